@@ -0,0 +1,117 @@
+#include "nanoemu.h"
+
+/* What the shell prints when it is ready for the next command. */
+#define BENCH_PROMPT    "$ "
+
+/* Longest a command may take before the run is abandoned, in seconds. */
+#define BENCH_TIMEOUT   600
+
+struct bench {
+    char* script;
+    struct bus* bus;
+    struct cpu** cpus;
+    int harts;
+};
+
+/* Counters sampled before and after each step. */
+struct bench_sample {
+    uint64_t ns;
+    uint64_t insts;
+    uint64_t disk_bytes;
+};
+
+static struct bench_sample
+bench_sample(struct bench* bench) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    struct bench_sample s = { (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec, 0, 0 };
+    for (int i = 0; i < bench->harts; i++) {
+        s.insts += __atomic_load_n(&bench->cpus[i]->instret, __ATOMIC_RELAXED);
+    }
+    s.disk_bytes = __atomic_load_n(&bench->bus->virtio->bytes_read, __ATOMIC_RELAXED)
+        + __atomic_load_n(&bench->bus->virtio->bytes_written, __ATOMIC_RELAXED);
+    return s;
+}
+
+/* Wait for the prompt, then report the step since `start` as a JSON object. */
+static bool
+bench_step(struct bench* bench, const char* name, struct bench_sample start) {
+    struct timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += BENCH_TIMEOUT;
+    bool done = uart_wait_expected(bench->bus->uart, &deadline);
+
+    struct bench_sample end = bench_sample(bench);
+    double seconds = (end.ns - start.ns) / 1e9;
+    uint64_t insts = end.insts - start.insts;
+    uint64_t bytes = end.disk_bytes - start.disk_bytes;
+    fprintf(stderr, "    {\"command\": \"");
+    for (const char* c = name; *c != '\0'; c++) {
+        if (*c == '"' || *c == '\\') {
+            fputc('\\', stderr);
+        }
+        fputc(*c, stderr);
+    }
+    fprintf(stderr, "\", \"seconds\": %.6f, \"insts\": %"PRIu64", \"mips\": %.2f, "
+        "\"disk_bytes\": %"PRIu64", \"disk_mb_s\": %.2f, \"done\": %s}",
+        seconds, insts, seconds > 0 ? insts / seconds / 1e6 : 0.0,
+        bytes, seconds > 0 ? bytes / seconds / 1e6 : 0.0,
+        done ? "true" : "false");
+    return done;
+}
+
+/*
+ * Boot to the shell prompt, then type each line of the script and wait for
+ * the prompt to come back. Every step is reported on stderr as one JSON
+ * document, the console output still goes to stdout. Exits when the script
+ * is done, or with status 1 if a step times out.
+ */
+static void*
+bench_thread(void* opaque) {
+    struct bench* bench = opaque;
+    struct uart* uart = bench->bus->uart;
+
+    fprintf(stderr, "{\n  \"steps\": [\n");
+    struct bench_sample first = bench_sample(bench);
+    bool ok = bench_step(bench, "boot", first);
+
+    char* save = NULL;
+    for (char* line = strtok_r(bench->script, "\n", &save); ok && line != NULL; line = strtok_r(NULL, "\n", &save)) {
+        if (line[0] == '#' || line[0] == '\0') {
+            continue;
+        }
+        fprintf(stderr, ",\n");
+        uart_expect(uart, BENCH_PROMPT);
+        struct bench_sample start = bench_sample(bench);
+        uart_send(uart, (const uint8_t*)line, strlen(line));
+        uart_send(uart, (const uint8_t*)"\n", 1);
+        ok = bench_step(bench, line, start);
+    }
+
+    struct bench_sample last = bench_sample(bench);
+    double seconds = (last.ns - first.ns) / 1e9;
+    fprintf(stderr, "\n  ],\n  \"seconds\": %.6f, \"insts\": %"PRIu64", \"mips\": %.2f, \"ok\": %s\n}\n",
+        seconds, last.insts - first.insts, seconds > 0 ? (last.insts - first.insts) / seconds / 1e6 : 0.0,
+        ok ? "true" : "false");
+    uart_flush(uart);
+    exit(ok ? 0 : 1);
+}
+
+/* Run the commands in the file at `path` in the background, see bench_thread(). */
+bool
+bench_start(const char* path, struct bus* bus, struct cpu** cpus, int harts) {
+    FILE* f = fopen(path, "rb");
+    if (f == NULL) {
+        return false;
+    }
+    struct bench* bench = calloc(1, sizeof *bench);
+    read_file(f, (uint8_t**)&bench->script);
+    bench->bus = bus;
+    bench->cpus = cpus;
+    bench->harts = harts;
+
+    /* The boot step ends at the first prompt. */
+    uart_expect(bus->uart, BENCH_PROMPT);
+    pthread_t tid;
+    return pthread_create(&tid, NULL, bench_thread, bench) == 0;
+}
@@ -0,0 +1,1073 @@
+#include "nanoemu.h"
+
+struct block_cache*
+block_cache_new() {
+    struct block_cache* cache = calloc(1, sizeof *cache);
+    cache->blocks = calloc(BLOCK_CACHE_SIZE, sizeof *cache->blocks);
+    return cache;
+}
+
+/*
+ * Micro-op handlers. They run with the PC already advanced past the
+ * instruction, exactly like cpu_execute.
+ */
+
+static enum exception
+op_generic(struct cpu* cpu, const struct uop* uop) {
+    cpu->inst_len = uop->len;
+    return cpu_execute(cpu, uop->inst);
+}
+
+static enum exception
+op_lui(struct cpu* cpu, const struct uop* uop) {
+    cpu->regs[uop->rd] = uop->imm;
+    return OK;
+}
+
+static enum exception
+op_auipc(struct cpu* cpu, const struct uop* uop) {
+    cpu->regs[uop->rd] = cpu->pc + uop->imm - uop->len;
+    return OK;
+}
+
+static enum exception
+op_addi(struct cpu* cpu, const struct uop* uop) {
+    cpu->regs[uop->rd] = cpu->regs[uop->rs1] + uop->imm;
+    return OK;
+}
+
+static enum exception
+op_slti(struct cpu* cpu, const struct uop* uop) {
+    cpu->regs[uop->rd] = (int64_t)cpu->regs[uop->rs1] < (int64_t)uop->imm ? 1 : 0;
+    return OK;
+}
+
+static enum exception
+op_sltiu(struct cpu* cpu, const struct uop* uop) {
+    cpu->regs[uop->rd] = cpu->regs[uop->rs1] < uop->imm ? 1 : 0;
+    return OK;
+}
+
+static enum exception
+op_xori(struct cpu* cpu, const struct uop* uop) {
+    cpu->regs[uop->rd] = cpu->regs[uop->rs1] ^ uop->imm;
+    return OK;
+}
+
+static enum exception
+op_ori(struct cpu* cpu, const struct uop* uop) {
+    cpu->regs[uop->rd] = cpu->regs[uop->rs1] | uop->imm;
+    return OK;
+}
+
+static enum exception
+op_andi(struct cpu* cpu, const struct uop* uop) {
+    cpu->regs[uop->rd] = cpu->regs[uop->rs1] & uop->imm;
+    return OK;
+}
+
+static enum exception
+op_slli(struct cpu* cpu, const struct uop* uop) {
+    cpu->regs[uop->rd] = cpu->regs[uop->rs1] << uop->imm;
+    return OK;
+}
+
+static enum exception
+op_srli(struct cpu* cpu, const struct uop* uop) {
+    cpu->regs[uop->rd] = cpu->regs[uop->rs1] >> uop->imm;
+    return OK;
+}
+
+static enum exception
+op_srai(struct cpu* cpu, const struct uop* uop) {
+    cpu->regs[uop->rd] = (int64_t)cpu->regs[uop->rs1] >> uop->imm;
+    return OK;
+}
+
+static enum exception
+op_addiw(struct cpu* cpu, const struct uop* uop) {
+    cpu->regs[uop->rd] = (int32_t)(cpu->regs[uop->rs1] + uop->imm);
+    return OK;
+}
+
+static enum exception
+op_slliw(struct cpu* cpu, const struct uop* uop) {
+    cpu->regs[uop->rd] = (int32_t)(cpu->regs[uop->rs1] << uop->imm);
+    return OK;
+}
+
+static enum exception
+op_srliw(struct cpu* cpu, const struct uop* uop) {
+    cpu->regs[uop->rd] = (int32_t)((uint32_t)cpu->regs[uop->rs1] >> uop->imm);
+    return OK;
+}
+
+static enum exception
+op_sraiw(struct cpu* cpu, const struct uop* uop) {
+    cpu->regs[uop->rd] = (int32_t)(cpu->regs[uop->rs1]) >> uop->imm;
+    return OK;
+}
+
+static enum exception
+op_add(struct cpu* cpu, const struct uop* uop) {
+    cpu->regs[uop->rd] = cpu->regs[uop->rs1] + cpu->regs[uop->rs2];
+    return OK;
+}
+
+static enum exception
+op_sub(struct cpu* cpu, const struct uop* uop) {
+    cpu->regs[uop->rd] = cpu->regs[uop->rs1] - cpu->regs[uop->rs2];
+    return OK;
+}
+
+static enum exception
+op_sll(struct cpu* cpu, const struct uop* uop) {
+    cpu->regs[uop->rd] = cpu->regs[uop->rs1] << (cpu->regs[uop->rs2] & 0x3f);
+    return OK;
+}
+
+static enum exception
+op_slt(struct cpu* cpu, const struct uop* uop) {
+    cpu->regs[uop->rd] = (int64_t)cpu->regs[uop->rs1] < (int64_t)cpu->regs[uop->rs2] ? 1 : 0;
+    return OK;
+}
+
+static enum exception
+op_sltu(struct cpu* cpu, const struct uop* uop) {
+    cpu->regs[uop->rd] = cpu->regs[uop->rs1] < cpu->regs[uop->rs2] ? 1 : 0;
+    return OK;
+}
+
+static enum exception
+op_xor(struct cpu* cpu, const struct uop* uop) {
+    cpu->regs[uop->rd] = cpu->regs[uop->rs1] ^ cpu->regs[uop->rs2];
+    return OK;
+}
+
+static enum exception
+op_srl(struct cpu* cpu, const struct uop* uop) {
+    cpu->regs[uop->rd] = cpu->regs[uop->rs1] >> (cpu->regs[uop->rs2] & 0x3f);
+    return OK;
+}
+
+static enum exception
+op_sra(struct cpu* cpu, const struct uop* uop) {
+    cpu->regs[uop->rd] = (int64_t)cpu->regs[uop->rs1] >> (cpu->regs[uop->rs2] & 0x3f);
+    return OK;
+}
+
+static enum exception
+op_or(struct cpu* cpu, const struct uop* uop) {
+    cpu->regs[uop->rd] = cpu->regs[uop->rs1] | cpu->regs[uop->rs2];
+    return OK;
+}
+
+static enum exception
+op_and(struct cpu* cpu, const struct uop* uop) {
+    cpu->regs[uop->rd] = cpu->regs[uop->rs1] & cpu->regs[uop->rs2];
+    return OK;
+}
+
+static enum exception
+op_addw(struct cpu* cpu, const struct uop* uop) {
+    cpu->regs[uop->rd] = (int32_t)(cpu->regs[uop->rs1] + cpu->regs[uop->rs2]);
+    return OK;
+}
+
+static enum exception
+op_subw(struct cpu* cpu, const struct uop* uop) {
+    cpu->regs[uop->rd] = (int32_t)(cpu->regs[uop->rs1] - cpu->regs[uop->rs2]);
+    return OK;
+}
+
+static enum exception
+op_sllw(struct cpu* cpu, const struct uop* uop) {
+    cpu->regs[uop->rd] = (int32_t)((uint32_t)cpu->regs[uop->rs1] << (cpu->regs[uop->rs2] & 0x1f));
+    return OK;
+}
+
+static enum exception
+op_srlw(struct cpu* cpu, const struct uop* uop) {
+    cpu->regs[uop->rd] = (int32_t)((uint32_t)cpu->regs[uop->rs1] >> (cpu->regs[uop->rs2] & 0x1f));
+    return OK;
+}
+
+static enum exception
+op_sraw(struct cpu* cpu, const struct uop* uop) {
+    cpu->regs[uop->rd] = (int32_t)cpu->regs[uop->rs1] >> (int32_t)(cpu->regs[uop->rs2] & 0x1f);
+    return OK;
+}
+
+static enum exception
+op_mul(struct cpu* cpu, const struct uop* uop) {
+    cpu->regs[uop->rd] = cpu->regs[uop->rs1] * cpu->regs[uop->rs2];
+    return OK;
+}
+
+static enum exception
+op_mulh(struct cpu* cpu, const struct uop* uop) {
+    cpu->regs[uop->rd] = alu_mulh(cpu->regs[uop->rs1], cpu->regs[uop->rs2]);
+    return OK;
+}
+
+static enum exception
+op_mulhsu(struct cpu* cpu, const struct uop* uop) {
+    cpu->regs[uop->rd] = alu_mulhsu(cpu->regs[uop->rs1], cpu->regs[uop->rs2]);
+    return OK;
+}
+
+static enum exception
+op_mulhu(struct cpu* cpu, const struct uop* uop) {
+    cpu->regs[uop->rd] = alu_mulhu(cpu->regs[uop->rs1], cpu->regs[uop->rs2]);
+    return OK;
+}
+
+static enum exception
+op_div(struct cpu* cpu, const struct uop* uop) {
+    cpu->regs[uop->rd] = alu_div(cpu->regs[uop->rs1], cpu->regs[uop->rs2]);
+    return OK;
+}
+
+static enum exception
+op_divu(struct cpu* cpu, const struct uop* uop) {
+    cpu->regs[uop->rd] = alu_divu(cpu->regs[uop->rs1], cpu->regs[uop->rs2]);
+    return OK;
+}
+
+static enum exception
+op_rem(struct cpu* cpu, const struct uop* uop) {
+    cpu->regs[uop->rd] = alu_rem(cpu->regs[uop->rs1], cpu->regs[uop->rs2]);
+    return OK;
+}
+
+static enum exception
+op_remu(struct cpu* cpu, const struct uop* uop) {
+    cpu->regs[uop->rd] = alu_remu(cpu->regs[uop->rs1], cpu->regs[uop->rs2]);
+    return OK;
+}
+
+static enum exception
+op_mulw(struct cpu* cpu, const struct uop* uop) {
+    cpu->regs[uop->rd] = (int32_t)(cpu->regs[uop->rs1] * cpu->regs[uop->rs2]);
+    return OK;
+}
+
+static enum exception
+op_divw(struct cpu* cpu, const struct uop* uop) {
+    cpu->regs[uop->rd] = alu_divw(cpu->regs[uop->rs1], cpu->regs[uop->rs2]);
+    return OK;
+}
+
+static enum exception
+op_divuw(struct cpu* cpu, const struct uop* uop) {
+    cpu->regs[uop->rd] = alu_divuw(cpu->regs[uop->rs1], cpu->regs[uop->rs2]);
+    return OK;
+}
+
+static enum exception
+op_remw(struct cpu* cpu, const struct uop* uop) {
+    cpu->regs[uop->rd] = alu_remw(cpu->regs[uop->rs1], cpu->regs[uop->rs2]);
+    return OK;
+}
+
+static enum exception
+op_remuw(struct cpu* cpu, const struct uop* uop) {
+    cpu->regs[uop->rd] = alu_remuw(cpu->regs[uop->rs1], cpu->regs[uop->rs2]);
+    return OK;
+}
+
+static enum exception
+op_sh1add(struct cpu* cpu, const struct uop* uop) {
+    cpu->regs[uop->rd] = (cpu->regs[uop->rs1] << 1) + cpu->regs[uop->rs2];
+    return OK;
+}
+
+static enum exception
+op_sh2add(struct cpu* cpu, const struct uop* uop) {
+    cpu->regs[uop->rd] = (cpu->regs[uop->rs1] << 2) + cpu->regs[uop->rs2];
+    return OK;
+}
+
+static enum exception
+op_sh3add(struct cpu* cpu, const struct uop* uop) {
+    cpu->regs[uop->rd] = (cpu->regs[uop->rs1] << 3) + cpu->regs[uop->rs2];
+    return OK;
+}
+
+static enum exception
+op_add_uw(struct cpu* cpu, const struct uop* uop) {
+    cpu->regs[uop->rd] = (uint64_t)(uint32_t)cpu->regs[uop->rs1] + cpu->regs[uop->rs2];
+    return OK;
+}
+
+static enum exception
+op_slli_uw(struct cpu* cpu, const struct uop* uop) {
+    cpu->regs[uop->rd] = (uint64_t)(uint32_t)cpu->regs[uop->rs1] << uop->imm;
+    return OK;
+}
+
+static enum exception
+op_andn(struct cpu* cpu, const struct uop* uop) {
+    cpu->regs[uop->rd] = cpu->regs[uop->rs1] & ~cpu->regs[uop->rs2];
+    return OK;
+}
+
+static enum exception
+op_orn(struct cpu* cpu, const struct uop* uop) {
+    cpu->regs[uop->rd] = cpu->regs[uop->rs1] | ~cpu->regs[uop->rs2];
+    return OK;
+}
+
+static enum exception
+op_xnor(struct cpu* cpu, const struct uop* uop) {
+    cpu->regs[uop->rd] = ~(cpu->regs[uop->rs1] ^ cpu->regs[uop->rs2]);
+    return OK;
+}
+
+static enum exception
+op_min(struct cpu* cpu, const struct uop* uop) {
+    cpu->regs[uop->rd] = (int64_t)cpu->regs[uop->rs1] < (int64_t)cpu->regs[uop->rs2] ? cpu->regs[uop->rs1] : cpu->regs[uop->rs2];
+    return OK;
+}
+
+static enum exception
+op_minu(struct cpu* cpu, const struct uop* uop) {
+    cpu->regs[uop->rd] = cpu->regs[uop->rs1] < cpu->regs[uop->rs2] ? cpu->regs[uop->rs1] : cpu->regs[uop->rs2];
+    return OK;
+}
+
+static enum exception
+op_max(struct cpu* cpu, const struct uop* uop) {
+    cpu->regs[uop->rd] = (int64_t)cpu->regs[uop->rs1] > (int64_t)cpu->regs[uop->rs2] ? cpu->regs[uop->rs1] : cpu->regs[uop->rs2];
+    return OK;
+}
+
+static enum exception
+op_maxu(struct cpu* cpu, const struct uop* uop) {
+    cpu->regs[uop->rd] = cpu->regs[uop->rs1] > cpu->regs[uop->rs2] ? cpu->regs[uop->rs1] : cpu->regs[uop->rs2];
+    return OK;
+}
+
+static enum exception
+op_rol(struct cpu* cpu, const struct uop* uop) {
+    cpu->regs[uop->rd] = alu_rol(cpu->regs[uop->rs1], cpu->regs[uop->rs2]);
+    return OK;
+}
+
+static enum exception
+op_ror(struct cpu* cpu, const struct uop* uop) {
+    cpu->regs[uop->rd] = alu_ror(cpu->regs[uop->rs1], cpu->regs[uop->rs2]);
+    return OK;
+}
+
+static enum exception
+op_rori(struct cpu* cpu, const struct uop* uop) {
+    cpu->regs[uop->rd] = alu_ror(cpu->regs[uop->rs1], uop->imm);
+    return OK;
+}
+
+static enum exception
+op_clz(struct cpu* cpu, const struct uop* uop) {
+    cpu->regs[uop->rd] = alu_clz(cpu->regs[uop->rs1]);
+    return OK;
+}
+
+static enum exception
+op_ctz(struct cpu* cpu, const struct uop* uop) {
+    cpu->regs[uop->rd] = alu_ctz(cpu->regs[uop->rs1]);
+    return OK;
+}
+
+static enum exception
+op_cpop(struct cpu* cpu, const struct uop* uop) {
+    cpu->regs[uop->rd] = __builtin_popcountll(cpu->regs[uop->rs1]);
+    return OK;
+}
+
+static enum exception
+op_sext_b(struct cpu* cpu, const struct uop* uop) {
+    cpu->regs[uop->rd] = (int8_t)cpu->regs[uop->rs1];
+    return OK;
+}
+
+static enum exception
+op_sext_h(struct cpu* cpu, const struct uop* uop) {
+    cpu->regs[uop->rd] = (int16_t)cpu->regs[uop->rs1];
+    return OK;
+}
+
+static enum exception
+op_zext_h(struct cpu* cpu, const struct uop* uop) {
+    cpu->regs[uop->rd] = (uint16_t)cpu->regs[uop->rs1];
+    return OK;
+}
+
+static enum exception
+op_rev8(struct cpu* cpu, const struct uop* uop) {
+    cpu->regs[uop->rd] = __builtin_bswap64(cpu->regs[uop->rs1]);
+    return OK;
+}
+
+static enum exception
+op_orc_b(struct cpu* cpu, const struct uop* uop) {
+    cpu->regs[uop->rd] = alu_orcb(cpu->regs[uop->rs1]);
+    return OK;
+}
+
+static enum exception
+op_bset(struct cpu* cpu, const struct uop* uop) {
+    cpu->regs[uop->rd] = cpu->regs[uop->rs1] | ((uint64_t)1 << (cpu->regs[uop->rs2] & 0x3f));
+    return OK;
+}
+
+static enum exception
+op_bclr(struct cpu* cpu, const struct uop* uop) {
+    cpu->regs[uop->rd] = cpu->regs[uop->rs1] & ~((uint64_t)1 << (cpu->regs[uop->rs2] & 0x3f));
+    return OK;
+}
+
+static enum exception
+op_binv(struct cpu* cpu, const struct uop* uop) {
+    cpu->regs[uop->rd] = cpu->regs[uop->rs1] ^ ((uint64_t)1 << (cpu->regs[uop->rs2] & 0x3f));
+    return OK;
+}
+
+static enum exception
+op_bext(struct cpu* cpu, const struct uop* uop) {
+    cpu->regs[uop->rd] = (cpu->regs[uop->rs1] >> (cpu->regs[uop->rs2] & 0x3f)) & 1;
+    return OK;
+}
+
+static enum exception
+op_bseti(struct cpu* cpu, const struct uop* uop) {
+    cpu->regs[uop->rd] = cpu->regs[uop->rs1] | ((uint64_t)1 << uop->imm);
+    return OK;
+}
+
+static enum exception
+op_bclri(struct cpu* cpu, const struct uop* uop) {
+    cpu->regs[uop->rd] = cpu->regs[uop->rs1] & ~((uint64_t)1 << uop->imm);
+    return OK;
+}
+
+static enum exception
+op_binvi(struct cpu* cpu, const struct uop* uop) {
+    cpu->regs[uop->rd] = cpu->regs[uop->rs1] ^ ((uint64_t)1 << uop->imm);
+    return OK;
+}
+
+static enum exception
+op_bexti(struct cpu* cpu, const struct uop* uop) {
+    cpu->regs[uop->rd] = (cpu->regs[uop->rs1] >> uop->imm) & 1;
+    return OK;
+}
+
+static enum exception
+op_lb(struct cpu* cpu, const struct uop* uop) {
+    uint64_t result;
+    enum exception exception;
+    if ((exception = cpu_load(cpu, cpu->regs[uop->rs1] + uop->imm, 8, &result)) != OK) {
+        return exception;
+    }
+    cpu->regs[uop->rd] = (int8_t)result;
+    return OK;
+}
+
+static enum exception
+op_lh(struct cpu* cpu, const struct uop* uop) {
+    uint64_t result;
+    enum exception exception;
+    if ((exception = cpu_load(cpu, cpu->regs[uop->rs1] + uop->imm, 16, &result)) != OK) {
+        return exception;
+    }
+    cpu->regs[uop->rd] = (int16_t)result;
+    return OK;
+}
+
+static enum exception
+op_lw(struct cpu* cpu, const struct uop* uop) {
+    uint64_t result;
+    enum exception exception;
+    if ((exception = cpu_load(cpu, cpu->regs[uop->rs1] + uop->imm, 32, &result)) != OK) {
+        return exception;
+    }
+    cpu->regs[uop->rd] = (int32_t)result;
+    return OK;
+}
+
+static enum exception
+op_ld(struct cpu* cpu, const struct uop* uop) {
+    uint64_t result;
+    enum exception exception;
+    if ((exception = cpu_load(cpu, cpu->regs[uop->rs1] + uop->imm, 64, &result)) != OK) {
+        return exception;
+    }
+    cpu->regs[uop->rd] = result;
+    return OK;
+}
+
+static enum exception
+op_lbu(struct cpu* cpu, const struct uop* uop) {
+    uint64_t result;
+    enum exception exception;
+    if ((exception = cpu_load(cpu, cpu->regs[uop->rs1] + uop->imm, 8, &result)) != OK) {
+        return exception;
+    }
+    cpu->regs[uop->rd] = result;
+    return OK;
+}
+
+static enum exception
+op_lhu(struct cpu* cpu, const struct uop* uop) {
+    uint64_t result;
+    enum exception exception;
+    if ((exception = cpu_load(cpu, cpu->regs[uop->rs1] + uop->imm, 16, &result)) != OK) {
+        return exception;
+    }
+    cpu->regs[uop->rd] = result;
+    return OK;
+}
+
+static enum exception
+op_lwu(struct cpu* cpu, const struct uop* uop) {
+    uint64_t result;
+    enum exception exception;
+    if ((exception = cpu_load(cpu, cpu->regs[uop->rs1] + uop->imm, 32, &result)) != OK) {
+        return exception;
+    }
+    cpu->regs[uop->rd] = result;
+    return OK;
+}
+
+static enum exception
+op_sb(struct cpu* cpu, const struct uop* uop) {
+    return cpu_store(cpu, cpu->regs[uop->rs1] + uop->imm, 8, cpu->regs[uop->rs2]);
+}
+
+static enum exception
+op_sh(struct cpu* cpu, const struct uop* uop) {
+    return cpu_store(cpu, cpu->regs[uop->rs1] + uop->imm, 16, cpu->regs[uop->rs2]);
+}
+
+static enum exception
+op_sw(struct cpu* cpu, const struct uop* uop) {
+    return cpu_store(cpu, cpu->regs[uop->rs1] + uop->imm, 32, cpu->regs[uop->rs2]);
+}
+
+static enum exception
+op_sd(struct cpu* cpu, const struct uop* uop) {
+    return cpu_store(cpu, cpu->regs[uop->rs1] + uop->imm, 64, cpu->regs[uop->rs2]);
+}
+
+static enum exception
+op_beq(struct cpu* cpu, const struct uop* uop) {
+    if (cpu->regs[uop->rs1] == cpu->regs[uop->rs2])
+        cpu->pc += uop->imm - uop->len;
+    return OK;
+}
+
+static enum exception
+op_bne(struct cpu* cpu, const struct uop* uop) {
+    if (cpu->regs[uop->rs1] != cpu->regs[uop->rs2])
+        cpu->pc += uop->imm - uop->len;
+    return OK;
+}
+
+static enum exception
+op_blt(struct cpu* cpu, const struct uop* uop) {
+    if ((int64_t)cpu->regs[uop->rs1] < (int64_t)cpu->regs[uop->rs2])
+        cpu->pc += uop->imm - uop->len;
+    return OK;
+}
+
+static enum exception
+op_bge(struct cpu* cpu, const struct uop* uop) {
+    if ((int64_t)cpu->regs[uop->rs1] >= (int64_t)cpu->regs[uop->rs2])
+        cpu->pc += uop->imm - uop->len;
+    return OK;
+}
+
+static enum exception
+op_bltu(struct cpu* cpu, const struct uop* uop) {
+    if (cpu->regs[uop->rs1] < cpu->regs[uop->rs2])
+        cpu->pc += uop->imm - uop->len;
+    return OK;
+}
+
+static enum exception
+op_bgeu(struct cpu* cpu, const struct uop* uop) {
+    if (cpu->regs[uop->rs1] >= cpu->regs[uop->rs2])
+        cpu->pc += uop->imm - uop->len;
+    return OK;
+}
+
+static enum exception
+op_jal(struct cpu* cpu, const struct uop* uop) {
+    cpu->regs[uop->rd] = cpu->pc;
+    cpu->pc += uop->imm - uop->len;
+    return OK;
+}
+
+static enum exception
+op_jalr(struct cpu* cpu, const struct uop* uop) {
+    uint64_t t = cpu->pc;
+    cpu->pc = (cpu->regs[uop->rs1] + uop->imm) & ~1;
+    cpu->regs[uop->rd] = t;
+    return OK;
+}
+
+#define UOP_HANDLER(name, store) op_##name,
+static const uop_handler uop_handlers[] = {
+    UOPS(UOP_HANDLER)
+};
+
+#define UOP_STORE(name, store) store,
+static const bool uop_stores[] = {
+    UOPS(UOP_STORE)
+};
+
+/*
+ * Decode `inst` into `uop`. Returns true if the instruction ends a block,
+ * i.e. it may change the PC, the privilege mode or the address space.
+ */
+static bool
+block_decode(struct uop* uop, uint32_t inst) {
+    uint64_t opcode = inst & 0x7f;
+    uint64_t funct3 = (inst >> 12) & 0x7;
+    uint64_t funct7 = (inst >> 25) & 0x7f;
+
+    uop->id = UOP_generic;
+    uop->rd = (inst >> 7) & 0x1f;
+    uop->rs1 = (inst >> 15) & 0x1f;
+    uop->rs2 = (inst >> 20) & 0x1f;
+    uop->inst = inst;
+    uop->imm = 0;
+
+    switch (opcode) {
+    case 0x03: {
+        static const uint8_t loads[8] = {
+            UOP_lb, UOP_lh, UOP_lw, UOP_ld, UOP_lbu, UOP_lhu, UOP_lwu, UOP_generic,
+        };
+        uop->id = loads[funct3];
+        uop->imm = (int32_t)inst >> 20;
+        return false;
+    }
+    case 0x13: {
+        uop->imm = (int32_t)(inst & 0xfff00000) >> 20;
+        switch (funct3) {
+        case 0x0: uop->id = UOP_addi; break;
+        case 0x1:
+            if ((funct7 >> 1) == 0x00) {
+                uop->id = UOP_slli;
+            } else if ((funct7 >> 1) == 0x0a) {
+                uop->id = UOP_bseti;
+            } else if ((funct7 >> 1) == 0x12) {
+                uop->id = UOP_bclri;
+            } else if ((funct7 >> 1) == 0x1a) {
+                uop->id = UOP_binvi;
+            } else if (funct7 == 0x30) {
+                static const uint8_t unary[8] = {
+                    UOP_clz, UOP_ctz, UOP_cpop, UOP_generic, UOP_sext_b, UOP_sext_h, UOP_generic, UOP_generic,
+                };
+                uop->id = uop->rs2 < 8 ? unary[uop->rs2] : UOP_generic;
+            }
+            uop->imm &= 0x3f;
+            break;
+        case 0x2: uop->id = UOP_slti; break;
+        case 0x3: uop->id = UOP_sltiu; break;
+        case 0x4: uop->id = UOP_xori; break;
+        case 0x5:
+            if ((funct7 >> 1) == 0x00) {
+                uop->id = UOP_srli;
+            } else if ((funct7 >> 1) == 0x10) {
+                uop->id = UOP_srai;
+            } else if ((funct7 >> 1) == 0x12) {
+                uop->id = UOP_bexti;
+            } else if ((funct7 >> 1) == 0x18) {
+                uop->id = UOP_rori;
+            } else if ((inst >> 20) == 0x287) {
+                uop->id = UOP_orc_b;
+            } else if ((inst >> 20) == 0x6b8) {
+                uop->id = UOP_rev8;
+            }
+            uop->imm &= 0x3f;
+            break;
+        case 0x6: uop->id = UOP_ori; break;
+        case 0x7: uop->id = UOP_andi; break;
+        }
+        return false;
+    }
+    case 0x17:
+        uop->id = UOP_auipc;
+        uop->imm = (int32_t)(inst & 0xfffff000);
+        return false;
+    case 0x1b: {
+        uop->imm = (int32_t)inst >> 20;
+        if (funct3 == 0x0) {
+            uop->id = UOP_addiw;
+        } else if (funct3 == 0x1 && funct7 == 0x00) {
+            uop->id = UOP_slliw;
+            uop->imm &= 0x1f;
+        } else if (funct3 == 0x1 && (funct7 >> 1) == 0x02) {
+            uop->id = UOP_slli_uw;
+            uop->imm &= 0x3f;
+        } else if (funct3 == 0x5 && funct7 == 0x00) {
+            uop->id = UOP_srliw;
+            uop->imm &= 0x1f;
+        } else if (funct3 == 0x5 && funct7 == 0x20) {
+            uop->id = UOP_sraiw;
+            uop->imm &= 0x1f;
+        }
+        return false;
+    }
+    case 0x23: {
+        static const uint8_t stores[8] = {
+            UOP_sb, UOP_sh, UOP_sw, UOP_sd, UOP_generic, UOP_generic, UOP_generic, UOP_generic,
+        };
+        uop->id = stores[funct3];
+        uop->imm = (uint64_t)((int32_t)(inst & 0xfe000000) >> 20) | ((inst >> 7) & 0x1f);
+        return false;
+    }
+    case 0x2f:
+        return false;
+    /* Floating point and vectors stay generic, fpu_execute() and vector_execute() run them. */
+    case 0x07:
+    case 0x27:
+    case 0x43:
+    case 0x47:
+    case 0x4b:
+    case 0x4f:
+    case 0x53:
+    case 0x57:
+        return false;
+    case 0x33: {
+        if (funct7 == 0x00) {
+            static const uint8_t ops[8] = {
+                UOP_add, UOP_sll, UOP_slt, UOP_sltu, UOP_xor, UOP_srl, UOP_or, UOP_and,
+            };
+            uop->id = ops[funct3];
+        } else if (funct7 == 0x20) {
+            static const uint8_t ops[8] = {
+                UOP_sub, UOP_generic, UOP_generic, UOP_generic, UOP_xnor, UOP_sra, UOP_orn, UOP_andn,
+            };
+            uop->id = ops[funct3];
+        } else if (funct7 == 0x01) {
+            static const uint8_t ops[8] = {
+                UOP_mul, UOP_mulh, UOP_mulhsu, UOP_mulhu, UOP_div, UOP_divu, UOP_rem, UOP_remu,
+            };
+            uop->id = ops[funct3];
+        } else if (funct7 == 0x05) {
+            static const uint8_t ops[8] = {
+                UOP_generic, UOP_generic, UOP_generic, UOP_generic, UOP_min, UOP_minu, UOP_max, UOP_maxu,
+            };
+            uop->id = ops[funct3];
+        } else if (funct7 == 0x10) {
+            static const uint8_t ops[8] = {
+                UOP_generic, UOP_generic, UOP_sh1add, UOP_generic, UOP_sh2add, UOP_generic, UOP_sh3add, UOP_generic,
+            };
+            uop->id = ops[funct3];
+        } else if (funct7 == 0x30 && funct3 == 0x1) {
+            uop->id = UOP_rol;
+        } else if (funct7 == 0x30 && funct3 == 0x5) {
+            uop->id = UOP_ror;
+        } else if (funct7 == 0x14 && funct3 == 0x1) {
+            uop->id = UOP_bset;
+        } else if (funct7 == 0x24 && funct3 == 0x1) {
+            uop->id = UOP_bclr;
+        } else if (funct7 == 0x34 && funct3 == 0x1) {
+            uop->id = UOP_binv;
+        } else if (funct7 == 0x24 && funct3 == 0x5) {
+            uop->id = UOP_bext;
+        }
+        return false;
+    }
+    case 0x37:
+        uop->id = UOP_lui;
+        uop->imm = (int32_t)(inst & 0xfffff000);
+        return false;
+    case 0x3b: {
+        if (funct3 == 0x0 && funct7 == 0x00) {
+            uop->id = UOP_addw;
+        } else if (funct3 == 0x0 && funct7 == 0x20) {
+            uop->id = UOP_subw;
+        } else if (funct3 == 0x1 && funct7 == 0x00) {
+            uop->id = UOP_sllw;
+        } else if (funct3 == 0x5 && funct7 == 0x00) {
+            uop->id = UOP_srlw;
+        } else if (funct3 == 0x5 && funct7 == 0x20) {
+            uop->id = UOP_sraw;
+        } else if (funct7 == 0x01) {
+            static const uint8_t ops[8] = {
+                UOP_mulw, UOP_generic, UOP_generic, UOP_generic, UOP_divw, UOP_divuw, UOP_remw, UOP_remuw,
+            };
+            uop->id = ops[funct3];
+        } else if (funct3 == 0x0 && funct7 == 0x04) {
+            uop->id = UOP_add_uw;
+        } else if (funct3 == 0x4 && funct7 == 0x04 && uop->rs2 == 0) {
+            uop->id = UOP_zext_h;
+        }
+        return false;
+    }
+    case 0x63: {
+        static const uint8_t branches[8] = {
+            UOP_beq, UOP_bne, UOP_generic, UOP_generic, UOP_blt, UOP_bge, UOP_bltu, UOP_bgeu,
+        };
+        uop->id = branches[funct3];
+        uop->imm = (uint64_t)((int32_t)(inst & 0x80000000) >> 19)
+            | ((inst & 0x80) << 4)
+            | ((inst >> 20) & 0x7e0)
+            | ((inst >> 7) & 0x1e);
+        return true;
+    }
+    case 0x67:
+        uop->id = UOP_jalr;
+        uop->imm = (int32_t)(inst & 0xfff00000) >> 20;
+        return true;
+    case 0x6f:
+        uop->id = UOP_jal;
+        uop->imm = (uint64_t)((int32_t)(inst & 0x80000000) >> 11)
+            | (inst & 0xff000)
+            | ((inst >> 9) & 0x800)
+            | ((inst >> 20) & 0x7fe);
+        return true;
+    case 0x0f:
+    case 0x73:
+        return true;
+    default:
+        /* Leave it to cpu_execute to raise the illegal instruction. */
+        return true;
+    }
+}
+
+/*
+ * Decode the straight-line run starting at `paddr`, never crossing a page.
+ * A 32-bit instruction that straddles the end of the page is left out, the
+ * single-instruction path in cpu_run_block() runs it.
+ */
+static void
+block_fill(struct block* block, struct dram* dram, uint64_t paddr) {
+    /*
+     * The generation is taken before the code is read: a store that bumps
+     * it from here on, on any thread, retires the block.
+     */
+    uint32_t* gen = &dram->code_gen[(paddr - DRAM_BASE) / PAGE_SIZE];
+    block->paddr = paddr;
+    block->code_gen = __atomic_fetch_or(gen, 1, __ATOMIC_ACQ_REL) | 1;
+    block->len = 0;
+
+    uint64_t end = (paddr & ~(uint64_t)(PAGE_SIZE - 1)) + PAGE_SIZE;
+    uint64_t addr = paddr;
+    while (addr + 2 <= end && block->len < BLOCK_MAX_INSTS) {
+        uint32_t inst = host_load(dram_host(dram, addr, 16), 16);
+        uint8_t len = 2;
+        if ((inst & 0x3) != 0x3) {
+            inst = rvc_table[inst];
+        } else if (addr + 4 <= end) {
+            inst = host_load(dram_host(dram, addr, 32), 32);
+            len = 4;
+        } else {
+            break;
+        }
+        addr += len;
+        struct uop* uop = &block->uops[block->len++];
+        bool last = block_decode(uop, inst);
+        uop->len = len;
+        uop->handler = uop_handlers[uop->id];
+        uop->store = uop_stores[uop->id];
+        if (last) {
+            break;
+        }
+    }
+    block->uops[block->len].id = UOP_end;
+    block->code = NULL;
+    block->jit_len = 0;
+    block->runs = 0;
+}
+
+#ifndef THREADED_DISPATCH
+
+/* Call-threaded execution: one indirect call per micro-op. */
+static enum exception
+block_exec(struct cpu* cpu, struct block* block, uint32_t* gen, int start) {
+    enum exception exception;
+    for (int i = start; i < block->len; i++) {
+        const struct uop* uop = &block->uops[i];
+        /* The x0 register is always zero. */
+        cpu->regs[0] = 0;
+        cpu->pc += uop->len;
+        if ((exception = uop->handler(cpu, uop)) != OK) {
+            return exception;
+        }
+        /* Stop if the block has just overwritten its own code. */
+        if (uop->store && block->code_gen != __atomic_load_n(gen, __ATOMIC_ACQUIRE)) {
+            break;
+        }
+    }
+    cpu->regs[0] = 0;
+    return OK;
+}
+
+#else
+
+/*
+ * Direct-threaded execution: every micro-op body ends in its own indirect
+ * jump to the next one, so the host predicts each transition separately.
+ * Compilers without labels as values get an equivalent switch loop.
+ */
+#if defined(__GNUC__) && !defined(NO_COMPUTED_GOTO)
+#define UOP_LABEL(name) label_##name
+#define UOP_DISPATCH() goto *labels[uop->id]
+#define UOP_SWITCH_BEGIN() UOP_DISPATCH();
+#define UOP_SWITCH_END()
+#else
+#define UOP_LABEL(name) case UOP_##name
+#define UOP_DISPATCH() continue
+#define UOP_SWITCH_BEGIN() for (;;) switch (uop->id) {
+#define UOP_SWITCH_END() }
+#endif
+
+#define UOP_BODY(name, store) \
+    UOP_LABEL(name): \
+        cpu->regs[0] = 0; \
+        cpu->pc += uop->len; \
+        if ((exception = op_##name(cpu, uop)) != OK) { \
+            return exception; \
+        } \
+        if (store && block->code_gen != __atomic_load_n(gen, __ATOMIC_ACQUIRE)) { \
+            cpu->regs[0] = 0; \
+            return OK; \
+        } \
+        uop++; \
+        UOP_DISPATCH();
+
+#if defined(__GNUC__) && !defined(NO_COMPUTED_GOTO)
+/* Labels as values are an extension, but this file opts in on purpose. */
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpedantic"
+#endif
+
+static enum exception
+block_exec(struct cpu* cpu, struct block* block, uint32_t* gen, int start) {
+#if defined(__GNUC__) && !defined(NO_COMPUTED_GOTO)
+#define UOP_ADDRESS(name, store) &&label_##name,
+    static void* const labels[] = {
+        UOPS(UOP_ADDRESS)
+        &&label_end,
+    };
+#endif
+    enum exception exception;
+    const struct uop* uop = &block->uops[start];
+
+    UOP_SWITCH_BEGIN()
+    UOPS(UOP_BODY)
+    UOP_LABEL(end):
+        cpu->regs[0] = 0;
+        return OK;
+    UOP_SWITCH_END()
+}
+
+#if defined(__GNUC__) && !defined(NO_COMPUTED_GOTO)
+#pragma GCC diagnostic pop
+#endif
+
+#endif
+
+/* Number of micro-ops of `block` that start within its first `offset` bytes. */
+static int
+block_count(const struct block* block, uint64_t offset) {
+    int n = 0;
+    for (uint64_t at = 0; n < block->len && at < offset; n++) {
+        at += block->uops[n].len;
+    }
+    return n;
+}
+
+/* Whether the instruction at the PC is a 32-bit one that runs into the next page. */
+static bool
+cpu_fetch_straddles(struct cpu* cpu) {
+    uint64_t offset = cpu->pc & (PAGE_SIZE - 1);
+    return offset == PAGE_SIZE - 2 && (host_load(cpu->fetch_host + offset, 16) & 0x3) == 0x3;
+}
+
+/*
+ * Execute the block starting at the current PC, decoding it first if it is
+ * not cached. Code outside DRAM, and instructions that straddle a page, are
+ * executed one instruction at a time.
+ */
+enum exception
+cpu_run_block(struct cpu* cpu) {
+    enum exception exception;
+    if ((exception = cpu_fetch_page(cpu)) != OK) {
+        /* Nothing was executed, the trap records the PC itself. */
+        cpu->inst_len = 0;
+        return exception;
+    }
+
+    uint64_t ppc = cpu->fetch_ppage | (cpu->pc & (PAGE_SIZE - 1));
+    if (cpu->fetch_host == NULL || cpu_fetch_straddles(cpu)) {
+        uint64_t inst;
+        cpu->block_len = 1;
+        if ((exception = cpu_fetch(cpu, &inst)) != OK) {
+            cpu->inst_len = 0;
+            return exception;
+        }
+        if ((inst & 0x3) != 0x3) {
+            inst = rvc_table[inst & 0xffff];
+            cpu->inst_len = 2;
+        } else {
+            cpu->inst_len = 4;
+        }
+        cpu->pc += cpu->inst_len;
+        cpu->regs[0] = 0;
+        if ((exception = cpu_execute(cpu, inst)) == OK) {
+            cpu->instret += 1;
+        }
+        return exception;
+    }
+
+    struct block_cache* cache = cpu->blocks;
+    struct block* block = &cache->blocks[(ppc / 2) & (BLOCK_CACHE_SIZE - 1)];
+    uint32_t* gen = &cpu->bus->dram->code_gen[(ppc - DRAM_BASE) / PAGE_SIZE];
+    if (block->paddr == ppc && block->code_gen == __atomic_load_n(gen, __ATOMIC_ACQUIRE)) {
+        cache->hits += 1;
+    } else {
+        cache->misses += 1;
+        block_fill(block, cpu->bus->dram, ppc);
+    }
+    cpu->block_len = block->len;
+
+    int start = 0;
+    uint64_t vpc = cpu->pc;
+    exception = OK;
+    if (cpu->jit != NULL) {
+        if (block->code == NULL && ++block->runs == JIT_THRESHOLD) {
+            jit_compile(cpu->jit, cpu, block);
+        }
+        if (block->code != NULL) {
+            cpu->regs[0] = 0;
+            exception = jit_run(block, cpu);
+            /* The interpreter finishes what could not be translated. */
+            start = block->jit_len;
+        }
+    }
+    if (exception == OK && block->code_gen == __atomic_load_n(gen, __ATOMIC_ACQUIRE)) {
+        exception = block_exec(cpu, block, gen, start);
+    }
+    if (exception == OK && block->code_gen == __atomic_load_n(gen, __ATOMIC_ACQUIRE)) {
+        cpu->instret += block->len;
+        return OK;
+    }
+
+    /*
+     * Only the last micro-op of a block can jump, so a block that stops
+     * early has run a straight line up to the PC. A faulting instruction
+     * does not retire.
+     */
+    int ran = block_count(block, cpu->pc - vpc);
+    if (exception != OK && ran > 0) {
+        ran -= 1;
+        cpu->inst_len = block->uops[ran].len;
+    }
+    cpu->instret += ran;
+    return exception;
+}
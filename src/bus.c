@@ -1,134 +1,261 @@
 #include "nanoemu.h"
 
 struct bus*
-bus_new(struct dram* dram, struct virtio* virtio) {
+bus_new(struct dram* dram, struct timer* timer, struct virtio* virtio) {
     struct bus* bus = calloc(1, sizeof *bus);
     bus->dram = dram;
+    bus->timer = timer;
     bus->virtio = virtio;
-    bus->clint = clint_new();
-    bus->plic = plic_new();
-    bus->uart = uart_new();
+
+    /* Idle harts sleep with deadlines taken from the monotonic clock. */
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_mutex_init(&bus->irq.lock, NULL);
+    pthread_cond_init(&bus->irq.cond, &attr);
+    timer->irq = &bus->irq;
+
+    bus->clint = clint_new(timer, &bus->irq);
+    bus->plic = plic_new(&bus->irq);
+    bus->uart = uart_new(&bus->irq);
+
+    pthread_create(&virtio->tid, NULL, bus_disk_thread, (void*)bus);
     return bus;
 }
 
+static void
+bus_count(struct bus* bus, enum bus_device device) {
+    __atomic_fetch_add(&bus->mmio[device], 1, __ATOMIC_RELAXED);
+}
+
 enum exception
 bus_load(struct bus* bus, uint64_t addr, uint64_t size, uint64_t *result) {
+    if (DRAM_BASE <= addr) {
+        return dram_load(bus->dram, addr, size, result);
+    }
     if (CLINT_BASE <= addr && addr < CLINT_BASE + CLINT_SIZE) {
+        bus_count(bus, BUS_CLINT);
         return clint_load(bus->clint, addr, size, result);
     }
     if (PLIC_BASE <= addr && addr < PLIC_BASE + PLIC_SIZE) {
+        bus_count(bus, BUS_PLIC);
         return plic_load(bus->plic, addr, size, result);
     }
     if (UART_BASE <= addr && addr < UART_BASE + UART_SIZE) {
+        bus_count(bus, BUS_UART);
         return uart_load(bus->uart, addr, size, result);
     }
     if (VIRTIO_BASE <= addr && addr < VIRTIO_BASE + VIRTIO_SIZE) {
+        bus_count(bus, BUS_VIRTIO);
         return virtio_load(bus->virtio, addr, size, result);
     }
-    if (DRAM_BASE <= addr) {
-        return dram_load(bus->dram, addr, size, result);
-    }
 
     return LOAD_ACCESS_FAULT;
 }
 
 enum exception
 bus_store(struct bus* bus, uint64_t addr, uint64_t size, uint64_t value) {
+    if (DRAM_BASE <= addr) {
+        return dram_store(bus->dram, addr, size, value);
+    }
     if (CLINT_BASE <= addr && addr < CLINT_BASE + CLINT_SIZE) {
+        bus_count(bus, BUS_CLINT);
         return clint_store(bus->clint, addr, size, value);
     }
     if (PLIC_BASE <= addr && addr < PLIC_BASE + PLIC_SIZE) {
+        bus_count(bus, BUS_PLIC);
         return plic_store(bus->plic, addr, size, value);
     }
     if (UART_BASE <= addr && addr < UART_BASE + UART_SIZE) {
+        bus_count(bus, BUS_UART);
         return uart_store(bus->uart, addr, size, value);
     }
     if (VIRTIO_BASE <= addr && addr < VIRTIO_BASE + VIRTIO_SIZE) {
+        bus_count(bus, BUS_VIRTIO);
         return virtio_store(bus->virtio, addr, size, value);
     }
-    if (DRAM_BASE <= addr) {
-        return dram_store(bus->dram, addr, size, value);
-    }
 
     return STORE_AMO_ACCESS_FAULT;
 }
 
-void
-bus_disk_access(struct bus* bus) {
-    uint64_t desc_addr = virtio_desc_addr(bus->virtio);
-    uint64_t avail_addr = desc_addr + 0x40;
-    uint64_t used_addr = desc_addr + 4096;
-
-    uint64_t offset;
-    if (bus_load(bus, avail_addr + 1, 16, &offset) != OK) {
-        printf("ERROR: failed to read offset.\n");
-        exit(1);
-    }
-
-    uint64_t index;
-    if (bus_load(bus, avail_addr + (offset % VIRTIO_DESC_NUM) + 2, 16, &index) != OK) {
-        printf("ERROR: failed to read index.\n");
-        exit(1);
-    }
-
-    uint64_t desc_addr0 = desc_addr + VIRTIO_VRING_DESC_SIZE * index;
-    uint64_t addr0;
-    if (bus_load(bus, desc_addr0, 64, &addr0) != OK) {
-        printf("ERROR: failed to read address field in descriptor.\n");
-        exit(1);
-    }
-    uint64_t next0;
-    if (bus_load(bus, desc_addr0 + 14, 16, &next0) != OK) {
-        printf("ERROR: failed to read next field in descriptor.\n");
-        exit(1);
-    }
-    uint64_t desc_addr1 = desc_addr + VIRTIO_VRING_DESC_SIZE * next0;
-    uint64_t addr1;
-    if (bus_load(bus, desc_addr1, 64, &addr1) != OK) {
-        printf("ERROR: failed to read address field in descriptor.\n");
-        exit(1);
-    }
-    uint64_t len1;
-    if (bus_load(bus, desc_addr1 + 8, 32, &len1) != OK) {
-        printf("ERROR: failed to read length field in descriptor.\n");
-        exit(1);
-    }
-    uint64_t flags1;
-    if (bus_load(bus, desc_addr1 + 12, 16, &flags1) != OK) {
-        printf("ERROR: failed to read flags field in descriptor.\n");
-        exit(1);
-    }
-
-    uint64_t blk_sector;
-    if (bus_load(bus, addr0 + 8, 64, &blk_sector) != OK) {
-        printf("ERROR: failed to read sector field in virtio_blk_outhdr.\n");
-        exit(1);
-    }
-
-    if ((flags1 & 2) == 0) {
-        /* Read dram data and write it to a disk directly (DMA). */
-        for (uint64_t i = 0; i < len1; i++) {
-            uint64_t data;
-            if (bus_load(bus, addr1 + i, 8, &data) != OK) {
-                printf("ERROR: failed to read from dram.\n");
-                exit(1);
-            }
-            virtio_disk_write(bus->virtio, blk_sector * 512 + i, data);
+struct virtq_desc {
+    uint64_t addr;
+    uint32_t len;
+    uint16_t flags;
+    uint16_t next;
+};
+
+/* Read descriptor `index` of `queue`. */
+static bool
+bus_read_desc(struct bus* bus, const struct virtq* queue, uint64_t index, struct virtq_desc* desc) {
+    if (index >= queue->num) {
+        return false;
+    }
+    uint8_t* p = dram_range(bus->dram, queue->desc + VIRTIO_VRING_DESC_SIZE * index, VIRTIO_VRING_DESC_SIZE);
+    if (p == NULL) {
+        return false;
+    }
+    desc->addr = host_load(p, 64);
+    desc->len = host_load(p + 8, 32);
+    desc->flags = host_load(p + 12, 16);
+    desc->next = host_load(p + 14, 16);
+    return true;
+}
+
+/*
+ * Move one data buffer of a request between DRAM and the disk. The buffer
+ * is checked against DRAM once and copied in one go.
+ */
+static uint8_t
+bus_disk_dma(struct bus* bus, uint64_t type, uint64_t offset, const struct virtq_desc* data) {
+    uint8_t* host = dram_range(bus->dram, data->addr, data->len);
+    if (host == NULL) {
+        return VIRTIO_BLK_S_IOERR;
+    }
+    if (type == VIRTIO_BLK_T_IN) {
+        if (!(data->flags & VIRTQ_DESC_F_WRITE) || !virtio_disk_read(bus->virtio, offset, host, data->len)) {
+            return VIRTIO_BLK_S_IOERR;
+        }
+        if (data->len != 0) {
+            dram_invalidate_code_range(bus->dram, data->addr, data->len);
         }
     } else {
-        /* Read disk data and write it to dram directly (DMA). */
-        for (uint64_t i = 0; i < len1; i++) {
-            uint64_t data = virtio_disk_read(bus->virtio, blk_sector * 512 + i);
-            if (bus_store(bus, addr1 +i, 8, data) != OK) {
-                printf("ERROR: failed to write to dram.\n");
-                exit(1);
+        if ((data->flags & VIRTQ_DESC_F_WRITE) || !virtio_disk_write(bus->virtio, offset, host, data->len)) {
+            return VIRTIO_BLK_S_IOERR;
+        }
+    }
+    return VIRTIO_BLK_S_OK;
+}
+
+/*
+ * Serve the request whose descriptor chain starts at `head`: a header, any
+ * number of data buffers and a status byte. Errors are reported to the
+ * driver in the status byte. Returns the number of bytes written to guest
+ * memory, for the used ring.
+ */
+static uint32_t
+bus_disk_request(struct bus* bus, const struct virtq* queue, uint64_t head) {
+    struct virtq_desc desc;
+    if (!bus_read_desc(bus, queue, head, &desc)) {
+        return 0;
+    }
+
+    uint8_t* header = dram_range(bus->dram, desc.addr, 16);
+    uint64_t type = header != NULL ? host_load(header, 32) : -1;
+    uint64_t offset = header != NULL ? host_load(header + 8, 64) * VIRTIO_SECTOR_SIZE : 0;
+    uint8_t result = header != NULL ? VIRTIO_BLK_S_OK : VIRTIO_BLK_S_IOERR;
+    if (type != VIRTIO_BLK_T_IN && type != VIRTIO_BLK_T_OUT && type != VIRTIO_BLK_T_FLUSH && header != NULL) {
+        result = VIRTIO_BLK_S_UNSUPP;
+    }
+
+    uint32_t written = 0;
+    /* A chain can't be longer than the queue, anything else is a loop. */
+    for (uint64_t i = 0; i < queue->num && (desc.flags & VIRTQ_DESC_F_NEXT); i++) {
+        if (!bus_read_desc(bus, queue, desc.next, &desc)) {
+            return written;
+        }
+        if (!(desc.flags & VIRTQ_DESC_F_NEXT)) {
+            /* The write-back is done by the time the flush completes. */
+            if (type == VIRTIO_BLK_T_FLUSH && result == VIRTIO_BLK_S_OK && !virtio_flush(bus->virtio)) {
+                result = VIRTIO_BLK_S_IOERR;
+            }
+            /* The last descriptor holds the status byte. */
+            uint8_t* status = dram_range(bus->dram, desc.addr, 1);
+            if (status != NULL && (desc.flags & VIRTQ_DESC_F_WRITE)) {
+                *status = result;
+                written += 1;
             }
+            return written;
+        }
+        if (result == VIRTIO_BLK_S_OK && type != VIRTIO_BLK_T_FLUSH) {
+            result = bus_disk_dma(bus, type, offset, &desc);
+            offset += desc.len;
+            if (type == VIRTIO_BLK_T_IN && result == VIRTIO_BLK_S_OK) {
+                written += desc.len;
+            }
+        }
+    }
+    return written;
+}
+
+/*
+ * Serve every request in the available ring, on the I/O thread. Returns
+ * true if the driver wants an interrupt for the completed requests.
+ */
+bool
+bus_disk_access(struct bus* bus) {
+    struct virtio* virtio = bus->virtio;
+    struct virtq queue;
+    if (!virtio_queue(virtio, &queue)) {
+        return false;
+    }
+
+    uint8_t* avail = dram_range(bus->dram, queue.avail, 6 + 2 * queue.num);
+    uint8_t* used = dram_range(bus->dram, queue.used, 6 + 8 * queue.num);
+    if (avail == NULL || used == NULL) {
+        /* The driver never set up the queue in RAM, there is nothing to serve. */
+        return false;
+    }
+
+    /*
+     * Drain the available ring, including requests the driver adds while
+     * the previous ones are being served, so that a burst of requests costs
+     * a single interrupt. With VIRTIO_F_EVENT_IDX, the driver is told how
+     * far the device has got, so that it only notifies again for requests
+     * past that point.
+     */
+    uint16_t old_used = virtio->used_idx;
+    uint16_t avail_idx = host_load(avail + 2, 16);
+    while (virtio->last_avail != avail_idx) {
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        while (virtio->last_avail != avail_idx) {
+            uint64_t head = host_load(avail + 4 + 2 * (virtio->last_avail % queue.num), 16);
+            virtio->last_avail += 1;
+
+            uint32_t written = bus_disk_request(bus, &queue, head);
+
+            uint8_t* elem = used + 4 + 8 * (virtio->used_idx % queue.num);
+            host_store(elem, 32, head);
+            host_store(elem + 4, 32, written);
+            virtio->used_idx += 1;
+            __atomic_thread_fence(__ATOMIC_RELEASE);
+            host_store(used + 2, 16, virtio->used_idx);
+        }
+
+        if (queue.event_idx) {
+            host_store(used + 4 + 8 * queue.num, 16, virtio->last_avail);
         }
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        avail_idx = host_load(avail + 2, 16);
     }
 
-    uint64_t new_id = virtio_new_id(bus->virtio);
-    if (bus_store(bus, used_addr + 2, 16, new_id % 8) != OK) {
-        printf("ERROR: failed to write to dram.\n");
-        exit(1);
+    if (virtio->used_idx == old_used) {
+        return false;
+    }
+    if (queue.event_idx) {
+        /* Interrupt only if the used index went past the driver's used_event. */
+        uint16_t used_event = host_load(avail + 4 + 2 * queue.num, 16);
+        return (uint16_t)(virtio->used_idx - used_event - 1) < (uint16_t)(virtio->used_idx - old_used);
     }
+    return !(host_load(avail, 16) & VIRTQ_AVAIL_F_NO_INTERRUPT);
+}
+
+/*
+ * Disk requests are served off the harts' threads: harts keep running
+ * while the transfer waits on the host, and only see the interrupt once
+ * the requests are in the used ring.
+ */
+void*
+bus_disk_thread(void* opaque) {
+    struct bus* bus = opaque;
+    while (1) {
+        virtio_wait_notify(bus->virtio);
+        if (bus_disk_access(bus)) {
+            virtio_complete(bus->virtio);
+            irq_notify(&bus->irq, ALL_HARTS);
+        }
+    }
+
+    /* Unreachable. */
+    return NULL;
 }
@@ -1,21 +1,57 @@
 #include "nanoemu.h"
 
 struct clint*
-clint_new() {
+clint_new(struct timer* timer, struct irq* irq) {
     struct clint* clint = calloc(1, sizeof *clint);
+    clint->timer = timer;
+    clint->irq = irq;
+    for (int i = 0; i < MAX_HARTS; i++) {
+        clint->mtimecmp[i] = UINT64_MAX;
+    }
     return clint;
 }
 
+/* Timer event: raise the timer interrupt of `hart` if its mtimecmp still says so. */
+static void
+clint_timer_fire(void* opaque, uint64_t hart) {
+    struct clint* clint = opaque;
+    if (timer_now(clint->timer) >= __atomic_load_n(&clint->mtimecmp[hart], __ATOMIC_RELAXED)) {
+        __atomic_or_fetch(&clint->mtip, (uint64_t)1 << hart, __ATOMIC_SEQ_CST);
+        irq_notify(clint->irq, (uint64_t)1 << hart);
+    }
+}
+
+/*
+ * Writing mtimecmp clears the hart's timer interrupt and schedules the next
+ * one, which fires once mtime catches up.
+ */
+void
+clint_set_mtimecmp(struct clint* clint, uint64_t hart, uint64_t value) {
+    __atomic_store_n(&clint->mtimecmp[hart], value, __ATOMIC_RELAXED);
+    __atomic_and_fetch(&clint->mtip, ~((uint64_t)1 << hart), __ATOMIC_SEQ_CST);
+    irq_notify(clint->irq, (uint64_t)1 << hart);
+    timer_schedule(clint->timer, value, clint_timer_fire, clint, hart);
+}
+
 enum exception
 clint_load(struct clint* clint, uint64_t addr, uint64_t size, uint64_t *result) {
+    if (CLINT_MSIP <= addr && addr < CLINT_MSIP_HART(MAX_HARTS)) {
+        if (size != 32 || addr % 4 != 0) {
+            return LOAD_ACCESS_FAULT;
+        }
+        *result = clint->msip[(addr - CLINT_MSIP) / 4];
+        return OK;
+    }
+
     switch (size) {
     case 64:
+        if (CLINT_MTIMECMP <= addr && addr < CLINT_MTIMECMP_HART(MAX_HARTS)) {
+            *result = addr % 8 == 0 ? clint->mtimecmp[(addr - CLINT_MTIMECMP) / 8] : 0;
+            return OK;
+        }
         switch (addr) {
-        case CLINT_MTIMECMP:
-            *result = clint->mtimecmp;
-            break;
         case CLINT_MTIME:
-            *result = clint->mtime;
+            *result = timer_now(clint->timer);
             break;
         default: *result = 0;
         }
@@ -27,14 +63,31 @@ clint_load(struct clint* clint, uint64_t addr, uint64_t size, uint64_t *result)
 
 enum exception
 clint_store(struct clint* clint, uint64_t addr, uint64_t size, uint64_t value) {
+    if (CLINT_MSIP <= addr && addr < CLINT_MSIP_HART(MAX_HARTS)) {
+        if (size != 32 || addr % 4 != 0) {
+            return STORE_AMO_ACCESS_FAULT;
+        }
+        uint64_t hart = (addr - CLINT_MSIP) / 4;
+        __atomic_store_n(&clint->msip[hart], value & 1, __ATOMIC_RELEASE);
+        irq_notify(clint->irq, (uint64_t)1 << hart);
+        return OK;
+    }
+
     switch (size) {
     case 64:
+        if (CLINT_MTIMECMP <= addr && addr < CLINT_MTIMECMP_HART(MAX_HARTS)) {
+            if (addr % 8 == 0) {
+                clint_set_mtimecmp(clint, (addr - CLINT_MTIMECMP) / 8, value);
+            }
+            return OK;
+        }
         switch (addr) {
-        case CLINT_MTIMECMP:
-            clint->mtimecmp = value;
-            break;
         case CLINT_MTIME:
-            clint->mtime = value;
+            /* Deadlines are in mtime, so they all have to be looked at again. */
+            timer_set_now(clint->timer, value);
+            for (int i = 0; i < MAX_HARTS; i++) {
+                clint_set_mtimecmp(clint, i, clint->mtimecmp[i]);
+            }
             break;
         }
         return OK;
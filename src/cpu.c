@@ -1,15 +1,23 @@
 #include "nanoemu.h"
 
 struct cpu*
-cpu_new(uint8_t* code, size_t code_size, uint8_t* disk) {
+cpu_new(struct bus* bus, uint64_t hartid) {
     struct cpu* cpu = calloc(1, sizeof *cpu);
 
     /* Initialize the sp(x2) register. */
-    cpu->regs[2] = DRAM_BASE + DRAM_SIZE;
+    cpu->regs[2] = DRAM_BASE + bus->dram->size;
 
-    cpu->bus = bus_new(dram_new(code, code_size), virtio_new(disk));
+    cpu->bus = bus;
+    cpu->blocks = block_cache_new();
     cpu->pc = DRAM_BASE;
     cpu->mode = MACHINE;
+    cpu->csrs[MHARTID] = hartid;
+    cpu->irq_check = true;
+    /* Let S-mode read cycle, time and instret; there is no firmware to do it. */
+    cpu->csrs[MCOUNTEREN] = 0x7;
+    /* Likewise, the FPU and the vector unit start enabled. */
+    cpu->csrs[MSTATUS] = MSTATUS_FS_INITIAL | MSTATUS_VS_INITIAL;
+    cpu->csrs[VTYPE] = VTYPE_VILL;
 
     return cpu;
 }
@@ -25,15 +33,31 @@ cpu_update_paging(struct cpu* cpu, uint16_t csr_addr) {
         cpu->enable_paging = true;
     else
         cpu->enable_paging = false;
+
+    /* A new address space invalidates every cached translation. */
+    tlb_flush(&cpu->itlb);
+    tlb_flush(&cpu->dtlb);
+    cpu_flush_fetch_page(cpu);
 }
 
-enum exception
-cpu_translate(struct cpu* cpu, uint64_t addr, enum exception e, uint64_t *result) {
-    if (!cpu->enable_paging) {
-        *result = addr;
-        return OK;
+/* Writes to these CSRs can unmask an interrupt that is already pending. */
+void
+cpu_update_interrupts(struct cpu* cpu, uint16_t csr_addr) {
+    switch (csr_addr) {
+    case MSTATUS:
+    case MIE:
+    case MIP:
+    case MIDELEG:
+    case SSTATUS:
+    case SIE:
+    case SIP:
+        cpu->irq_check = true;
     }
+}
 
+/* Walk the Sv39 page table for `addr`, `level` is where the leaf was found. */
+static enum exception
+cpu_walk(struct cpu* cpu, uint64_t addr, enum exception e, uint64_t *result, int *level) {
     int levels = 3;
     uint64_t vpn[] = {
         (addr >> 12) & 0x1ff,
@@ -72,6 +96,7 @@ cpu_translate(struct cpu* cpu, uint64_t addr, enum exception e, uint64_t *result
     };
 
     uint64_t offset = addr & 0xfff;
+    *level = i;
     switch (i) {
     case 0: {
         uint64_t ppn = (pte >> 10) & 0x0fffffffffff;
@@ -92,35 +117,211 @@ cpu_translate(struct cpu* cpu, uint64_t addr, enum exception e, uint64_t *result
     }
 }
 
-/* Fetch an instruction from current PC from DRAM. */
+enum exception
+cpu_translate(struct cpu* cpu, uint64_t addr, enum exception e, uint64_t *result) {
+    /* M-mode accesses are never translated. */
+    if (!cpu->enable_paging || cpu->mode == MACHINE) {
+        *result = addr;
+        return OK;
+    }
+
+    struct tlb* tlb = e == INSTRUCTION_PAGE_FAULT ? &cpu->itlb : &cpu->dtlb;
+    if (tlb_lookup(tlb, addr, cpu->mode, result)) {
+        return OK;
+    }
+
+    enum exception exception;
+    int level = 0;
+    if ((exception = cpu_walk(cpu, addr, e, result, &level)) != OK) {
+        return exception;
+    }
+    tlb_insert(tlb, addr, cpu->mode, *result, level);
+    return OK;
+}
+
+/* Translate the page of the current PC into the fetch page cache. */
+enum exception
+cpu_fill_fetch_page(struct cpu* cpu) {
+    uint64_t vpage = cpu->pc & ~(uint64_t)(PAGE_SIZE - 1);
+    uint64_t ppage;
+    enum exception exception;
+    if ((exception = cpu_translate(cpu, vpage, INSTRUCTION_PAGE_FAULT, &ppage)) != OK) {
+        return exception;
+    }
+    cpu->fetch_valid = true;
+    cpu->fetch_vpage = vpage;
+    cpu->fetch_mode = cpu->mode;
+    cpu->fetch_ppage = ppage;
+    cpu->fetch_host = dram_host(cpu->bus->dram, ppage, PAGE_SIZE * 8);
+    return OK;
+}
+
+/*
+ * Fetch the instruction at the current PC. A compressed instruction comes
+ * back in the low 16 bits; the upper half of a 32-bit one may be on the
+ * next page.
+ */
 enum exception
 cpu_fetch(struct cpu* cpu, uint64_t* result) {
-    uint64_t ppc;
     enum exception exception;
-    if ((exception = cpu_translate(cpu, cpu->pc, INSTRUCTION_PAGE_FAULT, &ppc)) != OK) {
+    if ((exception = cpu_fetch_page(cpu)) != OK) {
+        return exception;
+    }
+    uint64_t offset = cpu->pc & (PAGE_SIZE - 1);
+    if (cpu->fetch_host != NULL && offset <= PAGE_SIZE - 4) {
+        *result = host_load(cpu->fetch_host + offset, 32);
+        return OK;
+    }
+    uint64_t low, high;
+    if (bus_load(cpu->bus, cpu->fetch_ppage | offset, 16, &low) != OK) {
+        return INSTRUCTION_ACCESS_FAULT;
+    }
+    if ((low & 0x3) != 0x3) {
+        *result = low;
+        return OK;
+    }
+    uint64_t paddr = cpu->fetch_ppage | (offset + 2);
+    if (offset + 2 == PAGE_SIZE
+        && (exception = cpu_translate(cpu, cpu->pc + 2, INSTRUCTION_PAGE_FAULT, &paddr)) != OK) {
         return exception;
     }
-    if (bus_load(cpu->bus, ppc, 32, result) != OK) {
+    if (bus_load(cpu->bus, paddr, 16, &high) != OK) {
         return INSTRUCTION_ACCESS_FAULT;
     }
+    *result = low | high << 16;
     return OK;
 }
 
+/*
+ * Instructions retired before the one executing. The run loop adds a block
+ * to instret once it ends, and CSR instructions always end their block.
+ */
+static uint64_t
+cpu_retired(struct cpu* cpu) {
+    return cpu->instret + cpu->block_len - 1;
+}
+
+/* Counters are readable below M-mode only where mcounteren, then scounteren, allow it. */
+static bool
+cpu_counter_enabled(struct cpu* cpu, uint16_t addr) {
+    if (addr < CYCLE || addr > HPMCOUNTER31 || cpu->mode == MACHINE) {
+        return true;
+    }
+    uint64_t bit = (uint64_t)1 << (addr - CYCLE);
+    if (!(cpu->csrs[MCOUNTEREN] & bit)) {
+        return false;
+    }
+    return cpu->mode == SUPERVISOR || (cpu->csrs[SCOUNTEREN] & bit);
+}
+
+/* The floating-point and vector CSRs are off with their unit, see mstatus.FS and VS. */
+static bool
+cpu_unit_enabled(struct cpu* cpu, uint16_t addr) {
+    if (FFLAGS <= addr && addr <= FCSR) {
+        return (cpu->csrs[MSTATUS] & MSTATUS_FS) != 0;
+    }
+    if ((VSTART <= addr && addr <= VCSR) || (VL <= addr && addr <= VLENB)) {
+        return (cpu->csrs[MSTATUS] & MSTATUS_VS) != 0;
+    }
+    return true;
+}
+
+/*
+ * sstatus, sie and sip are views of mstatus, mie and mip, fflags and frm
+ * are fields of fcsr, and vxsat and vxrm of vcsr. The accrued FP flags are
+ * partly held by the host, see fpu_sync_flags().
+ */
 uint64_t
 cpu_load_csr(struct cpu* cpu, uint16_t addr) {
-    if (addr == SIE) {
+    switch (addr) {
+    case SSTATUS:
+        return cpu->csrs[MSTATUS] & SSTATUS_MASK;
+    case FFLAGS:
+        fpu_sync_flags(cpu);
+        return cpu->csrs[FCSR] & 0x1f;
+    case FRM:
+        return (cpu->csrs[FCSR] >> 5) & 0x7;
+    case FCSR:
+        fpu_sync_flags(cpu);
+        return cpu->csrs[FCSR];
+    case VXSAT:
+        return cpu->csrs[VCSR] & 0x1;
+    case VXRM:
+        return (cpu->csrs[VCSR] >> 1) & 0x3;
+    case VLENB:
+        return VLEN_BYTES;
+    case SIE:
         return cpu->csrs[MIE] & cpu->csrs[MIDELEG];
+    case SIP:
+        return cpu->csrs[MIP] & cpu->csrs[MIDELEG];
+    /* One cycle per instruction; the CSRs hold what was written minus the count. */
+    case CYCLE:
+    case MCYCLE:
+        return cpu_retired(cpu) + cpu->csrs[MCYCLE];
+    case INSTRET:
+    case MINSTRET:
+        return cpu_retired(cpu) + cpu->csrs[MINSTRET];
+    case TIME:
+        return timer_now(cpu->bus->timer);
+    default:
+        /* No hardware performance monitor events, their counters stay zero. */
+        if ((MHPMCOUNTER3 <= addr && addr <= MHPMCOUNTER31) || (HPMCOUNTER3 <= addr && addr <= HPMCOUNTER31)) {
+            return 0;
+        }
+        return cpu->csrs[addr];
     }
-    return cpu->csrs[addr];
 }
 
 void
 cpu_store_csr(struct cpu* cpu, uint16_t addr, uint64_t value) {
-    if (addr == SIE) {
+    switch (addr) {
+    case SSTATUS:
+        value = (cpu->csrs[MSTATUS] & ~SSTATUS_MASK) | (value & SSTATUS_MASK);
+        /* fall through */
+    case MSTATUS:
+        /* SD is read-only, it tells whether FS or VS is dirty. */
+        value &= ~MSTATUS_SD;
+        if ((value & MSTATUS_FS) == MSTATUS_FS || (value & MSTATUS_VS) == MSTATUS_VS) {
+            value |= MSTATUS_SD;
+        }
+        cpu->csrs[MSTATUS] = value;
+        break;
+    case FFLAGS:
+        fpu_store_fcsr(cpu, (cpu->csrs[FCSR] & 0xe0) | (value & 0x1f));
+        break;
+    case FRM:
+        fpu_sync_flags(cpu);
+        fpu_store_fcsr(cpu, (value & 0x7) << 5 | (cpu->csrs[FCSR] & 0x1f));
+        break;
+    case FCSR:
+        fpu_store_fcsr(cpu, value);
+        break;
+    case VSTART:
+    case VXSAT:
+    case VXRM:
+    case VCSR:
+        vector_store_csr(cpu, addr, value);
+        break;
+    case SIE:
         cpu->csrs[MIE] = (cpu->csrs[MIE] & ~cpu->csrs[MIDELEG]) | (value & cpu->csrs[MIDELEG]);
-        return;
+        break;
+    case SIP: {
+        /* Only the software interrupt can be raised or cleared from S-mode. */
+        uint64_t mask = cpu->csrs[MIDELEG] & MIP_SSIP;
+        cpu->csrs[MIP] = (cpu->csrs[MIP] & ~mask) | (value & mask);
+        break;
+    }
+    case MIDELEG:
+        cpu->csrs[MIDELEG] = value & MIDELEG_MASK;
+        break;
+    case MCYCLE:
+    case MINSTRET:
+        /* The write replaces the count of the writing instruction too. */
+        cpu->csrs[addr] = value - (cpu_retired(cpu) + 1);
+        break;
+    default:
+        cpu->csrs[addr] = value;
     }
-    cpu->csrs[addr] = value;
 }
 
 enum exception
@@ -130,6 +331,13 @@ cpu_load(struct cpu* cpu, uint64_t addr, uint64_t size, uint64_t *result) {
     if ((exception = cpu_translate(cpu, addr, LOAD_PAGE_FAULT, &pa)) != OK) {
         return exception;
     }
+
+    /* DRAM is by far the most common target, skip the MMIO dispatch. */
+    uint8_t* host = dram_host(cpu->bus->dram, pa, size);
+    if (host != NULL) {
+        *result = host_load(host, size);
+        return OK;
+    }
     return bus_load(cpu->bus, pa, size, result);
 }
 
@@ -140,9 +348,162 @@ cpu_store(struct cpu* cpu, uint64_t addr, uint64_t size, uint64_t value) {
     if ((exception = cpu_translate(cpu, addr, STORE_AMO_PAGE_FAULT, &pa)) != OK) {
         return exception;
     }
+
+    uint8_t* host = dram_host(cpu->bus->dram, pa, size);
+    if (host != NULL) {
+        dram_invalidate_code(cpu->bus->dram, pa, size);
+        host_store(host, size, value);
+        return OK;
+    }
     return bus_store(cpu->bus, pa, size, value);
 }
 
+/* Compute the new memory value of an AMO from the old one `a` and rs2 `b`. */
+static bool
+cpu_amo_op(uint64_t funct5, uint64_t size, uint64_t a, uint64_t b, uint64_t *result) {
+    int64_t sa = size == 32 ? (int32_t)a : (int64_t)a;
+    int64_t sb = size == 32 ? (int32_t)b : (int64_t)b;
+    uint64_t ua = size == 32 ? (uint32_t)a : a;
+    uint64_t ub = size == 32 ? (uint32_t)b : b;
+
+    switch (funct5) {
+    case 0x00: /* amoadd */
+        *result = a + b;
+        return true;
+    case 0x01: /* amoswap */
+        *result = b;
+        return true;
+    case 0x04: /* amoxor */
+        *result = a ^ b;
+        return true;
+    case 0x08: /* amoor */
+        *result = a | b;
+        return true;
+    case 0x0c: /* amoand */
+        *result = a & b;
+        return true;
+    case 0x10: /* amomin */
+        *result = sa < sb ? a : b;
+        return true;
+    case 0x14: /* amomax */
+        *result = sa > sb ? a : b;
+        return true;
+    case 0x18: /* amominu */
+        *result = ua < ub ? a : b;
+        return true;
+    case 0x1c: /* amomaxu */
+        *result = ua > ub ? a : b;
+        return true;
+    default:
+        return false;
+    }
+}
+
+/*
+ * Resolve the target of an atomic access to a naturally aligned host
+ * pointer. Atomics are only supported on DRAM. Only lr faults as a load.
+ */
+static enum exception
+cpu_amo_host(struct cpu* cpu, uint64_t addr, uint64_t size, bool load, uint8_t** host) {
+    if (addr % (size / 8) != 0) {
+        return load ? LOAD_ADDRESS_MISALIGNED : STORE_AMO_ADDRESS_MISALIGNED;
+    }
+    uint64_t pa;
+    enum exception exception;
+    if ((exception = cpu_translate(cpu, addr, load ? LOAD_PAGE_FAULT : STORE_AMO_PAGE_FAULT, &pa)) != OK) {
+        return exception;
+    }
+    if ((*host = dram_host(cpu->bus->dram, pa, size)) == NULL) {
+        return load ? LOAD_ACCESS_FAULT : STORE_AMO_ACCESS_FAULT;
+    }
+    if (!load) {
+        dram_invalidate_code(cpu->bus->dram, pa, size);
+    }
+    return OK;
+}
+
+/* Compare-and-swap a guest word of `size` bits, `old` is updated on failure. */
+static bool
+cpu_cas(uint8_t* host, uint64_t size, uint64_t *old, uint64_t value) {
+    if (size == 32) {
+        uint32_t expected = LE32((uint32_t)*old);
+        bool ok = __atomic_compare_exchange_n((uint32_t*)host, &expected, LE32((uint32_t)value),
+            false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+        *old = LE32(expected);
+        return ok;
+    }
+    uint64_t expected = LE64(*old);
+    bool ok = __atomic_compare_exchange_n((uint64_t*)host, &expected, LE64(value),
+        false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+    *old = LE64(expected);
+    return ok;
+}
+
+static uint64_t
+cpu_atomic_load(uint8_t* host, uint64_t size) {
+    if (size == 32) {
+        return LE32(__atomic_load_n((uint32_t*)host, __ATOMIC_SEQ_CST));
+    }
+    return LE64(__atomic_load_n((uint64_t*)host, __ATOMIC_SEQ_CST));
+}
+
+/*
+ * Execute an A extension instruction. Harts run on their own host threads,
+ * so read-modify-writes go through host atomics; sc succeeds if memory
+ * still holds the value lr loaded.
+ */
+static enum exception
+cpu_execute_amo(struct cpu* cpu, uint64_t funct5, uint64_t size, uint64_t rd, uint64_t rs1, uint64_t rs2) {
+    uint64_t addr = cpu->regs[rs1];
+    uint8_t* host;
+    enum exception exception;
+
+    if (funct5 == 0x02) { /* lr */
+        if (rs2 != 0) {
+            return ILLEGAL_INSTRUCTION;
+        }
+        if ((exception = cpu_amo_host(cpu, addr, size, true, &host)) != OK) {
+            return exception;
+        }
+        uint64_t value = cpu_atomic_load(host, size);
+        cpu->reserved = true;
+        cpu->reservation = addr;
+        cpu->reservation_value = value;
+        cpu->regs[rd] = size == 32 ? (uint64_t)(int32_t)value : value;
+        return OK;
+    }
+
+    if (funct5 == 0x03) { /* sc */
+        if ((exception = cpu_amo_host(cpu, addr, size, false, &host)) != OK) {
+            return exception;
+        }
+        bool ok = false;
+        if (cpu->reserved && cpu->reservation == addr) {
+            uint64_t old = cpu->reservation_value;
+            ok = cpu_cas(host, size, &old, cpu->regs[rs2]);
+        }
+        cpu->reserved = false;
+        cpu->regs[rd] = ok ? 0 : 1;
+        return OK;
+    }
+
+    uint64_t value;
+    if (!cpu_amo_op(funct5, size, 0, 0, &value)) {
+        return ILLEGAL_INSTRUCTION;
+    }
+    if ((exception = cpu_amo_host(cpu, addr, size, false, &host)) != OK) {
+        return exception;
+    }
+
+    uint64_t old = cpu_atomic_load(host, size);
+    do {
+        cpu_amo_op(funct5, size, old, cpu->regs[rs2], &value);
+    } while (!cpu_cas(host, size, &old, value));
+
+    cpu->regs[rd] = size == 32 ? (uint64_t)(int32_t)old : old;
+    return OK;
+}
+
 void
 cpu_dump_csrs(struct cpu* cpu) {
     printf("mstatus=0x%016"PRIx64" mtvec=0x%016"PRIx64" mepc=0x%016"PRIx64" mcause=0x%016"PRIx64"\n",
@@ -239,7 +600,16 @@ cpu_execute(struct cpu* cpu, uint64_t inst) {
     case 0x0f: {
         switch (funct3) {
         case 0x0: /* fence */
-            /* Do nothing. */
+            /* Other harts may observe this one's memory accesses. */
+            __atomic_thread_fence(__ATOMIC_SEQ_CST);
+            break;
+        case 0x1: /* fence.i */
+            /*
+             * Stores already retire stale blocks through the code
+             * generation of their page; only the fetch page is left.
+             */
+            __atomic_thread_fence(__ATOMIC_SEQ_CST);
+            cpu_flush_fetch_page(cpu);
             break;
         default: return ILLEGAL_INSTRUCTION;
         }
@@ -254,8 +624,47 @@ cpu_execute(struct cpu* cpu, uint64_t inst) {
         case 0x0: /* addi */
             cpu->regs[rd] = cpu->regs[rs1] + imm;
             break;
-        case 0x1: /* slli */
-            cpu->regs[rd] = cpu->regs[rs1] << shamt;
+        case 0x1:
+            switch (funct7 >> 1)
+            {
+            case 0x00: /* slli */
+                cpu->regs[rd] = cpu->regs[rs1] << shamt;
+                break;
+            case 0x0a: /* bseti */
+                cpu->regs[rd] = cpu->regs[rs1] | ((uint64_t)1 << shamt);
+                break;
+            case 0x12: /* bclri */
+                cpu->regs[rd] = cpu->regs[rs1] & ~((uint64_t)1 << shamt);
+                break;
+            case 0x1a: /* binvi */
+                cpu->regs[rd] = cpu->regs[rs1] ^ ((uint64_t)1 << shamt);
+                break;
+            case 0x18:
+                /* The unary Zbb instructions, selected by the rs2 field. */
+                if (funct7 != 0x30) {
+                    return ILLEGAL_INSTRUCTION;
+                }
+                switch (rs2) {
+                case 0x0: /* clz */
+                    cpu->regs[rd] = alu_clz(cpu->regs[rs1]);
+                    break;
+                case 0x1: /* ctz */
+                    cpu->regs[rd] = alu_ctz(cpu->regs[rs1]);
+                    break;
+                case 0x2: /* cpop */
+                    cpu->regs[rd] = __builtin_popcountll(cpu->regs[rs1]);
+                    break;
+                case 0x4: /* sext.b */
+                    cpu->regs[rd] = (int8_t)cpu->regs[rs1];
+                    break;
+                case 0x5: /* sext.h */
+                    cpu->regs[rd] = (int16_t)cpu->regs[rs1];
+                    break;
+                default: return ILLEGAL_INSTRUCTION;
+                }
+                break;
+            default: return ILLEGAL_INSTRUCTION;
+            }
             break;
         case 0x2: /* slti */
             cpu->regs[rd] = (int64_t)cpu->regs[rs1] < (int64_t)imm ? 1 : 0;
@@ -275,6 +684,24 @@ cpu_execute(struct cpu* cpu, uint64_t inst) {
             case 0x10: /* srai */
                 cpu->regs[rd] = (int64_t)(cpu->regs[rs1]) >> shamt;
                 break;
+            case 0x12: /* bexti */
+                cpu->regs[rd] = (cpu->regs[rs1] >> shamt) & 1;
+                break;
+            case 0x18: /* rori */
+                cpu->regs[rd] = alu_ror(cpu->regs[rs1], shamt);
+                break;
+            case 0x0a: /* orc.b */
+                if (shamt != 0x07) {
+                    return ILLEGAL_INSTRUCTION;
+                }
+                cpu->regs[rd] = alu_orcb(cpu->regs[rs1]);
+                break;
+            case 0x1a: /* rev8 */
+                if (shamt != 0x38) {
+                    return ILLEGAL_INSTRUCTION;
+                }
+                cpu->regs[rd] = __builtin_bswap64(cpu->regs[rs1]);
+                break;
             default: return ILLEGAL_INSTRUCTION;
             }
             break;
@@ -290,7 +717,7 @@ cpu_execute(struct cpu* cpu, uint64_t inst) {
     }
     case 0x17: /* auipc */ {
         uint64_t imm = (int32_t)(inst & 0xfffff000);
-        cpu->regs[rd] = cpu->pc + imm - 4;
+        cpu->regs[rd] = cpu->pc + imm - cpu->inst_len;
         break;
     }
     case 0x1b: {
@@ -301,8 +728,20 @@ cpu_execute(struct cpu* cpu, uint64_t inst) {
         case 0x0: /* addiw */
             cpu->regs[rd] = (int32_t)(cpu->regs[rs1] + imm);
             break;
-        case 0x1: /* slliw */
-            cpu->regs[rd] = (int32_t)(cpu->regs[rs1] << shamt);
+        case 0x1:
+            if (funct7 == 0x00) { /* slliw */
+                cpu->regs[rd] = (int32_t)(cpu->regs[rs1] << shamt);
+            } else if ((funct7 >> 1) == 0x02) { /* slli.uw, with a 6-bit shift */
+                cpu->regs[rd] = (uint64_t)(uint32_t)cpu->regs[rs1] << (imm & 0x3f);
+            } else if (funct7 == 0x30 && rs2 == 0x0) { /* clzw */
+                cpu->regs[rd] = alu_clzw(cpu->regs[rs1]);
+            } else if (funct7 == 0x30 && rs2 == 0x1) { /* ctzw */
+                cpu->regs[rd] = alu_ctzw(cpu->regs[rs1]);
+            } else if (funct7 == 0x30 && rs2 == 0x2) { /* cpopw */
+                cpu->regs[rd] = __builtin_popcount((uint32_t)cpu->regs[rs1]);
+            } else {
+                return ILLEGAL_INSTRUCTION;
+            }
             break;
         case 0x5: {
             switch (funct7) {
@@ -312,6 +751,9 @@ cpu_execute(struct cpu* cpu, uint64_t inst) {
             case 0x20: /* sraiw */
                 cpu->regs[rd] = (int32_t)(cpu->regs[rs1]) >> shamt;
                 break;
+            case 0x30: /* roriw */
+                cpu->regs[rd] = alu_rorw(cpu->regs[rs1], shamt);
+                break;
             default: return ILLEGAL_INSTRUCTION;
             }
             break;
@@ -351,53 +793,18 @@ cpu_execute(struct cpu* cpu, uint64_t inst) {
     }
     case 0x2f: {
         uint64_t funct5 = (funct7 & 0x7c) >> 2;
-        if (funct3 == 0x2 && funct5 == 0x00) { /* amoadd.w */
-            uint64_t t;
-            if ((exception = cpu_load(cpu, cpu->regs[rs1], 32, &t)) != OK) {
-                return exception;
-            }
-            if ((exception = cpu_store(cpu, cpu->regs[rs1], 32, t + cpu->regs[rs2])) != OK) {
-                return exception;
-            }
-            cpu->regs[rd] = t;
-        } else if (funct3 == 0x3 && funct5 == 0x00) { /* amoadd.d */
-            uint64_t t;
-            if ((exception = cpu_load(cpu, cpu->regs[rs1], 64, &t)) != OK) {
-                return exception;
-            }
-            if ((exception = cpu_store(cpu, cpu->regs[rs1], 64, t + cpu->regs[rs2])) != OK) {
-                return exception;
-            }
-            cpu->regs[rd] = t;
-        } else if (funct3 == 0x2 && funct5 == 0x01) { /* amoswap.w */
-            uint64_t t;
-            if ((exception = cpu_load(cpu, cpu->regs[rs1], 32, &t)) != OK) {
-                return exception;
-            }
-            if ((exception = cpu_store(cpu, cpu->regs[rs1], 32, cpu->regs[rs2])) != OK) {
-                return exception;
-            }
-            cpu->regs[rd] = t;
-        } else if (funct3 == 0x3 && funct5 == 0x01) { /* amoswap.d */
-            uint64_t t;
-            if ((exception = cpu_load(cpu, cpu->regs[rs1], 64, &t)) != OK) {
-                return exception;
-            }
-            if ((exception = cpu_store(cpu, cpu->regs[rs1], 64, cpu->regs[rs2])) != OK) {
-                return exception;
-            }
-            cpu->regs[rd] = t;
-        } else {
-            return ILLEGAL_INSTRUCTION;
+        switch (funct3) {
+        case 0x2:
+            return cpu_execute_amo(cpu, funct5, 32, rd, rs1, rs2);
+        case 0x3:
+            return cpu_execute_amo(cpu, funct5, 64, rd, rs1, rs2);
+        default: return ILLEGAL_INSTRUCTION;
         }
-        break;
     }
     case 0x33: {
         uint32_t shamt = cpu->regs[rs2] & 0x3f;
         if (funct3 == 0x0 && funct7 == 0x00) { /* add */
             cpu->regs[rd] = cpu->regs[rs1] + cpu->regs[rs2];
-        } else if (funct3 == 0x0 && funct7 == 0x01) { /* mul */
-            cpu->regs[rd] = cpu->regs[rs1] * cpu->regs[rs2];
         } else if (funct3 == 0x0 && funct7 == 0x20) { /* sub */
             cpu->regs[rd] = cpu->regs[rs1] - cpu->regs[rs2];
         } else if (funct3 == 0x1 && funct7 == 0x00) { /* sll */
@@ -416,6 +823,54 @@ cpu_execute(struct cpu* cpu, uint64_t inst) {
             cpu->regs[rd] = cpu->regs[rs1] | cpu->regs[rs2];
         } else if (funct3 == 0x7 && funct7 == 0x00) { /* and */
             cpu->regs[rd] = cpu->regs[rs1] & cpu->regs[rs2];
+        } else if (funct3 == 0x0 && funct7 == 0x01) { /* mul */
+            cpu->regs[rd] = cpu->regs[rs1] * cpu->regs[rs2];
+        } else if (funct3 == 0x1 && funct7 == 0x01) { /* mulh */
+            cpu->regs[rd] = alu_mulh(cpu->regs[rs1], cpu->regs[rs2]);
+        } else if (funct3 == 0x2 && funct7 == 0x01) { /* mulhsu */
+            cpu->regs[rd] = alu_mulhsu(cpu->regs[rs1], cpu->regs[rs2]);
+        } else if (funct3 == 0x3 && funct7 == 0x01) { /* mulhu */
+            cpu->regs[rd] = alu_mulhu(cpu->regs[rs1], cpu->regs[rs2]);
+        } else if (funct3 == 0x4 && funct7 == 0x01) { /* div */
+            cpu->regs[rd] = alu_div(cpu->regs[rs1], cpu->regs[rs2]);
+        } else if (funct3 == 0x5 && funct7 == 0x01) { /* divu */
+            cpu->regs[rd] = alu_divu(cpu->regs[rs1], cpu->regs[rs2]);
+        } else if (funct3 == 0x6 && funct7 == 0x01) { /* rem */
+            cpu->regs[rd] = alu_rem(cpu->regs[rs1], cpu->regs[rs2]);
+        } else if (funct3 == 0x7 && funct7 == 0x01) { /* remu */
+            cpu->regs[rd] = alu_remu(cpu->regs[rs1], cpu->regs[rs2]);
+        } else if (funct3 == 0x2 && funct7 == 0x10) { /* sh1add */
+            cpu->regs[rd] = (cpu->regs[rs1] << 1) + cpu->regs[rs2];
+        } else if (funct3 == 0x4 && funct7 == 0x10) { /* sh2add */
+            cpu->regs[rd] = (cpu->regs[rs1] << 2) + cpu->regs[rs2];
+        } else if (funct3 == 0x6 && funct7 == 0x10) { /* sh3add */
+            cpu->regs[rd] = (cpu->regs[rs1] << 3) + cpu->regs[rs2];
+        } else if (funct3 == 0x4 && funct7 == 0x20) { /* xnor */
+            cpu->regs[rd] = ~(cpu->regs[rs1] ^ cpu->regs[rs2]);
+        } else if (funct3 == 0x6 && funct7 == 0x20) { /* orn */
+            cpu->regs[rd] = cpu->regs[rs1] | ~cpu->regs[rs2];
+        } else if (funct3 == 0x7 && funct7 == 0x20) { /* andn */
+            cpu->regs[rd] = cpu->regs[rs1] & ~cpu->regs[rs2];
+        } else if (funct3 == 0x4 && funct7 == 0x05) { /* min */
+            cpu->regs[rd] = (int64_t)cpu->regs[rs1] < (int64_t)cpu->regs[rs2] ? cpu->regs[rs1] : cpu->regs[rs2];
+        } else if (funct3 == 0x5 && funct7 == 0x05) { /* minu */
+            cpu->regs[rd] = cpu->regs[rs1] < cpu->regs[rs2] ? cpu->regs[rs1] : cpu->regs[rs2];
+        } else if (funct3 == 0x6 && funct7 == 0x05) { /* max */
+            cpu->regs[rd] = (int64_t)cpu->regs[rs1] > (int64_t)cpu->regs[rs2] ? cpu->regs[rs1] : cpu->regs[rs2];
+        } else if (funct3 == 0x7 && funct7 == 0x05) { /* maxu */
+            cpu->regs[rd] = cpu->regs[rs1] > cpu->regs[rs2] ? cpu->regs[rs1] : cpu->regs[rs2];
+        } else if (funct3 == 0x1 && funct7 == 0x30) { /* rol */
+            cpu->regs[rd] = alu_rol(cpu->regs[rs1], cpu->regs[rs2]);
+        } else if (funct3 == 0x5 && funct7 == 0x30) { /* ror */
+            cpu->regs[rd] = alu_ror(cpu->regs[rs1], cpu->regs[rs2]);
+        } else if (funct3 == 0x1 && funct7 == 0x14) { /* bset */
+            cpu->regs[rd] = cpu->regs[rs1] | ((uint64_t)1 << shamt);
+        } else if (funct3 == 0x1 && funct7 == 0x24) { /* bclr */
+            cpu->regs[rd] = cpu->regs[rs1] & ~((uint64_t)1 << shamt);
+        } else if (funct3 == 0x1 && funct7 == 0x34) { /* binv */
+            cpu->regs[rd] = cpu->regs[rs1] ^ ((uint64_t)1 << shamt);
+        } else if (funct3 == 0x5 && funct7 == 0x24) { /* bext */
+            cpu->regs[rd] = (cpu->regs[rs1] >> shamt) & 1;
         } else {
             return ILLEGAL_INSTRUCTION;
         }
@@ -435,16 +890,32 @@ cpu_execute(struct cpu* cpu, uint64_t inst) {
             cpu->regs[rd] = (int32_t)((uint32_t)cpu->regs[rs1] << shamt);
         } else if (funct3 == 0x5 && funct7 == 0x00) { /* srlw */
             cpu->regs[rd] = (int32_t)((uint32_t)cpu->regs[rs1] >> shamt);
-        } else if (funct3 == 0x5 && funct7 == 0x01) { /* divu */
-            cpu->regs[rd] = cpu->regs[rs2] == 0
-                ? -1
-                : cpu->regs[rs1] / cpu->regs[rs2];
         } else if (funct3 == 0x5 && funct7 == 0x20) { /* sraw */
             cpu->regs[rd] = (int32_t)cpu->regs[rs1] >> (int32_t)shamt;
+        } else if (funct3 == 0x0 && funct7 == 0x01) { /* mulw */
+            cpu->regs[rd] = (int32_t)(cpu->regs[rs1] * cpu->regs[rs2]);
+        } else if (funct3 == 0x4 && funct7 == 0x01) { /* divw */
+            cpu->regs[rd] = alu_divw(cpu->regs[rs1], cpu->regs[rs2]);
+        } else if (funct3 == 0x5 && funct7 == 0x01) { /* divuw */
+            cpu->regs[rd] = alu_divuw(cpu->regs[rs1], cpu->regs[rs2]);
+        } else if (funct3 == 0x6 && funct7 == 0x01) { /* remw */
+            cpu->regs[rd] = alu_remw(cpu->regs[rs1], cpu->regs[rs2]);
         } else if (funct3 == 0x7 && funct7 == 0x01) { /* remuw */
-            cpu->regs[rd] = cpu->regs[rs2] == 0
-                ? cpu->regs[rs1]
-                : (int32_t)((uint32_t)cpu->regs[rs1] % (uint32_t)cpu->regs[rs2]);
+            cpu->regs[rd] = alu_remuw(cpu->regs[rs1], cpu->regs[rs2]);
+        } else if (funct3 == 0x0 && funct7 == 0x04) { /* add.uw */
+            cpu->regs[rd] = (uint64_t)(uint32_t)cpu->regs[rs1] + cpu->regs[rs2];
+        } else if (funct3 == 0x2 && funct7 == 0x10) { /* sh1add.uw */
+            cpu->regs[rd] = ((uint64_t)(uint32_t)cpu->regs[rs1] << 1) + cpu->regs[rs2];
+        } else if (funct3 == 0x4 && funct7 == 0x10) { /* sh2add.uw */
+            cpu->regs[rd] = ((uint64_t)(uint32_t)cpu->regs[rs1] << 2) + cpu->regs[rs2];
+        } else if (funct3 == 0x6 && funct7 == 0x10) { /* sh3add.uw */
+            cpu->regs[rd] = ((uint64_t)(uint32_t)cpu->regs[rs1] << 3) + cpu->regs[rs2];
+        } else if (funct3 == 0x4 && funct7 == 0x04 && rs2 == 0) { /* zext.h */
+            cpu->regs[rd] = (uint16_t)cpu->regs[rs1];
+        } else if (funct3 == 0x1 && funct7 == 0x30) { /* rolw */
+            cpu->regs[rd] = alu_rolw(cpu->regs[rs1], cpu->regs[rs2]);
+        } else if (funct3 == 0x5 && funct7 == 0x30) { /* rorw */
+            cpu->regs[rd] = alu_rorw(cpu->regs[rs1], cpu->regs[rs2]);
         } else {
             return ILLEGAL_INSTRUCTION;
         }
@@ -460,27 +931,27 @@ cpu_execute(struct cpu* cpu, uint64_t inst) {
         {
         case 0x0: /* beq */
             if (cpu->regs[rs1] == cpu->regs[rs2])
-                cpu->pc += imm - 4;
+                cpu->pc += imm - cpu->inst_len;
             break;
         case 0x1: /* bne */
             if (cpu->regs[rs1] != cpu->regs[rs2])
-                cpu->pc += imm - 4;
+                cpu->pc += imm - cpu->inst_len;
             break;
         case 0x4: /* blt */
             if ((int64_t)cpu->regs[rs1] < (int64_t)cpu->regs[rs2])
-                cpu->pc += imm - 4;
+                cpu->pc += imm - cpu->inst_len;
             break;
         case 0x5: /* bge */
             if ((int64_t)cpu->regs[rs1] >= (int64_t)cpu->regs[rs2])
-                cpu->pc += imm - 4;
+                cpu->pc += imm - cpu->inst_len;
             break;
         case 0x6: /* bltu */
             if (cpu->regs[rs1] < cpu->regs[rs2])
-                cpu->pc += imm - 4;
+                cpu->pc += imm - cpu->inst_len;
             break;
         case 0x7: /* bgeu */
             if (cpu->regs[rs1] >= cpu->regs[rs2])
-                cpu->pc += imm - 4;
+                cpu->pc += imm - cpu->inst_len;
             break;
         default: return ILLEGAL_INSTRUCTION;
         }
@@ -502,11 +973,22 @@ cpu_execute(struct cpu* cpu, uint64_t inst) {
             | ((inst >> 9) & 0x800)
             | ((inst >> 20) & 0x7fe);
 
-        cpu->pc += imm - 4;
+        cpu->pc += imm - cpu->inst_len;
         break;
     }
     case 0x73: {
         uint16_t addr = (inst & 0xfff00000) >> 20;
+        if (funct3 != 0x0 && (!cpu_counter_enabled(cpu, addr) || !cpu_unit_enabled(cpu, addr))) {
+            return ILLEGAL_INSTRUCTION;
+        }
+        /*
+         * csrrs and csrrc with x0, and their immediate forms with 0, only
+         * read. Writing a read-only CSR (the top two address bits set) traps.
+         */
+        bool csr_write = funct3 == 0x1 || funct3 == 0x5 || rs1 != 0;
+        if (funct3 != 0x0 && csr_write && (addr >> 10) == 0x3) {
+            return ILLEGAL_INSTRUCTION;
+        }
         switch (funct3) {
         case 0x0: {
             if (rs2 == 0x0 && funct7 == 0x0) { /* ecall */
@@ -527,17 +1009,32 @@ cpu_execute(struct cpu* cpu, uint64_t inst) {
                     : cpu_load_csr(cpu, SSTATUS) & ~(1 << 1));
                 cpu_store_csr(cpu, SSTATUS, cpu_load_csr(cpu, SSTATUS) | (1 << 5));
                 cpu_store_csr(cpu, SSTATUS, cpu_load_csr(cpu, SSTATUS) & ~(1 << 8));
+                cpu->irq_check = true;
+            } else if (rs2 == 0x5 && funct7 == 0x8) { /* wfi */
+                /* mstatus.TW traps wfi outside M-mode. */
+                if (cpu->mode != MACHINE && ((cpu_load_csr(cpu, MSTATUS) >> 21) & 1) == 1) {
+                    return ILLEGAL_INSTRUCTION;
+                }
+                cpu->wfi = true;
             } else if (rs2 == 0x2 && funct7 == 0x18) { /* mret */
                 cpu->pc = cpu_load_csr(cpu, MEPC);
                 uint64_t mpp = (cpu_load_csr(cpu, MSTATUS) >> 11) & 3;
-                cpu->mode = mpp == 2 ? MACHINE : (mpp == 1 ? SUPERVISOR : USER);
+                cpu->mode = mpp == 3 ? MACHINE : (mpp == 1 ? SUPERVISOR : USER);
                 cpu_store_csr(cpu, MSTATUS, (((cpu_load_csr(cpu, MSTATUS) >> 7) & 1) == 1)
                     ? cpu_load_csr(cpu, MSTATUS) | (1 << 3)
                     : cpu_load_csr(cpu, MSTATUS) & ~(1 << 3));
                 cpu_store_csr(cpu, MSTATUS, cpu_load_csr(cpu, MSTATUS) | (1 << 7));
                 cpu_store_csr(cpu, MSTATUS, cpu_load_csr(cpu, MSTATUS) & ~(3 << 11));
+                cpu->irq_check = true;
             } else if (funct7 == 0x9) { /* sfence.vma */
-                /* Do nothing. */
+                if (rs1 == 0) {
+                    tlb_flush(&cpu->itlb);
+                    tlb_flush(&cpu->dtlb);
+                } else {
+                    tlb_flush_page(&cpu->itlb, cpu->regs[rs1]);
+                    tlb_flush_page(&cpu->dtlb, cpu->regs[rs1]);
+                }
+                cpu_flush_fetch_page(cpu);
             } else {
                 return ILLEGAL_INSTRUCTION;
             }
@@ -548,46 +1045,75 @@ cpu_execute(struct cpu* cpu, uint64_t inst) {
             cpu_store_csr(cpu, addr, cpu->regs[rs1]);
             cpu->regs[rd] = t;
             cpu_update_paging(cpu, addr);
+            cpu_update_interrupts(cpu, addr);
             break;
         }
         case 0x2: { /* csrrs */
             uint64_t t = cpu_load_csr(cpu, addr);
-            cpu_store_csr(cpu, addr, t | cpu->regs[rs1]);
+            if (csr_write) {
+                cpu_store_csr(cpu, addr, t | cpu->regs[rs1]);
+                cpu_update_paging(cpu, addr);
+                cpu_update_interrupts(cpu, addr);
+            }
             cpu->regs[rd] = t;
-            cpu_update_paging(cpu, addr);
             break;
         }
         case 0x3: { /* csrrc */
             uint64_t t = cpu_load_csr(cpu, addr);
-            cpu_store_csr(cpu, addr, t & ~cpu->regs[rs1]);
+            if (csr_write) {
+                cpu_store_csr(cpu, addr, t & ~cpu->regs[rs1]);
+                cpu_update_paging(cpu, addr);
+                cpu_update_interrupts(cpu, addr);
+            }
             cpu->regs[rd] = t;
-            cpu_update_paging(cpu, addr);
             break;
         }
         case 0x5: { /* csrrwi */
             cpu->regs[rd] = cpu_load_csr(cpu, addr);
             cpu_store_csr(cpu, addr, rs1);
             cpu_update_paging(cpu, addr);
+            cpu_update_interrupts(cpu, addr);
             break;
         }
         case 0x6: { /* csrrsi */
             uint64_t t = cpu_load_csr(cpu, addr);
-            cpu_store_csr(cpu, addr, t | rs1);
+            if (csr_write) {
+                cpu_store_csr(cpu, addr, t | rs1);
+                cpu_update_paging(cpu, addr);
+                cpu_update_interrupts(cpu, addr);
+            }
             cpu->regs[rd] = t;
-            cpu_update_paging(cpu, addr);
             break;
         }
         case 0x7: { /* csrrci */
             uint64_t t = cpu_load_csr(cpu, addr);
-            cpu_store_csr(cpu, addr, t & ~rs1);
+            if (csr_write) {
+                cpu_store_csr(cpu, addr, t & ~rs1);
+                cpu_update_paging(cpu, addr);
+                cpu_update_interrupts(cpu, addr);
+            }
             cpu->regs[rd] = t;
-            cpu_update_paging(cpu, addr);
             break;
         }
         default: return ILLEGAL_INSTRUCTION;
         }
         break;
     }
+    case 0x07:
+    case 0x27:
+        /* The widths left over by the FP loads and stores select vector ones. */
+        if (funct3 == 0x0 || funct3 >= 0x5) {
+            return vector_execute(cpu, inst);
+        }
+        return fpu_execute(cpu, inst);
+    case 0x43:
+    case 0x47:
+    case 0x4b:
+    case 0x4f:
+    case 0x53:
+        return fpu_execute(cpu, inst);
+    case 0x57:
+        return vector_execute(cpu, inst);
     default: return ILLEGAL_INSTRUCTION;
     }
 
@@ -610,18 +1136,43 @@ cpu_dump_registers(struct cpu* cpu) {
     }
 }
 
+void
+cpu_dump_caches(struct cpu* cpu) {
+    printf("itlb hits=%"PRIu64" misses=%"PRIu64"  dtlb hits=%"PRIu64" misses=%"PRIu64"  blocks hits=%"PRIu64" misses=%"PRIu64"\n",
+        cpu->itlb.hits,
+        cpu->itlb.misses,
+        cpu->dtlb.hits,
+        cpu->dtlb.misses,
+        cpu->blocks->hits,
+        cpu->blocks->misses);
+}
+
 void
 cpu_take_trap(struct cpu* cpu, enum exception exception, enum interrupt interrupt) {
-    uint64_t exception_pc = cpu->pc - 4;
+    bool is_interrupt = interrupt != NONE;
+
+    /* A trap between lr and sc makes the sc fail. */
+    cpu->reserved = false;
+    cpu_flush_fetch_page(cpu);
+
+    /*
+     * Exceptions are raised with the PC already inst_len bytes past the
+     * faulting instruction; interrupts are taken between instructions, so
+     * the PC is the next one to execute.
+     */
+    uint64_t exception_pc = is_interrupt ? cpu->pc : cpu->pc - cpu->inst_len;
     enum mode previous_mode = cpu->mode;
 
-    bool is_interrupt = interrupt != NONE;
     uint64_t cause = exception;
     if (is_interrupt) {
         cause = ((uint64_t)1 << 63) | (uint64_t)interrupt;
+        cpu->stats.interrupts[interrupt] += 1;
+    } else {
+        cpu->stats.exceptions[exception] += 1;
     }
 
-    if (previous_mode <= SUPERVISOR && (((cpu_load_csr(cpu, MEDELEG) >> (uint32_t)cause) & 1) != 0)) {
+    uint64_t deleg = cpu_load_csr(cpu, is_interrupt ? MIDELEG : MEDELEG);
+    if (previous_mode <= SUPERVISOR && ((deleg >> (cause & 63)) & 1) != 0) {
         cpu->mode = SUPERVISOR;
         if (is_interrupt) {
             uint64_t vec = (cpu_load_csr(cpu, STVEC) & 1) == 1 ? (4 * cause) : 0;
@@ -657,36 +1208,75 @@ cpu_take_trap(struct cpu* cpu, enum exception exception, enum interrupt interrup
             ? cpu_load_csr(cpu, MSTATUS) | (1 << 7)
             : cpu_load_csr(cpu, MSTATUS) & ~(1 << 7));
         cpu_store_csr(cpu, MSTATUS, cpu_load_csr(cpu, MSTATUS) & ~(1 << 3));
-        cpu_store_csr(cpu, MSTATUS, cpu_load_csr(cpu, MSTATUS) & ~(3 << 11));
+        cpu_store_csr(cpu, MSTATUS, (cpu_load_csr(cpu, MSTATUS) & ~(3 << 11)) | ((uint64_t)previous_mode << 11));
     }
 }
 
+/*
+ * Evaluate the pending interrupts of the hart. Callers only need to do so
+ * when cpu_interrupt_may_be_pending() says something changed.
+ */
 enum interrupt
 cpu_check_pending_interrupt(struct cpu* cpu) {
-    if (cpu->mode == MACHINE) {
-        if (((cpu_load_csr(cpu, MSTATUS) >> 3) & 1) == 0) {
-            return NONE;
-        }
-    } else if (cpu->mode == SUPERVISOR) {
-        if (((cpu_load_csr(cpu, SSTATUS) >> 1) & 1) == 0) {
-            return NONE;
-        }
-    }
+    uint64_t hart = cpu_load_csr(cpu, MHARTID);
+    cpu->irq_check = false;
+    __atomic_fetch_and(&cpu->bus->irq.pending, ~((uint64_t)1 << hart), __ATOMIC_ACQ_REL);
+
+    /*
+     * Interrupts for a more privileged mode are always enabled, and those
+     * for the current mode only if its global enable bit is set.
+     */
+    uint64_t deleg = cpu_load_csr(cpu, MIDELEG);
+    uint64_t mstatus = cpu_load_csr(cpu, MSTATUS);
+    bool m_enabled = cpu->mode < MACHINE || ((mstatus >> 3) & 1) == 1;
+    bool s_enabled = cpu->mode < SUPERVISOR || (cpu->mode == SUPERVISOR && ((mstatus >> 1) & 1) == 1);
+    uint64_t enabled = cpu_load_csr(cpu, MIE) & ((m_enabled ? ~deleg : 0) | (s_enabled ? deleg : 0));
 
+    /*
+     * A device interrupt goes to the first hart that polls it with the
+     * source enabled in its PLIC context, and stays with it until the hart
+     * completes it. Devices are peeked at first so that idle polls take no
+     * lock, and only claimed by a hart that can take the interrupt now.
+     */
+    struct plic* plic = cpu->bus->plic;
+    uint64_t senable = (enabled & MIP_SEIP) && !(cpu_load_csr(cpu, MIP) & MIP_SEIP) ? plic->senable[hart] : 0;
     uint64_t irq = 0;
-    if (uart_interrupting(cpu->bus->uart)) {
-        irq = UART_IRQ;
-    } else if (virtio_is_interrupting(cpu->bus->virtio)) {
-        bus_disk_access(cpu->bus);
-        irq = VIRTIO_IRQ;
+    if (((senable >> UART_IRQ) & 1) && uart_may_interrupt(cpu->bus->uart) && plic_claim(plic, UART_IRQ)) {
+        if (uart_interrupting(cpu->bus->uart)) {
+            irq = UART_IRQ;
+        } else {
+            plic_complete(plic, UART_IRQ);
+        }
+    }
+    if (irq == 0 && ((senable >> VIRTIO_IRQ) & 1) && virtio_may_interrupt(cpu->bus->virtio)
+        && plic_claim(plic, VIRTIO_IRQ)) {
+        if (virtio_is_interrupting(cpu->bus->virtio)) {
+            irq = VIRTIO_IRQ;
+        } else {
+            plic_complete(plic, VIRTIO_IRQ);
+        }
     }
 
     if (irq != 0) {
-        bus_store(cpu->bus, PLIC_SCLAIM, 32, irq);
+        cpu->stats.external[irq] += 1;
+        plic->sclaim[hart] = irq;
         cpu_store_csr(cpu, MIP, cpu_load_csr(cpu, MIP) | MIP_SEIP);
     }
 
-    uint64_t pending = cpu_load_csr(cpu, MIE) & cpu_load_csr(cpu, MIP);
+    if (__atomic_load_n(&cpu->bus->clint->msip[hart], __ATOMIC_ACQUIRE) & 1) {
+        cpu_store_csr(cpu, MIP, cpu_load_csr(cpu, MIP) | MIP_MSIP);
+    }
+
+    /* The timer interrupt is level-triggered, it lasts until mtimecmp is moved. */
+    if ((__atomic_load_n(&cpu->bus->clint->mtip, __ATOMIC_ACQUIRE) >> hart) & 1) {
+        cpu_store_csr(cpu, MIP, cpu_load_csr(cpu, MIP) | MIP_MTIP);
+    } else {
+        cpu_store_csr(cpu, MIP, cpu_load_csr(cpu, MIP) & ~MIP_MTIP);
+    }
+
+    uint64_t pending = enabled & cpu_load_csr(cpu, MIP);
+    /* Whatever is left pending is taken after this one. */
+    cpu->irq_check = pending != 0;
     if (pending & MIP_MEIP) {
         cpu_store_csr(cpu, MIP, cpu_load_csr(cpu, MIP) & ~MIP_MEIP);
         return MACHINE_EXTERNAL_INTERRUPT;
@@ -696,7 +1286,6 @@ cpu_check_pending_interrupt(struct cpu* cpu) {
         return MACHINE_SOFTWARE_INTERRUPT;
     }
     if (pending & MIP_MTIP) {
-        cpu_store_csr(cpu, MIP, cpu_load_csr(cpu, MIP) & ~MIP_MTIP);
         return MACHINE_TIMER_INTERRUPT;
     }
     if (pending & MIP_SEIP) {
@@ -714,3 +1303,47 @@ cpu_check_pending_interrupt(struct cpu* cpu) {
 
     return NONE;
 }
+
+/*
+ * Idle after wfi: sleep on the host until the hart is notified of an
+ * interrupt or the next timer event is due. wfi may also end for nothing,
+ * guests loop around it.
+ */
+void
+cpu_wait_for_interrupt(struct cpu* cpu) {
+    struct bus* bus = cpu->bus;
+    uint64_t hart = cpu_load_csr(cpu, MHARTID);
+    uint64_t bit = (uint64_t)1 << hart;
+
+    /* Interrupts enabled in mie end wfi even if they are masked globally. */
+    uint64_t mie = cpu_load_csr(cpu, MIE);
+    if (cpu->irq_check || (mie & cpu_load_csr(cpu, MIP)) != 0) {
+        return;
+    }
+    uint64_t senable = plic_may_claim(bus->plic, bus->plic->senable[hart]);
+    if ((mie & MIP_SEIP) && ((((senable >> UART_IRQ) & 1) && uart_may_interrupt(bus->uart))
+        || (((senable >> VIRTIO_IRQ) & 1) && virtio_may_interrupt(bus->virtio)))) {
+        return;
+    }
+
+    if (timer_skip_to_next(bus->timer)) {
+        timer_poll(bus->timer);
+        return;
+    }
+
+    struct timespec deadline;
+    bool timed = timer_next_deadline(bus->timer, &deadline);
+    pthread_mutex_lock(&bus->irq.lock);
+    __atomic_fetch_or(&bus->irq.sleeping, bit, __ATOMIC_SEQ_CST);
+    while (!(__atomic_load_n(&bus->irq.pending, __ATOMIC_SEQ_CST) & bit)) {
+        if (!timed) {
+            pthread_cond_wait(&bus->irq.cond, &bus->irq.lock);
+        } else if (pthread_cond_timedwait(&bus->irq.cond, &bus->irq.lock, &deadline) == ETIMEDOUT) {
+            break;
+        }
+    }
+    __atomic_fetch_and(&bus->irq.sleeping, ~bit, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&bus->irq.lock);
+
+    timer_poll(bus->timer);
+}
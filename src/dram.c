@@ -1,119 +1,84 @@
 #include "nanoemu.h"
 
+/*
+ * DRAM is an anonymous mapping without swap reservation: pages the guest
+ * never touches read as zero and cost no host memory. NULL if the mapping
+ * fails or `code` does not fit.
+ */
 struct dram*
-dram_new(uint8_t* code, size_t code_size) {
+dram_new(uint64_t size, uint8_t* code, size_t code_size) {
+    if (code_size > size) {
+        errno = EINVAL;
+        return NULL;
+    }
+    void* data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (data == MAP_FAILED) {
+        return NULL;
+    }
+
     struct dram* dram = calloc(1, sizeof *dram);
-    dram->data = calloc(DRAM_SIZE, 1);
+    dram->data = data;
+    dram->size = size;
+    dram->code_gen = calloc(size / PAGE_SIZE, sizeof *dram->code_gen);
     memcpy(dram->data, code, code_size);
     return dram;
 }
 
-static inline uint64_t
-dram_load8(struct dram* dram, uint64_t addr) {
-    uint64_t index = addr - DRAM_BASE;
-    return dram->data[index];
-}
-
-static inline uint64_t
-dram_load16(struct dram* dram, uint64_t addr) {
-    uint64_t index = addr - DRAM_BASE;
-    return (uint64_t)(dram->data[index])
-        | ((uint64_t)(dram->data[index + 1]) << 8);
-}
-
-static inline uint64_t
-dram_load32(struct dram* dram, uint64_t addr) {
-    uint64_t index = addr - DRAM_BASE;
-    return (uint64_t)(dram->data[index])
-        | ((uint64_t)(dram->data[index + 1]) << 8)
-        | ((uint64_t)(dram->data[index + 2]) << 16)
-        | ((uint64_t)(dram->data[index + 3]) << 24);
+/* Host memory actually backing DRAM, against what is reserved. */
+void
+dram_dump_stats(struct dram* dram, FILE* f) {
+    uint64_t pages = dram->size / PAGE_SIZE;
+    uint64_t resident = 0;
+    unsigned char vec[1024];
+    for (uint64_t page = 0; page < pages; page += sizeof vec) {
+        uint64_t n = pages - page < sizeof vec ? pages - page : sizeof vec;
+        if (mincore(dram->data + page * PAGE_SIZE, n * PAGE_SIZE, vec) != 0) {
+            return;
+        }
+        for (uint64_t i = 0; i < n; i++) {
+            resident += vec[i] & 1;
+        }
+    }
+    fprintf(f, "dram resident=%"PRIu64" reserved=%"PRIu64" pages (%"PRIu64" of %"PRIu64" MiB)\n",
+        resident,
+        pages,
+        resident * PAGE_SIZE >> 20,
+        dram->size >> 20);
 }
 
-static inline uint64_t
-dram_load64(struct dram* dram, uint64_t addr) {
-    uint64_t index = addr - DRAM_BASE;
-    return (uint64_t)(dram->data[index])
-        | ((uint64_t)(dram->data[index + 1]) << 8)
-        | ((uint64_t)(dram->data[index + 2]) << 16)
-        | ((uint64_t)(dram->data[index + 3]) << 24)
-        | ((uint64_t)(dram->data[index + 4]) << 32)
-        | ((uint64_t)(dram->data[index + 5]) << 40)
-        | ((uint64_t)(dram->data[index + 6]) << 48)
-        | ((uint64_t)(dram->data[index + 7]) << 56);
+/* Retire decoded blocks of every page written by a DMA transfer. */
+void
+dram_invalidate_code_range(struct dram* dram, uint64_t addr, uint64_t len) {
+    for (uint64_t page = (addr - DRAM_BASE) / PAGE_SIZE; page <= (addr + len - 1 - DRAM_BASE) / PAGE_SIZE; page++) {
+        if (__atomic_load_n(&dram->code_gen[page], __ATOMIC_RELAXED) & 1) {
+            __atomic_fetch_add(&dram->code_gen[page], 1, __ATOMIC_ACQ_REL);
+        }
+    }
 }
 
 enum exception
 dram_load(struct dram* dram, uint64_t addr, uint64_t size, uint64_t *result) {
-    switch (size) {
-    case 8:
-        *result = dram_load8(dram, addr);
-        return OK;
-    case 16:
-        *result = dram_load16(dram, addr);
-        return OK;
-    case 32:
-        *result = dram_load32(dram, addr);
-        return OK;
-    case 64:
-        *result = dram_load64(dram, addr);
-        return OK;
-    default:
+    if (size != 8 && size != 16 && size != 32 && size != 64) {
         return LOAD_ACCESS_FAULT;
     }
-}
-
-static inline void
-dram_store8(struct dram* dram, uint64_t addr, uint64_t value) {
-    uint64_t index = addr - DRAM_BASE;
-    dram->data[index] = value;
-}
-
-static inline void
-dram_store16(struct dram* dram, uint64_t addr, uint64_t value) {
-    uint64_t index = addr - DRAM_BASE;
-    dram->data[index + 0] = (value >> 0) & 0xff;
-    dram->data[index + 1] = (value >> 8) & 0xff;
-}
-
-static inline void
-dram_store32(struct dram* dram, uint64_t addr, uint64_t value) {
-    uint64_t index = addr - DRAM_BASE;
-    dram->data[index + 0] = (value >>  0) & 0xff;
-    dram->data[index + 1] = (value >>  8) & 0xff;
-    dram->data[index + 2] = (value >> 16) & 0xff;
-    dram->data[index + 3] = (value >> 24) & 0xff;
-}
-
-static inline void
-dram_store64(struct dram* dram, uint64_t addr, uint64_t value) {
-    uint64_t index = addr - DRAM_BASE;
-    dram->data[index + 0] = (value >>  0) & 0xff;
-    dram->data[index + 1] = (value >>  8) & 0xff;
-    dram->data[index + 2] = (value >> 16) & 0xff;
-    dram->data[index + 3] = (value >> 24) & 0xff;
-    dram->data[index + 4] = (value >> 32) & 0xff;
-    dram->data[index + 5] = (value >> 40) & 0xff;
-    dram->data[index + 6] = (value >> 48) & 0xff;
-    dram->data[index + 7] = (value >> 56) & 0xff;
+    uint8_t* host = dram_host(dram, addr, size);
+    if (host == NULL) {
+        return LOAD_ACCESS_FAULT;
+    }
+    *result = host_load(host, size);
+    return OK;
 }
 
 enum exception
 dram_store(struct dram* dram, uint64_t addr, uint64_t size, uint64_t value) {
-    switch (size) {
-    case 8:
-        dram_store8(dram, addr, value);
-        return OK;
-    case 16:
-        dram_store16(dram, addr, value);
-        return OK;
-    case 32:
-        dram_store32(dram, addr, value);
-        return OK;
-    case 64:
-        dram_store64(dram, addr, value);
-        return OK;
-    default:
+    if (size != 8 && size != 16 && size != 32 && size != 64) {
+        return STORE_AMO_ACCESS_FAULT;
+    }
+    uint8_t* host = dram_host(dram, addr, size);
+    if (host == NULL) {
         return STORE_AMO_ACCESS_FAULT;
     }
+    dram_invalidate_code(dram, addr, size);
+    host_store(host, size, value);
+    return OK;
 }
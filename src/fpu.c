@@ -0,0 +1,473 @@
+#include "nanoemu.h"
+
+#include <fenv.h>
+#include <math.h>
+
+/*
+ * The F and D extensions, on host floating-point arithmetic.
+ *
+ * Every hart runs on its own host thread and the floating-point environment
+ * is per thread, so the host rounding mode follows the hart's and the host
+ * exception flags accumulate the hart's. They are folded into fcsr when the
+ * guest reads it or the hart parks, not after every instruction; emulation
+ * code on a hart thread must not raise flags of its own, which is why NaNs
+ * are told apart by their bits before any comparison.
+ *
+ * The host has no round-to-nearest, ties-to-max-magnitude mode: arithmetic
+ * in RMM rounds ties to even, only conversions to integers get it right.
+ */
+
+#define FFLAG_NX    0x01
+#define FFLAG_UF    0x02
+#define FFLAG_OF    0x04
+#define FFLAG_DZ    0x08
+#define FFLAG_NV    0x10
+
+#define RM_RMM      4
+#define RM_DYN      7
+
+#define NAN_BOX     ((uint64_t)0xffffffff << 32)
+
+/* Bit layout of a format, single (0) or double (1) precision. */
+struct fpu_format {
+    uint64_t sign;
+    uint64_t exp;
+    uint64_t frac;
+    uint64_t quiet;
+    uint64_t canonical;
+};
+
+static const struct fpu_format fpu_formats[2] = {
+    { (uint64_t)1 << 31, 0x7f800000, 0x7fffff, 0x400000, 0x7fc00000 },
+    { (uint64_t)1 << 63, (uint64_t)0x7ff << 52, ((uint64_t)1 << 52) - 1, (uint64_t)1 << 51, 0x7ff8000000000000 },
+};
+
+void
+fpu_sync_flags(struct cpu* cpu) {
+    static const struct {
+        int host;
+        uint64_t flag;
+    } flags[] = {
+        { FE_INEXACT, FFLAG_NX },
+        { FE_UNDERFLOW, FFLAG_UF },
+        { FE_OVERFLOW, FFLAG_OF },
+        { FE_DIVBYZERO, FFLAG_DZ },
+        { FE_INVALID, FFLAG_NV },
+    };
+    int raised = fetestexcept(FE_ALL_EXCEPT);
+    if (raised == 0) {
+        return;
+    }
+    for (size_t i = 0; i < sizeof flags / sizeof flags[0]; i++) {
+        if (raised & flags[i].host) {
+            cpu->csrs[FCSR] |= flags[i].flag;
+        }
+    }
+    feclearexcept(FE_ALL_EXCEPT);
+}
+
+static void
+fpu_set_dirty(struct cpu* cpu) {
+    cpu->csrs[MSTATUS] |= MSTATUS_FS | MSTATUS_SD;
+}
+
+/* Write fcsr. The flags raised on the host so far are replaced too. */
+void
+fpu_store_fcsr(struct cpu* cpu, uint64_t value) {
+    feclearexcept(FE_ALL_EXCEPT);
+    cpu->csrs[FCSR] = value & 0xff;
+    fpu_set_dirty(cpu);
+}
+
+/* Set the host rounding mode for `rm`. Returns the resolved mode, or -1 if it is reserved. */
+static int
+fpu_rounding(struct cpu* cpu, uint64_t rm) {
+    static const int modes[] = { FE_TONEAREST, FE_TOWARDZERO, FE_DOWNWARD, FE_UPWARD, FE_TONEAREST };
+    if (rm == RM_DYN) {
+        rm = (cpu->csrs[FCSR] >> 5) & 0x7;
+    }
+    if (rm > RM_RMM) {
+        return -1;
+    }
+    if (cpu->host_rm != rm) {
+        fesetround(modes[rm]);
+        cpu->host_rm = rm;
+    }
+    return rm;
+}
+
+/* Bits of register `r` in format `dbl`; a single that is not NaN-boxed reads as the canonical NaN. */
+static uint64_t
+fpu_bits(struct cpu* cpu, uint64_t r, bool dbl) {
+    uint64_t v = cpu->fregs[r];
+    if (dbl) {
+        return v;
+    }
+    return (v & NAN_BOX) == NAN_BOX ? (uint32_t)v : fpu_formats[0].canonical;
+}
+
+static float
+fpu_get_s(struct cpu* cpu, uint64_t r) {
+    uint32_t bits = fpu_bits(cpu, r, false);
+    float f;
+    memcpy(&f, &bits, sizeof f);
+    return f;
+}
+
+static double
+fpu_get_d(struct cpu* cpu, uint64_t r) {
+    double d;
+    memcpy(&d, &cpu->fregs[r], sizeof d);
+    return d;
+}
+
+/* Write a computed result; NaNs become the canonical NaN. */
+static void
+fpu_set_s(struct cpu* cpu, uint64_t r, float f) {
+    uint32_t bits;
+    memcpy(&bits, &f, sizeof bits);
+    cpu->fregs[r] = NAN_BOX | (isnan(f) ? fpu_formats[0].canonical : bits);
+}
+
+static void
+fpu_set_d(struct cpu* cpu, uint64_t r, double d) {
+    uint64_t bits;
+    memcpy(&bits, &d, sizeof bits);
+    cpu->fregs[r] = isnan(d) ? fpu_formats[1].canonical : bits;
+}
+
+static bool
+fpu_is_nan(uint64_t bits, const struct fpu_format* f) {
+    return (bits & f->exp) == f->exp && (bits & f->frac) != 0;
+}
+
+static bool
+fpu_is_snan(uint64_t bits, const struct fpu_format* f) {
+    return fpu_is_nan(bits, f) && (bits & f->quiet) == 0;
+}
+
+/* Value of bits that are not a NaN, widened to double exactly. */
+static double
+fpu_value(uint64_t bits, bool dbl) {
+    if (dbl) {
+        double d;
+        memcpy(&d, &bits, sizeof d);
+        return d;
+    }
+    uint32_t b = bits;
+    float f;
+    memcpy(&f, &b, sizeof f);
+    return f;
+}
+
+static uint64_t
+fpu_classify(uint64_t bits, const struct fpu_format* f) {
+    bool negative = (bits & f->sign) != 0;
+    uint64_t exp = bits & f->exp;
+    uint64_t frac = bits & f->frac;
+    if (exp == f->exp) {
+        if (frac == 0) {
+            return negative ? 1 << 0 : 1 << 7;
+        }
+        return (frac & f->quiet) != 0 ? 1 << 9 : 1 << 8;
+    }
+    if (exp == 0) {
+        if (frac == 0) {
+            return negative ? 1 << 3 : 1 << 4;
+        }
+        return negative ? 1 << 2 : 1 << 5;
+    }
+    return negative ? 1 << 1 : 1 << 6;
+}
+
+/* feq (quiet), flt and fle (signaling on any NaN). */
+static uint64_t
+fpu_compare(uint64_t a, uint64_t b, bool dbl, uint64_t funct3) {
+    const struct fpu_format* f = &fpu_formats[dbl];
+    if (fpu_is_nan(a, f) || fpu_is_nan(b, f)) {
+        if (funct3 != 0x2 || fpu_is_snan(a, f) || fpu_is_snan(b, f)) {
+            feraiseexcept(FE_INVALID);
+        }
+        return 0;
+    }
+    double x = fpu_value(a, dbl), y = fpu_value(b, dbl);
+    switch (funct3) {
+    case 0x0: return x <= y;
+    case 0x1: return x < y;
+    default: return x == y;
+    }
+}
+
+/* fmin and fmax: a NaN operand yields the other one, and -0 is below +0. */
+static uint64_t
+fpu_min_max(uint64_t a, uint64_t b, bool dbl, bool max) {
+    const struct fpu_format* f = &fpu_formats[dbl];
+    if (fpu_is_snan(a, f) || fpu_is_snan(b, f)) {
+        feraiseexcept(FE_INVALID);
+    }
+    if (fpu_is_nan(a, f)) {
+        return fpu_is_nan(b, f) ? f->canonical : b;
+    }
+    if (fpu_is_nan(b, f)) {
+        return a;
+    }
+    double x = fpu_value(a, dbl), y = fpu_value(b, dbl);
+    if (x == y) {
+        bool a_first = ((a & f->sign) != 0) != max;
+        return a_first ? a : b;
+    }
+    return (x < y) != max ? a : b;
+}
+
+/*
+ * fcvt to an integer: round `x` with `rm`, then convert to a word (0),
+ * unsigned word (1), long (2) or unsigned long (3). NaNs and values out of
+ * range are invalid and saturate; words are sign-extended.
+ */
+static uint64_t
+fpu_to_int(double x, int rm, uint64_t type) {
+    static const double lo[] = { -2147483648.0, 0.0, -9223372036854775808.0, 0.0 };
+    static const double hi[] = { 2147483648.0, 4294967296.0, 9223372036854775808.0, 18446744073709551616.0 };
+    static const uint64_t min[] = { (uint64_t)INT32_MIN, 0, (uint64_t)INT64_MIN, 0 };
+    static const uint64_t max[] = { INT32_MAX, UINT64_MAX, INT64_MAX, UINT64_MAX };
+    if (isnan(x)) {
+        feraiseexcept(FE_INVALID);
+        return max[type];
+    }
+    double r = rm == RM_RMM ? round(x) : nearbyint(x);
+    if (r < lo[type] || r >= hi[type]) {
+        feraiseexcept(FE_INVALID);
+        return r < lo[type] ? min[type] : max[type];
+    }
+    if (r != x) {
+        feraiseexcept(FE_INEXACT);
+    }
+    switch (type) {
+    case 0: return (int32_t)r;
+    case 1: return (int32_t)(uint32_t)r;
+    case 2: return (int64_t)r;
+    default: return (uint64_t)r;
+    }
+}
+
+/* fcvt from the integer x[rs1] of the given type, rounded in the host mode. */
+static void
+fpu_from_int(struct cpu* cpu, uint64_t rd, uint64_t value, uint64_t type, bool dbl) {
+    switch (type) {
+    case 0:
+        dbl ? fpu_set_d(cpu, rd, (int32_t)value) : fpu_set_s(cpu, rd, (int32_t)value);
+        break;
+    case 1:
+        dbl ? fpu_set_d(cpu, rd, (uint32_t)value) : fpu_set_s(cpu, rd, (uint32_t)value);
+        break;
+    case 2:
+        dbl ? fpu_set_d(cpu, rd, (int64_t)value) : fpu_set_s(cpu, rd, (int64_t)value);
+        break;
+    default:
+        dbl ? fpu_set_d(cpu, rd, value) : fpu_set_s(cpu, rd, value);
+        break;
+    }
+}
+
+/* The fused multiply-adds: (-)(rs1 * rs2) +/- rs3, rounded once by the host. */
+static enum exception
+fpu_execute_fma(struct cpu* cpu, uint32_t inst) {
+    uint64_t opcode = inst & 0x7f;
+    uint64_t rd = (inst >> 7) & 0x1f;
+    uint64_t rs1 = (inst >> 15) & 0x1f;
+    uint64_t rs2 = (inst >> 20) & 0x1f;
+    uint64_t rs3 = inst >> 27;
+    uint64_t fmt = (inst >> 25) & 0x3;
+    if (fmt > 1 || fpu_rounding(cpu, (inst >> 12) & 0x7) < 0) {
+        return ILLEGAL_INSTRUCTION;
+    }
+    /* fmsub and fnmadd subtract the addend, fnmsub and fnmadd negate the product. */
+    bool negate_product = opcode == 0x4b || opcode == 0x4f;
+    bool negate_addend = opcode == 0x47 || opcode == 0x4f;
+    if (fmt == 1) {
+        double a = fpu_get_d(cpu, rs1), b = fpu_get_d(cpu, rs2), c = fpu_get_d(cpu, rs3);
+        fpu_set_d(cpu, rd, fma(negate_product ? -a : a, b, negate_addend ? -c : c));
+    } else {
+        float a = fpu_get_s(cpu, rs1), b = fpu_get_s(cpu, rs2), c = fpu_get_s(cpu, rs3);
+        fpu_set_s(cpu, rd, fmaf(negate_product ? -a : a, b, negate_addend ? -c : c));
+    }
+    return OK;
+}
+
+/* rd = rs1 op rs2 in the format of the instruction. */
+#define FPU_ARITH(op) \
+    if (dbl) { \
+        fpu_set_d(cpu, rd, fpu_get_d(cpu, rs1) op fpu_get_d(cpu, rs2)); \
+    } else { \
+        fpu_set_s(cpu, rd, fpu_get_s(cpu, rs1) op fpu_get_s(cpu, rs2)); \
+    }
+
+/* OP-FP: arithmetic, sign injection, min/max, comparisons, conversions and moves. */
+static enum exception
+fpu_execute_op(struct cpu* cpu, uint32_t inst) {
+    uint64_t rd = (inst >> 7) & 0x1f;
+    uint64_t funct3 = (inst >> 12) & 0x7;
+    uint64_t rs1 = (inst >> 15) & 0x1f;
+    uint64_t rs2 = (inst >> 20) & 0x1f;
+    uint64_t funct5 = inst >> 27;
+    uint64_t fmt = (inst >> 25) & 0x3;
+    if (fmt > 1) {
+        return ILLEGAL_INSTRUCTION;
+    }
+    bool dbl = fmt == 1;
+    const struct fpu_format* f = &fpu_formats[dbl];
+
+    /* These round, funct3 holds their rounding mode. */
+    int rm = 0;
+    switch (funct5) {
+    case 0x00: case 0x01: case 0x02: case 0x03: case 0x0b:
+    case 0x08: case 0x18: case 0x1a:
+        if ((rm = fpu_rounding(cpu, funct3)) < 0) {
+            return ILLEGAL_INSTRUCTION;
+        }
+        break;
+    }
+
+    switch (funct5) {
+    case 0x00: FPU_ARITH(+) break;  /* fadd */
+    case 0x01: FPU_ARITH(-) break;  /* fsub */
+    case 0x02: FPU_ARITH(*) break;  /* fmul */
+    case 0x03: FPU_ARITH(/) break;  /* fdiv */
+    case 0x0b: /* fsqrt */
+        if (rs2 != 0) {
+            return ILLEGAL_INSTRUCTION;
+        }
+        dbl ? fpu_set_d(cpu, rd, sqrt(fpu_get_d(cpu, rs1))) : fpu_set_s(cpu, rd, sqrtf(fpu_get_s(cpu, rs1)));
+        break;
+    case 0x04: { /* fsgnj, fsgnjn, fsgnjx */
+        uint64_t a = fpu_bits(cpu, rs1, dbl), b = fpu_bits(cpu, rs2, dbl);
+        uint64_t sign;
+        switch (funct3) {
+        case 0x0: sign = b & f->sign; break;
+        case 0x1: sign = ~b & f->sign; break;
+        case 0x2: sign = (a ^ b) & f->sign; break;
+        default: return ILLEGAL_INSTRUCTION;
+        }
+        uint64_t bits = (a & ~f->sign) | sign;
+        cpu->fregs[rd] = dbl ? bits : NAN_BOX | bits;
+        break;
+    }
+    case 0x05: { /* fmin, fmax */
+        if (funct3 > 0x1) {
+            return ILLEGAL_INSTRUCTION;
+        }
+        uint64_t bits = fpu_min_max(fpu_bits(cpu, rs1, dbl), fpu_bits(cpu, rs2, dbl), dbl, funct3 == 0x1);
+        cpu->fregs[rd] = dbl ? bits : NAN_BOX | bits;
+        break;
+    }
+    case 0x08: /* fcvt.s.d, fcvt.d.s */
+        if (dbl && rs2 == 0) {
+            fpu_set_d(cpu, rd, fpu_get_s(cpu, rs1));
+        } else if (!dbl && rs2 == 1) {
+            fpu_set_s(cpu, rd, fpu_get_d(cpu, rs1));
+        } else {
+            return ILLEGAL_INSTRUCTION;
+        }
+        break;
+    case 0x14: /* fle, flt, feq */
+        if (funct3 > 0x2) {
+            return ILLEGAL_INSTRUCTION;
+        }
+        cpu->regs[rd] = fpu_compare(fpu_bits(cpu, rs1, dbl), fpu_bits(cpu, rs2, dbl), dbl, funct3);
+        break;
+    case 0x18: /* fcvt.w, fcvt.wu, fcvt.l, fcvt.lu */
+        if (rs2 > 3) {
+            return ILLEGAL_INSTRUCTION;
+        }
+        cpu->regs[rd] = fpu_to_int(dbl ? fpu_get_d(cpu, rs1) : fpu_get_s(cpu, rs1), rm, rs2);
+        break;
+    case 0x1a: /* fcvt from w, wu, l, lu */
+        if (rs2 > 3) {
+            return ILLEGAL_INSTRUCTION;
+        }
+        fpu_from_int(cpu, rd, cpu->regs[rs1], rs2, dbl);
+        break;
+    case 0x1c: /* fmv.x.w, fmv.x.d, fclass */
+        if (rs2 != 0) {
+            return ILLEGAL_INSTRUCTION;
+        }
+        if (funct3 == 0x0) {
+            cpu->regs[rd] = dbl ? cpu->fregs[rs1] : (uint64_t)(int32_t)cpu->fregs[rs1];
+        } else if (funct3 == 0x1) {
+            cpu->regs[rd] = fpu_classify(fpu_bits(cpu, rs1, dbl), f);
+        } else {
+            return ILLEGAL_INSTRUCTION;
+        }
+        return OK;
+    case 0x1e: /* fmv.w.x, fmv.d.x */
+        if (rs2 != 0 || funct3 != 0x0) {
+            return ILLEGAL_INSTRUCTION;
+        }
+        cpu->fregs[rd] = dbl ? cpu->regs[rs1] : NAN_BOX | (uint32_t)cpu->regs[rs1];
+        break;
+    default:
+        return ILLEGAL_INSTRUCTION;
+    }
+    fpu_set_dirty(cpu);
+    return OK;
+}
+
+/*
+ * Execute an F or D extension instruction. They are all illegal while
+ * mstatus.FS is off.
+ */
+enum exception
+fpu_execute(struct cpu* cpu, uint32_t inst) {
+    if ((cpu->csrs[MSTATUS] & MSTATUS_FS) == 0) {
+        return ILLEGAL_INSTRUCTION;
+    }
+
+    uint64_t opcode = inst & 0x7f;
+    uint64_t funct3 = (inst >> 12) & 0x7;
+    uint64_t rd = (inst >> 7) & 0x1f;
+    uint64_t rs1 = (inst >> 15) & 0x1f;
+    uint64_t rs2 = (inst >> 20) & 0x1f;
+    enum exception exception;
+
+    switch (opcode) {
+    case 0x07: { /* flw, fld */
+        uint64_t addr = cpu->regs[rs1] + (uint64_t)((int32_t)inst >> 20);
+        uint64_t value;
+        if (funct3 == 0x2) {
+            if ((exception = cpu_load(cpu, addr, 32, &value)) != OK) {
+                return exception;
+            }
+            cpu->fregs[rd] = NAN_BOX | value;
+        } else if (funct3 == 0x3) {
+            if ((exception = cpu_load(cpu, addr, 64, &value)) != OK) {
+                return exception;
+            }
+            cpu->fregs[rd] = value;
+        } else {
+            return ILLEGAL_INSTRUCTION;
+        }
+        fpu_set_dirty(cpu);
+        return OK;
+    }
+    case 0x27: { /* fsw, fsd */
+        uint64_t imm = (uint64_t)((int32_t)(inst & 0xfe000000) >> 20) | ((inst >> 7) & 0x1f);
+        uint64_t addr = cpu->regs[rs1] + imm;
+        if (funct3 == 0x2) {
+            return cpu_store(cpu, addr, 32, cpu->fregs[rs2]);
+        } else if (funct3 == 0x3) {
+            return cpu_store(cpu, addr, 64, cpu->fregs[rs2]);
+        }
+        return ILLEGAL_INSTRUCTION;
+    }
+    case 0x43:
+    case 0x47:
+    case 0x4b:
+    case 0x4f:
+        if ((exception = fpu_execute_fma(cpu, inst)) == OK) {
+            fpu_set_dirty(cpu);
+        }
+        return exception;
+    default:
+        return fpu_execute_op(cpu, inst);
+    }
+}
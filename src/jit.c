@@ -0,0 +1,609 @@
+#include "nanoemu.h"
+
+#if defined(__x86_64__) && !defined(_WIN32)
+
+#include <stddef.h>
+#include <sys/mman.h>
+
+/*
+ * A tiny x86-64 translator for hot blocks.
+ *
+ * Translated code follows the System V calling convention and is entered as
+ * `enum exception code(struct cpu* cpu)`. It keeps the cpu pointer in rbx and
+ * guest registers in cpu->regs; rax, rcx, rdx, rsi and rdi are scratch. The
+ * guest PC stays at the start of the block while translated code runs and is
+ * moved exactly once on the way out, so a trap always sees the PC past the
+ * faulting instruction, as it would in the interpreter.
+ *
+ * Only the leading run of micro-ops with a dedicated handler is translated;
+ * the interpreter picks up the rest of the block, which is where CSR and
+ * system instructions end up.
+ *
+ * Code cache policy: translations hang off blocks, which are keyed by
+ * physical address and hold no virtual addresses, so SATP writes don't
+ * flush anything; the inline TLB check reads the live TLB, which is already
+ * flushed. Self-modifying code bumps the page's code generation, the block
+ * is decoded again and its translation dropped. When the cache fills up,
+ * all translations are dropped at once.
+ *
+ * The cache is never writable and executable at once: it is mapped
+ * read-execute, and jit_compile() makes the pages it emits into writable
+ * only for as long as it takes. Each hart has its own cache, so no other
+ * thread runs code from those pages meanwhile.
+ */
+
+/* Upper bound for the host code of a single block. */
+#define JIT_MAX_BLOCK_CODE (BLOCK_MAX_INSTS * 256)
+
+#define RAX 0
+#define RCX 1
+#define RDX 2
+#define RSI 6
+#define RDI 7
+
+#define CPU_REG(r)  (offsetof(struct cpu, regs) + 8 * (r))
+#define CPU_PC      offsetof(struct cpu, pc)
+
+struct jit_emitter {
+    uint8_t* code;
+    size_t len;
+    /* Jumps to the shared "return OK" and "return eax" exits. */
+    size_t ok_fixups[BLOCK_MAX_INSTS * 4];
+    int ok_count;
+    size_t exit_fixups[BLOCK_MAX_INSTS * 4];
+    int exit_count;
+};
+
+static void
+emit8(struct jit_emitter* e, uint8_t byte) {
+    e->code[e->len++] = byte;
+}
+
+static void
+emit32(struct jit_emitter* e, uint32_t value) {
+    for (int i = 0; i < 4; i++) {
+        emit8(e, (value >> (8 * i)) & 0xff);
+    }
+}
+
+static void
+emit64(struct jit_emitter* e, uint64_t value) {
+    for (int i = 0; i < 8; i++) {
+        emit8(e, (value >> (8 * i)) & 0xff);
+    }
+}
+
+static void
+emit_bytes(struct jit_emitter* e, const uint8_t* bytes, size_t n) {
+    memcpy(e->code + e->len, bytes, n);
+    e->len += n;
+}
+
+#define EMIT(e, ...) do { \
+    const uint8_t bytes[] = { __VA_ARGS__ }; \
+    emit_bytes(e, bytes, sizeof bytes); \
+} while (0)
+
+/* Emit a rel32 jump or jcc and return the offset of its displacement. */
+static size_t
+emit_jump(struct jit_emitter* e, int cc) {
+    if (cc < 0) {
+        emit8(e, 0xe9);
+    } else {
+        EMIT(e, 0x0f, 0x80 | cc);
+    }
+    size_t at = e->len;
+    emit32(e, 0);
+    return at;
+}
+
+static void
+patch_jump(struct jit_emitter* e, size_t at, size_t target) {
+    uint32_t rel = (uint32_t)(target - (at + 4));
+    memcpy(e->code + at, &rel, 4);
+}
+
+#define CC_B    0x2
+#define CC_AE   0x3
+#define CC_E    0x4
+#define CC_NE   0x5
+#define CC_A    0x7
+#define CC_L    0xc
+#define CC_GE   0xd
+
+/* mov reg, [rbx + disp32] */
+static void
+emit_load_cpu(struct jit_emitter* e, int reg, uint32_t disp) {
+    EMIT(e, 0x48, 0x8b, 0x83 | (reg << 3));
+    emit32(e, disp);
+}
+
+/* mov [rbx + disp32], reg */
+static void
+emit_store_cpu(struct jit_emitter* e, uint32_t disp, int reg) {
+    EMIT(e, 0x48, 0x89, 0x83 | (reg << 3));
+    emit32(e, disp);
+}
+
+static void
+emit_load_reg(struct jit_emitter* e, int reg, int r) {
+    if (r == 0) {
+        /* xor reg, reg */
+        EMIT(e, 0x31, 0xc0 | (reg << 3) | reg);
+    } else {
+        emit_load_cpu(e, reg, CPU_REG(r));
+    }
+}
+
+static void
+emit_store_reg(struct jit_emitter* e, int r, int reg) {
+    if (r != 0) {
+        emit_store_cpu(e, CPU_REG(r), reg);
+    }
+}
+
+/* mov reg, imm */
+static void
+emit_mov_imm(struct jit_emitter* e, int reg, uint64_t imm) {
+    if ((int64_t)imm == (int32_t)imm) {
+        EMIT(e, 0x48, 0xc7, 0xc0 | reg);
+        emit32(e, imm);
+    } else {
+        EMIT(e, 0x48, 0xb8 | reg);
+        emit64(e, imm);
+    }
+}
+
+/* add qword [rbx + pc], imm32 */
+static void
+emit_add_pc(struct jit_emitter* e, int32_t imm) {
+    EMIT(e, 0x48, 0x81, 0x83);
+    emit32(e, CPU_PC);
+    emit32(e, imm);
+}
+
+/* Leave with the exception in eax, the PC `next` bytes past the block start. */
+static void
+emit_exit(struct jit_emitter* e, uint32_t next) {
+    emit_add_pc(e, next);
+    e->exit_fixups[e->exit_count++] = emit_jump(e, -1);
+}
+
+/* Leave with OK after the PC has been set. */
+static void
+emit_ok(struct jit_emitter* e) {
+    e->ok_fixups[e->ok_count++] = emit_jump(e, -1);
+}
+
+static uint64_t
+host_function(void (*f)(void)) {
+    return (uint64_t)(uintptr_t)f;
+}
+
+/*
+ * Compute the guest address of a load or store into rax, then look for a
+ * DRAM host address: rsi = dram->data and rcx = offset into it. Jumps that
+ * must take the slow path are returned in `slow`.
+ */
+static int
+emit_fast_address(struct jit_emitter* e, struct cpu* cpu, const struct uop* uop, int size, bool store, size_t* slow) {
+    int n = 0;
+    struct dram* dram = cpu->bus->dram;
+
+    emit_load_reg(e, RAX, uop->rs1);
+    /* add rax, imm32 */
+    EMIT(e, 0x48, 0x05);
+    emit32(e, uop->imm);
+
+    if (size > 1) {
+        /* test al, size - 1; misaligned accesses take the slow path. */
+        EMIT(e, 0xa8, size - 1);
+        slow[n++] = emit_jump(e, CC_NE);
+    }
+
+    /* mov rdx, rax; cmp byte [rbx + enable_paging], 0; je bare */
+    EMIT(e, 0x48, 0x89, 0xc2);
+    EMIT(e, 0x80, 0xbb);
+    emit32(e, offsetof(struct cpu, enable_paging));
+    emit8(e, 0);
+    size_t bare = emit_jump(e, CC_E);
+
+    /* Data TLB lookup, the same as tlb_lookup. */
+    uint32_t tlb = offsetof(struct cpu, dtlb) + offsetof(struct tlb, entries);
+    EMIT(e, 0x48, 0x89, 0xc1);                  /* mov rcx, rax */
+    EMIT(e, 0x48, 0xc1, 0xe9, 12);              /* shr rcx, 12 */
+    EMIT(e, 0x89, 0xce);                        /* mov esi, ecx */
+    EMIT(e, 0x81, 0xe6);                        /* and esi, TLB_SIZE - 1 */
+    emit32(e, TLB_SIZE - 1);
+    EMIT(e, 0x48, 0x69, 0xf6);                  /* imul rsi, rsi, sizeof entry */
+    emit32(e, sizeof(struct tlb_entry));
+    EMIT(e, 0x48, 0x8d, 0xbc, 0x33);            /* lea rdi, [rbx + rsi + tlb] */
+    emit32(e, tlb);
+    EMIT(e, 0x48, 0x39, 0x8f);                  /* cmp [rdi + vpn], rcx */
+    emit32(e, offsetof(struct tlb_entry, vpn));
+    slow[n++] = emit_jump(e, CC_NE);
+    EMIT(e, 0x80, 0xbf);                        /* cmp byte [rdi + valid], 0 */
+    emit32(e, offsetof(struct tlb_entry, valid));
+    emit8(e, 0);
+    slow[n++] = emit_jump(e, CC_E);
+    EMIT(e, 0x8b, 0xb3);                        /* mov esi, [rbx + mode] */
+    emit32(e, offsetof(struct cpu, mode));
+    EMIT(e, 0x39, 0xb7);                        /* cmp [rdi + mode], esi */
+    emit32(e, offsetof(struct tlb_entry, mode));
+    slow[n++] = emit_jump(e, CC_NE);
+    EMIT(e, 0x48, 0x8b, 0x97);                  /* mov rdx, [rdi + ppn] */
+    emit32(e, offsetof(struct tlb_entry, ppn));
+    EMIT(e, 0x48, 0xc1, 0xe2, 12);              /* shl rdx, 12 */
+    EMIT(e, 0x89, 0xc1);                        /* mov ecx, eax */
+    EMIT(e, 0x81, 0xe1);                        /* and ecx, 0xfff */
+    emit32(e, PAGE_SIZE - 1);
+    EMIT(e, 0x48, 0x09, 0xca);                  /* or rdx, rcx */
+    EMIT(e, 0x48, 0xff, 0x83);                  /* inc qword [rbx + hits] */
+    emit32(e, offsetof(struct cpu, dtlb) + offsetof(struct tlb, hits));
+
+    patch_jump(e, bare, e->len);
+    EMIT(e, 0x48, 0x89, 0xd1);                  /* mov rcx, rdx */
+    emit_mov_imm(e, RSI, DRAM_BASE);
+    EMIT(e, 0x48, 0x29, 0xf1);                  /* sub rcx, rsi */
+    emit_mov_imm(e, RSI, dram->size - size);
+    EMIT(e, 0x48, 0x39, 0xf1);                  /* cmp rcx, rsi */
+    slow[n++] = emit_jump(e, CC_A);
+
+    if (store) {
+        /* Stores to pages with decoded code go through cpu_store. */
+        EMIT(e, 0x48, 0x89, 0xcf);              /* mov rdi, rcx */
+        EMIT(e, 0x48, 0xc1, 0xef, 12);          /* shr rdi, 12 */
+        emit_mov_imm(e, RSI, (uint64_t)(uintptr_t)dram->code_gen);
+        EMIT(e, 0xf6, 0x04, 0xbe, 0x01);        /* test byte [rsi + rdi * 4], 1 */
+        slow[n++] = emit_jump(e, CC_NE);
+    }
+
+    emit_mov_imm(e, RSI, (uint64_t)(uintptr_t)dram->data);
+    return n;
+}
+
+static void
+emit_load(struct jit_emitter* e, struct cpu* cpu, const struct uop* uop, uint32_t offset) {
+    int size = 0;
+    switch (uop->id) {
+    case UOP_lb: case UOP_lbu: size = 1; break;
+    case UOP_lh: case UOP_lhu: size = 2; break;
+    case UOP_lw: case UOP_lwu: size = 4; break;
+    case UOP_ld: size = 8; break;
+    }
+
+    size_t slow[8];
+    int n = emit_fast_address(e, cpu, uop, size, false, slow);
+    switch (uop->id) {
+    case UOP_lb:  EMIT(e, 0x48, 0x0f, 0xbe, 0x04, 0x0e); break;  /* movsx rax, byte [rsi + rcx] */
+    case UOP_lbu: EMIT(e, 0x0f, 0xb6, 0x04, 0x0e); break;        /* movzx eax, byte [rsi + rcx] */
+    case UOP_lh:  EMIT(e, 0x48, 0x0f, 0xbf, 0x04, 0x0e); break;  /* movsx rax, word [rsi + rcx] */
+    case UOP_lhu: EMIT(e, 0x0f, 0xb7, 0x04, 0x0e); break;        /* movzx eax, word [rsi + rcx] */
+    case UOP_lw:  EMIT(e, 0x48, 0x63, 0x04, 0x0e); break;        /* movsxd rax, [rsi + rcx] */
+    case UOP_lwu: EMIT(e, 0x8b, 0x04, 0x0e); break;              /* mov eax, [rsi + rcx] */
+    case UOP_ld:  EMIT(e, 0x48, 0x8b, 0x04, 0x0e); break;        /* mov rax, [rsi + rcx] */
+    }
+    size_t done = emit_jump(e, -1);
+
+    /* Slow path: cpu_load(cpu, rax, size, rsp). */
+    for (int j = 0; j < n; j++) {
+        patch_jump(e, slow[j], e->len);
+    }
+    EMIT(e, 0x48, 0x89, 0xdf);                  /* mov rdi, rbx */
+    EMIT(e, 0x48, 0x89, 0xc6);                  /* mov rsi, rax */
+    emit8(e, 0xba);                             /* mov edx, size */
+    emit32(e, size * 8);
+    EMIT(e, 0x48, 0x89, 0xe1);                  /* mov rcx, rsp */
+    emit_mov_imm(e, RAX, host_function((void (*)(void))cpu_load));
+    EMIT(e, 0xff, 0xd0);                        /* call rax */
+    EMIT(e, 0x83, 0xf8, 0xff);                  /* cmp eax, OK */
+    size_t ok = emit_jump(e, CC_E);
+    emit_exit(e, offset + uop->len);
+    patch_jump(e, ok, e->len);
+    EMIT(e, 0x48, 0x8b, 0x04, 0x24);            /* mov rax, [rsp] */
+    switch (uop->id) {
+    case UOP_lb: EMIT(e, 0x48, 0x0f, 0xbe, 0xc0); break;         /* movsx rax, al */
+    case UOP_lh: EMIT(e, 0x48, 0x0f, 0xbf, 0xc0); break;         /* movsx rax, ax */
+    case UOP_lw: EMIT(e, 0x48, 0x63, 0xc0); break;               /* movsxd rax, eax */
+    }
+
+    patch_jump(e, done, e->len);
+    emit_store_reg(e, uop->rd, RAX);
+}
+
+static void
+emit_store(struct jit_emitter* e, struct cpu* cpu, struct block* block, const struct uop* uop, uint32_t offset) {
+    int size = 0;
+    switch (uop->id) {
+    case UOP_sb: size = 1; break;
+    case UOP_sh: size = 2; break;
+    case UOP_sw: size = 4; break;
+    case UOP_sd: size = 8; break;
+    }
+
+    size_t slow[8];
+    int n = emit_fast_address(e, cpu, uop, size, true, slow);
+    emit_load_reg(e, RDX, uop->rs2);
+    switch (uop->id) {
+    case UOP_sb: EMIT(e, 0x88, 0x14, 0x0e); break;               /* mov [rsi + rcx], dl */
+    case UOP_sh: EMIT(e, 0x66, 0x89, 0x14, 0x0e); break;         /* mov [rsi + rcx], dx */
+    case UOP_sw: EMIT(e, 0x89, 0x14, 0x0e); break;               /* mov [rsi + rcx], edx */
+    case UOP_sd: EMIT(e, 0x48, 0x89, 0x14, 0x0e); break;         /* mov [rsi + rcx], rdx */
+    }
+    size_t done = emit_jump(e, -1);
+
+    /* Slow path: cpu_store(cpu, rax, size, rs2). */
+    for (int j = 0; j < n; j++) {
+        patch_jump(e, slow[j], e->len);
+    }
+    EMIT(e, 0x48, 0x89, 0xdf);                  /* mov rdi, rbx */
+    EMIT(e, 0x48, 0x89, 0xc6);                  /* mov rsi, rax */
+    emit8(e, 0xba);                             /* mov edx, size */
+    emit32(e, size * 8);
+    emit_load_reg(e, RCX, uop->rs2);
+    emit_mov_imm(e, RAX, host_function((void (*)(void))cpu_store));
+    EMIT(e, 0xff, 0xd0);                        /* call rax */
+    EMIT(e, 0x83, 0xf8, 0xff);                  /* cmp eax, OK */
+    size_t ok = emit_jump(e, CC_E);
+    emit_exit(e, offset + uop->len);
+    patch_jump(e, ok, e->len);
+
+    /*
+     * Stop if the block has just overwritten its own code. Plain x86-64
+     * loads have acquire semantics, like the interpreter's check.
+     */
+    struct dram* dram = cpu->bus->dram;
+    emit_mov_imm(e, RSI, (uint64_t)(uintptr_t)&dram->code_gen[(block->paddr - DRAM_BASE) / PAGE_SIZE]);
+    EMIT(e, 0x81, 0x3e);                        /* cmp dword [rsi], code_gen */
+    emit32(e, block->code_gen);
+    size_t same = emit_jump(e, CC_E);
+    emit_add_pc(e, offset + uop->len);
+    emit_ok(e);
+    patch_jump(e, same, e->len);
+
+    patch_jump(e, done, e->len);
+}
+
+/* rax = rs1 op rcx, where rcx holds rs2 or the immediate. */
+static void
+emit_alu(struct jit_emitter* e, const struct uop* uop) {
+    switch (uop->id) {
+    case UOP_add: case UOP_addi: EMIT(e, 0x48, 0x01, 0xc8); break;
+    case UOP_sub: EMIT(e, 0x48, 0x29, 0xc8); break;
+    case UOP_and: case UOP_andi: EMIT(e, 0x48, 0x21, 0xc8); break;
+    case UOP_or: case UOP_ori: EMIT(e, 0x48, 0x09, 0xc8); break;
+    case UOP_xor: case UOP_xori: EMIT(e, 0x48, 0x31, 0xc8); break;
+    case UOP_sll: case UOP_slli: EMIT(e, 0x48, 0xd3, 0xe0); break;
+    case UOP_srl: case UOP_srli: EMIT(e, 0x48, 0xd3, 0xe8); break;
+    case UOP_sra: case UOP_srai: EMIT(e, 0x48, 0xd3, 0xf8); break;
+    case UOP_slt: case UOP_slti:
+        EMIT(e, 0x48, 0x39, 0xc8, 0x0f, 0x9c, 0xc0, 0x0f, 0xb6, 0xc0); break;
+    case UOP_sltu: case UOP_sltiu:
+        EMIT(e, 0x48, 0x39, 0xc8, 0x0f, 0x92, 0xc0, 0x0f, 0xb6, 0xc0); break;
+    case UOP_addw: case UOP_addiw: EMIT(e, 0x01, 0xc8, 0x48, 0x63, 0xc0); break;
+    case UOP_subw: EMIT(e, 0x29, 0xc8, 0x48, 0x63, 0xc0); break;
+    case UOP_sllw: case UOP_slliw: EMIT(e, 0xd3, 0xe0, 0x48, 0x63, 0xc0); break;
+    case UOP_srlw: case UOP_srliw: EMIT(e, 0xd3, 0xe8, 0x48, 0x63, 0xc0); break;
+    case UOP_sraw: case UOP_sraiw: EMIT(e, 0xd3, 0xf8, 0x48, 0x63, 0xc0); break;
+    case UOP_mul: EMIT(e, 0x48, 0x0f, 0xaf, 0xc1); break;
+    case UOP_mulw: EMIT(e, 0x0f, 0xaf, 0xc1, 0x48, 0x63, 0xc0); break;
+    }
+}
+
+static void
+emit_branch(struct jit_emitter* e, const struct uop* uop, uint32_t offset) {
+    static const int cc[] = {
+        [UOP_beq] = CC_E, [UOP_bne] = CC_NE, [UOP_blt] = CC_L,
+        [UOP_bge] = CC_GE, [UOP_bltu] = CC_B, [UOP_bgeu] = CC_AE,
+    };
+    emit_load_reg(e, RAX, uop->rs1);
+    emit_load_reg(e, RCX, uop->rs2);
+    EMIT(e, 0x48, 0x39, 0xc8);                  /* cmp rax, rcx */
+    size_t taken = emit_jump(e, cc[uop->id]);
+    emit_add_pc(e, offset + uop->len);
+    emit_ok(e);
+    patch_jump(e, taken, e->len);
+    emit_add_pc(e, offset + uop->imm);
+    emit_ok(e);
+}
+
+/* Translate one micro-op. Returns false if it needs the interpreter. */
+static bool
+emit_uop(struct jit_emitter* e, struct cpu* cpu, struct block* block, const struct uop* uop, uint32_t offset) {
+    switch (uop->id) {
+    case UOP_lui:
+        emit_mov_imm(e, RAX, uop->imm);
+        emit_store_reg(e, uop->rd, RAX);
+        return true;
+    case UOP_auipc:
+        emit_load_cpu(e, RAX, CPU_PC);
+        emit_mov_imm(e, RCX, offset + uop->imm);
+        EMIT(e, 0x48, 0x01, 0xc8);              /* add rax, rcx */
+        emit_store_reg(e, uop->rd, RAX);
+        return true;
+    case UOP_addi: case UOP_slti: case UOP_sltiu: case UOP_xori:
+    case UOP_ori: case UOP_andi: case UOP_slli: case UOP_srli:
+    case UOP_srai: case UOP_addiw: case UOP_slliw: case UOP_srliw:
+    case UOP_sraiw:
+        if (uop->rd == 0) {
+            return true;
+        }
+        emit_load_reg(e, RAX, uop->rs1);
+        emit_mov_imm(e, RCX, uop->imm);
+        emit_alu(e, uop);
+        emit_store_reg(e, uop->rd, RAX);
+        return true;
+    case UOP_add: case UOP_sub: case UOP_sll: case UOP_slt:
+    case UOP_sltu: case UOP_xor: case UOP_srl: case UOP_sra:
+    case UOP_or: case UOP_and: case UOP_addw: case UOP_subw:
+    case UOP_sllw: case UOP_srlw: case UOP_sraw: case UOP_mul:
+    case UOP_mulw:
+        if (uop->rd == 0) {
+            return true;
+        }
+        emit_load_reg(e, RAX, uop->rs1);
+        emit_load_reg(e, RCX, uop->rs2);
+        emit_alu(e, uop);
+        emit_store_reg(e, uop->rd, RAX);
+        return true;
+    case UOP_lb: case UOP_lh: case UOP_lw: case UOP_ld:
+    case UOP_lbu: case UOP_lhu: case UOP_lwu:
+        emit_load(e, cpu, uop, offset);
+        return true;
+    case UOP_sb: case UOP_sh: case UOP_sw: case UOP_sd:
+        emit_store(e, cpu, block, uop, offset);
+        return true;
+    case UOP_beq: case UOP_bne: case UOP_blt:
+    case UOP_bge: case UOP_bltu: case UOP_bgeu:
+        emit_branch(e, uop, offset);
+        return true;
+    case UOP_jal:
+        emit_load_cpu(e, RAX, CPU_PC);
+        EMIT(e, 0x48, 0x05);                    /* add rax, imm32 */
+        emit32(e, offset + uop->len);
+        emit_store_reg(e, uop->rd, RAX);
+        emit_add_pc(e, offset + uop->imm);
+        emit_ok(e);
+        return true;
+    case UOP_jalr:
+        emit_load_reg(e, RAX, uop->rs1);
+        EMIT(e, 0x48, 0x05);                    /* add rax, imm32 */
+        emit32(e, uop->imm);
+        EMIT(e, 0x48, 0x83, 0xe0, 0xfe);        /* and rax, ~1 */
+        emit_load_cpu(e, RDX, CPU_PC);
+        EMIT(e, 0x48, 0x81, 0xc2);              /* add rdx, imm32 */
+        emit32(e, offset + uop->len);
+        emit_store_cpu(e, CPU_PC, RAX);
+        emit_store_reg(e, uop->rd, RDX);
+        emit_ok(e);
+        return true;
+    default:
+        return false;
+    }
+}
+
+static bool
+jit_is_terminator(const struct uop* uop) {
+    switch (uop->id) {
+    case UOP_beq: case UOP_bne: case UOP_blt: case UOP_bge:
+    case UOP_bltu: case UOP_bgeu: case UOP_jal: case UOP_jalr:
+        return true;
+    default:
+        return false;
+    }
+}
+
+struct jit*
+jit_new() {
+    uint8_t* base = mmap(NULL, JIT_CACHE_SIZE, PROT_READ | PROT_EXEC,
+        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (base == MAP_FAILED) {
+        return NULL;
+    }
+
+    struct jit* jit = calloc(1, sizeof *jit);
+    jit->base = base;
+    jit->size = JIT_CACHE_SIZE;
+    return jit;
+}
+
+/*
+ * Drop every translation, the code cache is full. Blocks start counting
+ * their runs again, so the hot ones are translated anew.
+ */
+static void
+jit_flush(struct jit* jit, struct block_cache* cache) {
+    for (int i = 0; i < BLOCK_CACHE_SIZE; i++) {
+        cache->blocks[i].code = NULL;
+        cache->blocks[i].jit_len = 0;
+        cache->blocks[i].runs = 0;
+    }
+    jit->used = 0;
+    jit->flushes += 1;
+}
+
+bool
+jit_compile(struct jit* jit, struct cpu* cpu, struct block* block) {
+    if (jit->size - jit->used < JIT_MAX_BLOCK_CODE) {
+        jit_flush(jit, cpu->blocks);
+    }
+
+    /* Open the pages the block may be emitted into. */
+    uintptr_t page = sysconf(_SC_PAGESIZE);
+    uintptr_t start = (uintptr_t)(jit->base + jit->used) & ~(page - 1);
+    uintptr_t end = ((uintptr_t)(jit->base + jit->used) + JIT_MAX_BLOCK_CODE + page - 1) & ~(page - 1);
+    if (mprotect((void*)start, end - start, PROT_READ | PROT_WRITE) != 0) {
+        return false;
+    }
+
+    struct jit_emitter e;
+    e.code = jit->base + jit->used;
+    e.len = 0;
+    e.ok_count = 0;
+    e.exit_count = 0;
+
+    /* push rbx; sub rsp, 16; mov rbx, rdi */
+    EMIT(&e, 0x53, 0x48, 0x83, 0xec, 0x10, 0x48, 0x89, 0xfb);
+
+    int n = 0;
+    uint32_t offset = 0;
+    while (n < block->len && emit_uop(&e, cpu, block, &block->uops[n], offset)) {
+        offset += block->uops[n].len;
+        if (jit_is_terminator(&block->uops[n++])) {
+            break;
+        }
+    }
+    if (n == 0) {
+        mprotect((void*)start, end - start, PROT_READ | PROT_EXEC);
+        return false;
+    }
+    if (!jit_is_terminator(&block->uops[n - 1])) {
+        emit_add_pc(&e, offset);
+    }
+
+    for (int j = 0; j < e.ok_count; j++) {
+        patch_jump(&e, e.ok_fixups[j], e.len);
+    }
+    emit8(&e, 0xb8);                            /* mov eax, OK */
+    emit32(&e, (uint32_t)OK);
+    for (int j = 0; j < e.exit_count; j++) {
+        patch_jump(&e, e.exit_fixups[j], e.len);
+    }
+    /* add rsp, 16; pop rbx; ret */
+    EMIT(&e, 0x48, 0x83, 0xc4, 0x10, 0x5b, 0xc3);
+
+    if (mprotect((void*)start, end - start, PROT_READ | PROT_EXEC) != 0) {
+        return false;
+    }
+    block->code = e.code;
+    block->jit_len = n;
+    jit->used += (e.len + 15) & ~(size_t)15;
+    jit->blocks += 1;
+    return true;
+}
+
+enum exception
+jit_run(struct block* block, struct cpu* cpu) {
+    enum exception (*code)(struct cpu* cpu);
+    memcpy(&code, &block->code, sizeof code);
+    return code(cpu);
+}
+
+#else
+
+struct jit*
+jit_new() {
+    return NULL;
+}
+
+bool
+jit_compile(struct jit* jit, struct cpu* cpu, struct block* block) {
+    return false;
+}
+
+enum exception
+jit_run(struct block* block, struct cpu* cpu) {
+    return OK;
+}
+
+#endif
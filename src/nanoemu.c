@@ -1,63 +1,365 @@
 #include "nanoemu.h"
 
-int
-main(int argc, char** argv) {
-    if (argc != 2 && argc != 3) {
-        printf("Usage: nanoemu <filename> [<image>]\n");
-        exit(1);
+static void
+usage() {
+    printf("Usage: nanoemu [--jit] [--harts <n>] [--memory <MiB>] [--writeback] [--icount]\n"
+        "               [--save-snapshot <file>] [--restore-snapshot <file>] [--bench <script>]\n"
+        "               [--profile <file>] [--profile-symbols <elf>] [--profile-period <n>]\n"
+        "               <filename> [<image>]\n");
+    exit(1);
+}
+
+/* Serializes the final dump when a hart stops the machine. */
+static pthread_mutex_t halt_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* What the signal thread and the final dump need to see. */
+static struct {
+    struct bus* bus;
+    struct cpu* cpus[MAX_HARTS];
+    int harts;
+    uint64_t start_ns;
+    /* Where SIGUSR2 saves a snapshot, and the disk image it is taken against. */
+    const char* snapshot_path;
+    const char* disk_path;
+    /* The sampling profiler, and where it writes its folded stacks. */
+    struct profile* profile;
+    const char* profile_path;
+} machine;
+
+static uint64_t
+host_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void
+dump_stats(FILE* f) {
+    stats_dump(f, machine.bus, machine.cpus, machine.harts, (host_ns() - machine.start_ns) / 1e9);
+}
+
+/* Harts park at a block boundary while `pausing` is set, see save_snapshot(). */
+static pthread_mutex_t pause_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pause_cond = PTHREAD_COND_INITIALIZER;
+static bool pausing;
+static int parked;
+
+static void
+hart_park() {
+    pthread_mutex_lock(&pause_lock);
+    parked++;
+    pthread_cond_broadcast(&pause_cond);
+    while (pausing) {
+        pthread_cond_wait(&pause_cond, &pause_lock);
     }
+    parked--;
+    pthread_mutex_unlock(&pause_lock);
+}
 
-    FILE *f = fopen(argv[1], "rb");
-    if (f == NULL) {
-        printf("ERROR: %s\n", strerror(errno));
+/* Stop the machine, save it and exit. */
+static void
+save_snapshot() {
+    struct bus* bus = machine.bus;
+
+    pthread_mutex_lock(&pause_lock);
+    __atomic_store_n(&pausing, true, __ATOMIC_RELEASE);
+    irq_notify(&bus->irq, ALL_HARTS);
+    while (parked < machine.harts) {
+        pthread_cond_wait(&pause_cond, &pause_lock);
     }
+    pthread_mutex_unlock(&pause_lock);
 
-    uint8_t* binary = NULL;
-    uint8_t* disk = NULL;
-    size_t fsize = read_file(f, &binary);
+    /* In-flight disk requests complete before the queues are saved. */
+    virtio_quiesce(bus->virtio);
+    uart_flush(bus->uart);
+    pthread_mutex_lock(&halt_lock);
+    if (!snapshot_save(machine.snapshot_path, bus, machine.cpus, machine.harts, machine.disk_path)) {
+        printf("\nERROR: failed to save snapshot: %s\n", strerror(errno));
+        exit(1);
+    }
+    virtio_flush(bus->virtio);
+    printf("\nsnapshot saved to %s\n", machine.snapshot_path);
+    exit(0);
+}
+
+/* Registered with atexit(), so every way out of the emulator keeps the profile. */
+static void
+write_profile() {
+    if (!profile_write(machine.profile, machine.profile_path)) {
+        fprintf(stderr, "ERROR: failed to write the profile: %s\n", strerror(errno));
+    }
+}
 
-    if (argc == 3) {
-        FILE *f = fopen(argv[2], "rb");
-        if (f == NULL) {
-            printf("ERROR: %s\n", strerror(errno));
+/*
+ * SIGUSR1 prints statistics to stderr and writes the profile so far,
+ * SIGUSR2 saves a snapshot if asked to. While profiling, SIGINT and SIGTERM
+ * exit through write_profile().
+ */
+static void*
+signal_thread(void* opaque) {
+    sigset_t* set = opaque;
+    while (1) {
+        int sig;
+        if (sigwait(set, &sig) != 0) {
+            continue;
+        }
+        if (sig == SIGUSR1) {
+            dump_stats(stderr);
+            if (machine.profile != NULL) {
+                write_profile();
+            }
+        } else if (sig == SIGUSR2) {
+            save_snapshot();
+        } else {
+            exit(128 + sig);
         }
-        read_file(f, &disk);
     }
 
-    struct cpu* cpu = cpu_new(binary, fsize, disk);
-    free(binary);
+    /* Unreachable. */
+    return NULL;
+}
+
+/* Run one hart until it hits a fatal exception, then stop the machine. */
+static void*
+hart_thread(void* opaque) {
+    struct cpu* cpu = opaque;
 
     while (1) {
-        /* Fetch instruction. */
-        uint64_t inst;
         enum exception exception;
         enum interrupt interrupt;
-        if ((exception = cpu_fetch(cpu, &inst)) != OK) {
+
+        /* Fetch, decode & execute a block of instructions. */
+        if ((exception = cpu_run_block(cpu)) != OK) {
             cpu_take_trap(cpu, exception, NONE);
             if (exception_is_fatal(exception)) {
                 break;
             }
-            inst = 0;
         }
 
-        /* Advance PC. */
-        cpu->pc += 4;
+        /* Device events are only looked at every TIMER_QUANTUM instructions. */
+        if (cpu->instret - cpu->timer_instret >= TIMER_QUANTUM) {
+            timer_advance(cpu->bus->timer, cpu->instret - cpu->timer_instret);
+            cpu->timer_instret = cpu->instret;
+            timer_poll(cpu->bus->timer);
+        }
 
-        /* Decode & execute. */
-        if ((exception = cpu_execute(cpu, inst)) != OK) {
-            cpu_take_trap(cpu, exception, NONE);
-            if (exception_is_fatal(exception)) {
-                break;
-            }
+        if (machine.profile != NULL && cpu->instret >= machine.profile->next[cpu->csrs[MHARTID]]) {
+            profile_sample(machine.profile, cpu);
+        }
+
+        if (__atomic_load_n(&pausing, __ATOMIC_ACQUIRE)) {
+            /* The accrued FP flags live in this thread until synced. */
+            fpu_sync_flags(cpu);
+            hart_park();
         }
 
-        if ((interrupt = cpu_check_pending_interrupt(cpu)) != NONE) {
+        if (cpu_interrupt_may_be_pending(cpu) && (interrupt = cpu_check_pending_interrupt(cpu)) != NONE) {
             cpu_take_trap(cpu, OK, interrupt);
+        } else if (cpu->wfi) {
+            cpu_wait_for_interrupt(cpu);
         }
+        cpu->wfi = false;
     }
 
+    pthread_mutex_lock(&halt_lock);
+    virtio_flush(cpu->bus->virtio);
+    uart_flush(cpu->bus->uart);
+    printf("hart %"PRIu64" stopped\n", cpu_load_csr(cpu, MHARTID));
     cpu_dump_registers(cpu);
     printf("----------------------------------------------------------------------------------------------------------------------\n");
     cpu_dump_csrs(cpu);
+    printf("----------------------------------------------------------------------------------------------------------------------\n");
+    cpu_dump_caches(cpu);
+    printf("----------------------------------------------------------------------------------------------------------------------\n");
+    dump_stats(stdout);
+    exit(0);
+}
+
+int
+main(int argc, char** argv) {
+    static const struct option options[] = {
+        { "jit", no_argument, NULL, 'j' },
+        { "harts", required_argument, NULL, 'n' },
+        { "memory", required_argument, NULL, 'm' },
+        { "writeback", no_argument, NULL, 'w' },
+        { "icount", no_argument, NULL, 'i' },
+        { "save-snapshot", required_argument, NULL, 's' },
+        { "restore-snapshot", required_argument, NULL, 'r' },
+        { "bench", required_argument, NULL, 'b' },
+        { "profile", required_argument, NULL, 'p' },
+        { "profile-symbols", required_argument, NULL, 'S' },
+        { "profile-period", required_argument, NULL, 'P' },
+        { NULL, 0, NULL, 0 },
+    };
+
+    bool jit = false;
+    int harts = 1;
+    uint64_t dram_size = DRAM_DEFAULT_SIZE;
+    bool writeback = false;
+    bool icount = false;
+    const char* save_path = NULL;
+    const char* restore_path = NULL;
+    const char* bench_path = NULL;
+    const char* symbols_path = NULL;
+    uint64_t profile_period = PROFILE_PERIOD;
+    int opt;
+    while ((opt = getopt_long(argc, argv, "", options, NULL)) != -1) {
+        switch (opt) {
+        case 'j':
+            jit = true;
+            break;
+        case 'n':
+            harts = atoi(optarg);
+            if (harts < 1 || harts > MAX_HARTS) {
+                printf("ERROR: the number of harts must be between 1 and %d.\n", MAX_HARTS);
+                exit(1);
+            }
+            break;
+        case 'm':
+            dram_size = strtoull(optarg, NULL, 0);
+            if (dram_size == 0 || dram_size > DRAM_MAX_SIZE >> 20) {
+                printf("ERROR: the memory size must be between 1 and %"PRIu64" MiB.\n", DRAM_MAX_SIZE >> 20);
+                exit(1);
+            }
+            dram_size <<= 20;
+            break;
+        case 'w':
+            writeback = true;
+            break;
+        case 'i':
+            icount = true;
+            break;
+        case 's':
+            save_path = optarg;
+            break;
+        case 'r':
+            restore_path = optarg;
+            break;
+        case 'b':
+            bench_path = optarg;
+            break;
+        case 'p':
+            machine.profile_path = optarg;
+            break;
+        case 'S':
+            symbols_path = optarg;
+            break;
+        case 'P':
+            profile_period = strtoull(optarg, NULL, 0);
+            if (profile_period == 0) {
+                printf("ERROR: the profile period must be at least one instruction.\n");
+                exit(1);
+            }
+            break;
+        default:
+            usage();
+        }
+    }
+    argc -= optind;
+    argv += optind;
+
+    if (argc != 1 && argc != 2) {
+        usage();
+    }
+
+    /* Only the signal thread takes SIGUSR1 and SIGUSR2; threads created from here on inherit the mask. */
+    static sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGUSR1);
+    if (save_path != NULL) {
+        sigaddset(&signals, SIGUSR2);
+    }
+    if (machine.profile_path != NULL) {
+        sigaddset(&signals, SIGINT);
+        sigaddset(&signals, SIGTERM);
+    }
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+    machine.start_ns = host_ns();
+
+    FILE *f = fopen(argv[0], "rb");
+    if (f == NULL) {
+        printf("ERROR: %s\n", strerror(errno));
+    }
+
+    uint8_t* binary = NULL;
+    uint8_t* disk = NULL;
+    size_t disk_size = 0;
+    size_t fsize = read_file(f, &binary);
+
+    /*
+     * The disk image is mapped rather than read, copy-on-write unless guest
+     * writes should go back to the file.
+     */
+    if (argc == 2 && (disk = map_file(argv[1], writeback, &disk_size)) == NULL) {
+        printf("ERROR: %s\n", strerror(errno));
+        exit(1);
+    }
+
+    /*
+     * All harts share memory and devices, and start at DRAM_BASE. mtime
+     * follows the host clock, or the instruction count with --icount.
+     */
+    struct dram* dram = dram_new(dram_size, binary, fsize);
+    if (dram == NULL) {
+        printf("ERROR: cannot set up %"PRIu64" MiB of memory: %s\n", dram_size >> 20, strerror(errno));
+        exit(1);
+    }
+    struct bus* bus = bus_new(dram, timer_new(icount), virtio_new(disk, disk_size, writeback));
+    free(binary);
+
+    struct cpu** cpus = machine.cpus;
+    machine.bus = bus;
+    machine.harts = harts;
+    rvc_init();
+    for (int i = 0; i < harts; i++) {
+        cpus[i] = cpu_new(bus, i);
+        if (jit && (cpus[i]->jit = jit_new()) == NULL) {
+            printf("ERROR: the JIT is not available on this host.\n");
+            exit(1);
+        }
+    }
+
+    /* The snapshot brings its own memory and state, the kernel has already booted. */
+    if (restore_path != NULL && !snapshot_restore(restore_path, bus, cpus, harts)) {
+        printf("ERROR: failed to restore snapshot: %s\n", strerror(errno));
+        exit(1);
+    }
+
+    machine.snapshot_path = save_path;
+    machine.disk_path = argc == 2 ? argv[1] : NULL;
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, signal_thread, &signals) != 0) {
+        printf("ERROR: failed to start the signal thread.\n");
+        exit(1);
+    }
+
+    if (machine.profile_path != NULL) {
+        machine.profile = profile_new(profile_period);
+        if (symbols_path != NULL && !profile_load_symbols(machine.profile, symbols_path)) {
+            printf("ERROR: %s: %s\n", symbols_path, strerror(errno));
+            exit(1);
+        }
+        atexit(write_profile);
+    }
+
+    /* A benchmark script types into the console instead of the user. */
+    if (bench_path == NULL) {
+        uart_attach_stdin(bus->uart);
+    } else if (!bench_start(bench_path, bus, cpus, harts)) {
+        printf("ERROR: %s: %s\n", bench_path, strerror(errno));
+        exit(1);
+    }
+
+    /* Hart 0 runs on the main thread. */
+    for (int i = 1; i < harts; i++) {
+        pthread_t tid;
+        if (pthread_create(&tid, NULL, hart_thread, cpus[i]) != 0) {
+            printf("ERROR: failed to start hart %d.\n", i);
+            exit(1);
+        }
+    }
+    hart_thread(cpus[0]);
+
+    /* Unreachable. */
     return 0;
 }
@@ -1,41 +1,103 @@
 #include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
 #include <pthread.h>
+#include <signal.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <string.h>
+#include <time.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <inttypes.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #define SUPRESS_RETURN(x) (void)((x)+1)
 
-/* Xv6 uses only 128MiB of memory. */
-#define DRAM_SIZE 1024 * 1024 * 128
+/* Xv6 uses only 128MiB of memory; --memory changes the size of DRAM. */
+#define DRAM_DEFAULT_SIZE (1024 * 1024 * 128)
+#define DRAM_MAX_SIZE ((uint64_t)1024 * 1024 * 1024 * 64)
 
 /* Same as QEMU virt machine, DRAM starts at 0x80000000. */
 #define DRAM_BASE 0x80000000
 
+/* Xv6 is built for at most 8 harts. */
+#define MAX_HARTS 8
+#define ALL_HARTS (((uint64_t)1 << MAX_HARTS) - 1)
+
+/*
+ * Devices report interrupt state changes by setting the bits of the harts
+ * concerned in a shared word, which harts test at block boundaries instead
+ * of polling every device. Harts idling in wfi sleep on the condvar.
+ */
+struct irq {
+    uint64_t pending;
+    uint64_t sleeping;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+};
+
+static inline void
+irq_notify(struct irq* irq, uint64_t harts) {
+    __atomic_fetch_or(&irq->pending, harts, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&irq->sleeping, __ATOMIC_SEQ_CST) & harts) {
+        pthread_mutex_lock(&irq->lock);
+        pthread_cond_broadcast(&irq->cond);
+        pthread_mutex_unlock(&irq->lock);
+    }
+}
+
+/* Per-hart registers are laid out as in the QEMU virt machine. */
 #define CLINT_BASE      0x2000000
 #define CLINT_SIZE      0x10000
-#define CLINT_MTIMECMP  CLINT_BASE + 0x4000
-#define CLINT_MTIME     CLINT_BASE + 0xbff8
+#define CLINT_MSIP      (CLINT_BASE)
+#define CLINT_MTIMECMP  (CLINT_BASE + 0x4000)
+#define CLINT_MTIME     (CLINT_BASE + 0xbff8)
 
 #define PLIC_BASE       0xc000000
 #define PLIC_SIZE       0x4000000
-#define PLIC_PENDING    PLIC_BASE + 0x1000
-#define PLIC_SENABLE    PLIC_BASE + 0x2080
-#define PLIC_SPRIORITY  PLIC_BASE + 0x201000
-#define PLIC_SCLAIM     PLIC_BASE + 0x201004
+#define PLIC_PENDING    (PLIC_BASE + 0x1000)
+#define PLIC_SENABLE    (PLIC_BASE + 0x2080)
+#define PLIC_SPRIORITY  (PLIC_BASE + 0x201000)
+#define PLIC_SCLAIM     (PLIC_BASE + 0x201004)
+
+#define CLINT_MSIP_HART(hart)       (CLINT_MSIP + 4 * (hart))
+#define CLINT_MTIMECMP_HART(hart)   (CLINT_MTIMECMP + 8 * (hart))
+#define PLIC_SENABLE_HART(hart)     (PLIC_SENABLE + 0x100 * (hart))
+#define PLIC_SPRIORITY_HART(hart)   (PLIC_SPRIORITY + 0x2000 * (hart))
+#define PLIC_SCLAIM_HART(hart)      (PLIC_SCLAIM + 0x2000 * (hart))
 
 #define UART_BASE   0x10000000
 #define UART_SIZE   0x100
 #define UART_RHR    UART_BASE + 0
 #define UART_THR    UART_BASE + 0
+#define UART_IER    UART_BASE + 1
+#define UART_IIR    UART_BASE + 2
+#define UART_FCR    UART_BASE + 2
 #define UART_LCR    UART_BASE + 3
 #define UART_LSR    UART_BASE + 5
+#define UART_IER_RX     1
+#define UART_IER_TX     2
+#define UART_IIR_NONE   1
+#define UART_IIR_TX     2
+#define UART_IIR_RX     4
+#define UART_IIR_FIFO   0xc0
+#define UART_FCR_FIFO   1
+#define UART_FCR_RX_RESET 2
+#define UART_LCR_DLAB   0x80
 #define UART_LSR_RX 1
 #define UART_LSR_TX 1 << 5
+#define UART_LSR_TEMT 1 << 6
+
+/* Depth of the emulated 16550 FIFOs. */
+#define UART_FIFO_SIZE      16
+/* Longest output uart_expect() can wait for. */
+#define UART_EXPECT_MAX 16
+
+/* Output buffered on the host side of the transmit FIFO. */
+#define UART_TX_BUF_SIZE    4096
 
 #define VIRTIO_BASE             0x10001000
 #define VIRTIO_SIZE             0x1000
@@ -44,42 +106,92 @@
 #define VIRTIO_DEVICE_ID        VIRTIO_BASE + 0x008
 #define VIRTIO_VENDOR_ID        VIRTIO_BASE + 0x00c
 #define VIRTIO_DEVICE_FEATURES  VIRTIO_BASE + 0x010
+#define VIRTIO_DEVICE_FEATURES_SEL  VIRTIO_BASE + 0x014
 #define VIRTIO_DRIVER_FEATURES  VIRTIO_BASE + 0x020
+#define VIRTIO_DRIVER_FEATURES_SEL  VIRTIO_BASE + 0x024
 #define VIRTIO_GUEST_PAGE_SIZE  VIRTIO_BASE + 0x028
 #define VIRTIO_QUEUE_SEL        VIRTIO_BASE + 0x030
 #define VIRTIO_QUEUE_NUM_MAX    VIRTIO_BASE + 0x034
 #define VIRTIO_QUEUE_NUM        VIRTIO_BASE + 0x038
+#define VIRTIO_QUEUE_ALIGN      VIRTIO_BASE + 0x03c
 #define VIRTIO_QUEUE_PFN        VIRTIO_BASE + 0x040
 #define VIRTIO_QUEUE_NOTIFY     VIRTIO_BASE + 0x050
+#define VIRTIO_INTERRUPT_STATUS VIRTIO_BASE + 0x060
+#define VIRTIO_INTERRUPT_ACK    VIRTIO_BASE + 0x064
 #define VIRTIO_STATUS           VIRTIO_BASE + 0x070
 
 #define VIRTIO_VRING_DESC_SIZE  16
-#define VIRTIO_DESC_NUM         8
+/* Largest queue the driver may set up. */
+#define VIRTIO_QUEUE_MAX        1024
+
+#define VIRTQ_DESC_F_NEXT       1
+#define VIRTQ_DESC_F_WRITE      2
+#define VIRTQ_AVAIL_F_NO_INTERRUPT  1
+#define VIRTQ_USED_F_NO_NOTIFY  1
+
+#define VIRTIO_F_EVENT_IDX      29
+#define VIRTIO_BLK_F_FLUSH      9
+#define VIRTIO_BLK_T_IN         0
+#define VIRTIO_BLK_T_OUT        1
+#define VIRTIO_BLK_T_FLUSH      4
+#define VIRTIO_BLK_S_OK         0
+#define VIRTIO_BLK_S_IOERR      1
+#define VIRTIO_BLK_S_UNSUPP     2
+
+#define VIRTIO_SECTOR_SIZE      512
 
 #define VIRTIO_IRQ  1
 #define UART_IRQ    10
 
+/* Floating-point CSRs; fflags and frm are fields of fcsr */
+#define FFLAGS      0x001
+#define FRM         0x002
+#define FCSR        0x003
+
+/* Vector CSRs; vxsat and vxrm are fields of vcsr */
+#define VSTART      0x008
+#define VXSAT       0x009
+#define VXRM        0x00a
+#define VCSR        0x00f
+#define VL          0xc20
+#define VTYPE       0xc21
+#define VLENB       0xc22
+
 /* Machine level CSRs */
+#define MHARTID     0xf14
 #define MSTATUS     0x300
 #define MEDELEG     0x302
 #define MIDELEG     0x303
 #define MIE         0x304
 #define MTVEC       0x305
+#define MCOUNTEREN  0x306
 #define MEPC        0x341
 #define MCAUSE      0x342
 #define MTVAL       0x343
 #define MIP         0x344
+#define MCYCLE      0xb00
+#define MINSTRET    0xb02
+#define MHPMCOUNTER3    0xb03
+#define MHPMCOUNTER31   0xb1f
 
 /* Supervisor level CSRs */
 #define SSTATUS     0x100
 #define SIE         0x104
 #define STVEC       0x105
+#define SCOUNTEREN  0x106
 #define SEPC        0x141
 #define SCAUSE      0x142
 #define STVAL       0x143
 #define SIP         0x144
 #define SATP        0x180
 
+/* User level counters, read-only views of the machine ones */
+#define CYCLE       0xc00
+#define TIME        0xc01
+#define INSTRET     0xc02
+#define HPMCOUNTER3     0xc03
+#define HPMCOUNTER31    0xc1f
+
 #define MIP_SSIP ((uint64_t)1 << 1)
 #define MIP_MSIP ((uint64_t)1 << 3)
 #define MIP_STIP ((uint64_t)1 << 5)
@@ -87,6 +199,24 @@
 #define MIP_SEIP ((uint64_t)1 << 9)
 #define MIP_MEIP ((uint64_t)1 << 11)
 
+/* Only supervisor interrupts can be delegated. */
+#define MIDELEG_MASK (MIP_SSIP | MIP_STIP | MIP_SEIP)
+
+/* mstatus.FS and VS track the floating-point and vector state, SD summarizes them. */
+#define MSTATUS_VS          ((uint64_t)3 << 9)
+#define MSTATUS_VS_INITIAL  ((uint64_t)1 << 9)
+#define MSTATUS_FS          ((uint64_t)3 << 13)
+#define MSTATUS_FS_INITIAL  ((uint64_t)1 << 13)
+#define MSTATUS_SD          ((uint64_t)1 << 63)
+
+/* The mstatus fields visible through sstatus: SIE, SPIE, SPP, VS, FS, XS, SUM, MXR, UXL and SD. */
+#define SSTATUS_MASK (0x2 | 0x20 | 0x100 | 0x600 | 0x6000 | 0x18000 | 0x40000 | 0x80000 | ((uint64_t)3 << 32) | ((uint64_t)1 << 63))
+
+/* Vector registers are VLEN bits, one host SIMD register. */
+#define VLEN        128
+#define VLEN_BYTES  (VLEN / 8)
+#define VTYPE_VILL  ((uint64_t)1 << 63)
+
 #define PAGE_SIZE 4096
 
 enum exception {
@@ -124,11 +254,124 @@ bool
 exception_is_fatal(enum exception exception);
 
 struct dram {
+    /* Reserved up front, host pages are only allocated when first touched. */
     uint8_t* data;
+    uint64_t size;
+    /*
+     * Per-page generation numbers for decoded code. The low bit marks a page
+     * that blocks were decoded from; a store to such a page bumps the number
+     * so that every block holding the old one is stale.
+     */
+    uint32_t* code_gen;
 };
 
 struct dram*
-dram_new(uint8_t* code, size_t code_size);
+dram_new(uint64_t size, uint8_t* code, size_t code_size);
+
+void
+dram_dump_stats(struct dram* dram, FILE* f);
+
+/* Guest memory is little-endian; convert on big-endian hosts. */
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#define LE16(x) __builtin_bswap16(x)
+#define LE32(x) __builtin_bswap32(x)
+#define LE64(x) __builtin_bswap64(x)
+#else
+#define LE16(x) (x)
+#define LE32(x) (x)
+#define LE64(x) (x)
+#endif
+
+/*
+ * Resolve a guest physical access of `size` bits to a host pointer, or NULL
+ * if it is not entirely inside DRAM.
+ */
+static inline uint8_t*
+dram_host(struct dram* dram, uint64_t addr, uint64_t size) {
+    if (addr - DRAM_BASE > dram->size - size / 8) {
+        return NULL;
+    }
+    return dram->data + (addr - DRAM_BASE);
+}
+
+/*
+ * Resolve `len` bytes of guest physical memory for a DMA transfer, or NULL
+ * if the range is not entirely inside DRAM.
+ */
+static inline uint8_t*
+dram_range(struct dram* dram, uint64_t addr, uint64_t len) {
+    if (len > dram->size || addr - DRAM_BASE > dram->size - len) {
+        return NULL;
+    }
+    return dram->data + (addr - DRAM_BASE);
+}
+
+static inline uint64_t
+host_load(const uint8_t* p, uint64_t size) {
+    switch (size) {
+    case 8:
+        return *p;
+    case 16: {
+        uint16_t v;
+        memcpy(&v, p, sizeof v);
+        return LE16(v);
+    }
+    case 32: {
+        uint32_t v;
+        memcpy(&v, p, sizeof v);
+        return LE32(v);
+    }
+    default: {
+        uint64_t v;
+        memcpy(&v, p, sizeof v);
+        return LE64(v);
+    }
+    }
+}
+
+static inline void
+host_store(uint8_t* p, uint64_t size, uint64_t value) {
+    switch (size) {
+    case 8:
+        *p = value;
+        break;
+    case 16: {
+        uint16_t v = LE16((uint16_t)value);
+        memcpy(p, &v, sizeof v);
+        break;
+    }
+    case 32: {
+        uint32_t v = LE32((uint32_t)value);
+        memcpy(p, &v, sizeof v);
+        break;
+    }
+    default: {
+        uint64_t v = LE64(value);
+        memcpy(p, &v, sizeof v);
+        break;
+    }
+    }
+}
+
+/*
+ * Retire decoded blocks of the pages written by a store of `size` bits.
+ * Other harts and the I/O thread update the same generations, so the bump
+ * is atomic; block_fill() sets the low bit the same way.
+ */
+static inline void
+dram_invalidate_code(struct dram* dram, uint64_t addr, uint64_t size) {
+    uint32_t* first = &dram->code_gen[(addr - DRAM_BASE) / PAGE_SIZE];
+    uint32_t* last = &dram->code_gen[(addr + size / 8 - 1 - DRAM_BASE) / PAGE_SIZE];
+    if (__atomic_load_n(first, __ATOMIC_RELAXED) & 1) {
+        __atomic_fetch_add(first, 1, __ATOMIC_ACQ_REL);
+    }
+    if (last != first && (__atomic_load_n(last, __ATOMIC_RELAXED) & 1)) {
+        __atomic_fetch_add(last, 1, __ATOMIC_ACQ_REL);
+    }
+}
+
+void
+dram_invalidate_code_range(struct dram* dram, uint64_t addr, uint64_t len);
 
 enum exception
 dram_load(struct dram* dram, uint64_t addr, uint64_t size, uint64_t *result);
@@ -136,13 +379,86 @@ dram_load(struct dram* dram, uint64_t addr, uint64_t size, uint64_t *result);
 enum exception
 dram_store(struct dram* dram, uint64_t addr, uint64_t size, uint64_t value);
 
+/* Timebase of mtime, same as the QEMU virt machine. */
+#define TIMER_FREQ 10000000
+
+/* With --icount, mtime advances one tick per this many retired instructions. */
+#define TIMER_INSTS_PER_TICK 10
+
+/* Instructions a hart runs between two looks at the event queue. */
+#define TIMER_QUANTUM 1024
+
+#define MAX_EVENTS 32
+
+typedef void (*event_fn)(void* opaque, uint64_t arg);
+
+struct event {
+    uint64_t when;
+    event_fn fn;
+    void* opaque;
+    uint64_t arg;
+};
+
+/*
+ * Virtual time, from the host monotonic clock or, with --icount, from the
+ * number of retired instructions, and the device events scheduled on it.
+ */
+struct timer {
+    bool icount;
+    uint64_t base_ns;
+    uint64_t insts;
+    /* Added to the clock so that mtime can be written. */
+    uint64_t offset;
+    pthread_mutex_t lock;
+    struct event events[MAX_EVENTS];
+    int nevents;
+    /* Deadline of the earliest event, UINT64_MAX if there is none. */
+    uint64_t next;
+    /* Harts to wake when an earlier event is scheduled, see cpu_wait_for_interrupt(). */
+    struct irq* irq;
+};
+
+struct timer*
+timer_new(bool icount);
+
+uint64_t
+timer_now(struct timer* timer);
+
+void
+timer_set_now(struct timer* timer, uint64_t value);
+
+void
+timer_advance(struct timer* timer, uint64_t insts);
+
+void
+timer_schedule(struct timer* timer, uint64_t when, event_fn fn, void* opaque, uint64_t arg);
+
+void
+timer_cancel(struct timer* timer, event_fn fn, void* opaque, uint64_t arg);
+
+void
+timer_poll(struct timer* timer);
+
+bool
+timer_next_deadline(struct timer* timer, struct timespec* deadline);
+
+bool
+timer_skip_to_next(struct timer* timer);
+
 struct clint {
-    uint64_t mtime;
-    uint64_t mtimecmp;
+    struct timer* timer;
+    struct irq* irq;
+    uint32_t msip[MAX_HARTS];
+    uint64_t mtimecmp[MAX_HARTS];
+    /* Harts whose mtimecmp has been reached, reflected into their MIP.MTIP. */
+    uint64_t mtip;
 };
 
 struct clint*
-clint_new();
+clint_new(struct timer* timer, struct irq* irq);
+
+void
+clint_set_mtimecmp(struct clint* clint, uint64_t hart, uint64_t value);
 
 enum exception
 clint_load(struct clint* clint, uint64_t addr, uint64_t size, uint64_t *result);
@@ -150,15 +466,19 @@ clint_load(struct clint* clint, uint64_t addr, uint64_t size, uint64_t *result);
 enum exception
 clint_store(struct clint* clint, uint64_t addr, uint64_t size, uint64_t value);
 
+/* Only the supervisor context of each hart is implemented. */
 struct plic {
     uint64_t pending;
-    uint64_t senable;
-    uint64_t spriority;
-    uint64_t sclaim;
+    uint64_t senable[MAX_HARTS];
+    uint64_t spriority[MAX_HARTS];
+    uint64_t sclaim[MAX_HARTS];
+    /* Sources claimed by a hart and not yet completed. */
+    uint64_t claimed;
+    struct irq* irq;
 };
 
 struct plic*
-plic_new();
+plic_new(struct irq* irq);
 
 enum exception
 plic_load(struct plic* plic, uint64_t addr, uint64_t size, uint64_t *result);
@@ -166,17 +486,77 @@ plic_load(struct plic* plic, uint64_t addr, uint64_t size, uint64_t *result);
 enum exception
 plic_store(struct plic* plic, uint64_t addr, uint64_t size, uint64_t value);
 
+bool
+plic_claim(struct plic* plic, uint64_t irq);
+
+uint64_t
+plic_may_claim(struct plic* plic, uint64_t mask);
+
+void
+plic_complete(struct plic* plic, uint64_t irq);
+
+/*
+ * Single-producer single-consumer byte ring. `head` is only written by the
+ * consumer and `tail` by the producer; both run freely and `size` is a
+ * power of two. Every hart is a producer of the transmit ring and a
+ * consumer of the receive ring, so they serialize on the UART's hart_lock.
+ */
+struct uart_ring {
+    uint8_t* buf;
+    uint32_t size;
+    uint32_t head;
+    uint32_t tail;
+    /* Set while the host thread on the other side sleeps on the ring. */
+    bool waiting;
+};
+
+/*
+ * A 16550 whose receive FIFO is filled by a stdin thread and whose
+ * transmit FIFO is drained into stdout by a writer thread. Harts never
+ * wait for either thread, only briefly for each other.
+ */
 struct uart {
     uint8_t data[UART_SIZE];
-    bool interrupting;
-
-    pthread_t tid;
+    uint8_t divisor[2];
+    struct uart_ring rx;
+    struct uart_ring tx;
+    uint8_t rx_buf[UART_FIFO_SIZE];
+    uint8_t tx_buf[UART_TX_BUF_SIZE];
+    /* The guest found the transmit FIFO full, and the THRE interrupt it raises on draining. */
+    bool tx_stalled;
+    bool thre_pending;
+    struct irq* irq;
+    /*
+     * Output the writer thread watches for, see uart_expect(): the last
+     * bytes written, and whether they ended with `expect`.
+     */
+    const char* expect;
+    char out_tail[UART_EXPECT_MAX];
+    size_t out_len;
+    bool expect_seen;
+
+    pthread_t rx_tid;
+    pthread_t tx_tid;
     pthread_mutex_t lock;
     pthread_cond_t cond;
+    /* Held by a hart around its side of either ring. */
+    pthread_mutex_t hart_lock;
 };
 
 struct uart*
-uart_new();
+uart_new(struct irq* irq);
+
+void
+uart_attach_stdin(struct uart* uart);
+
+void
+uart_send(struct uart* uart, const uint8_t* data, size_t len);
+
+void
+uart_expect(struct uart* uart, const char* text);
+
+bool
+uart_wait_expected(struct uart* uart, const struct timespec* deadline);
 
 enum exception
 uart_load(struct uart* uart, uint64_t addr, uint64_t size, uint64_t *result);
@@ -184,23 +564,53 @@ uart_load(struct uart* uart, uint64_t addr, uint64_t size, uint64_t *result);
 enum exception
 uart_store(struct uart* uart, uint64_t addr, uint64_t size, uint64_t value);
 
+bool
+uart_may_interrupt(struct uart* uart);
+
 bool
 uart_interrupting(struct uart* uart);
 
+void
+uart_flush(struct uart* uart);
+
 struct virtio {
-    uint64_t id;
+    /* Next slot of the available ring to serve, and of the used ring to fill. */
+    uint16_t last_avail;
+    uint16_t used_idx;
+    uint32_t device_features_sel;
     uint32_t driver_features;
+    uint32_t driver_features_sel;
     uint32_t page_size;
     uint32_t queue_sel;
     uint32_t queue_num;
+    uint32_t queue_align;
     uint32_t queue_pfn;
     uint32_t queue_notify;
+    uint32_t interrupt_status;
     uint32_t status;
     uint8_t *disk;
+    size_t disk_size;
+    /* The disk is a shared mapping of the image file, see map_file(). */
+    bool disk_shared;
+
+    /* DMA statistics, see virtio_dump_stats(). */
+    uint64_t bytes_read;
+    uint64_t bytes_written;
+    uint64_t dma_ns;
+
+    /* Set by the I/O thread once completed requests are in the used ring. */
+    bool interrupting;
+    /* The I/O thread is serving a notification. */
+    bool busy;
+
+    /* Serializes the registers between harts and the I/O thread. */
+    pthread_t tid;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
 };
 
 struct virtio*
-virtio_new(uint8_t* disk);
+virtio_new(uint8_t* disk, size_t disk_size, bool disk_shared);
 
 enum exception
 virtio_load(struct virtio* virtio, uint64_t addr, uint64_t size, uint64_t *result);
@@ -208,31 +618,67 @@ virtio_load(struct virtio* virtio, uint64_t addr, uint64_t size, uint64_t *resul
 enum exception
 virtio_store(struct virtio* virtio, uint64_t addr, uint64_t size, uint64_t value);
 
+bool
+virtio_may_interrupt(struct virtio* virtio);
+
 bool
 virtio_is_interrupting(struct virtio* virtio);
 
-uint64_t
-virtio_desc_addr(struct virtio* virtio);
+void
+virtio_wait_notify(struct virtio* virtio);
 
-uint64_t
-virtio_disk_read(struct virtio* virtio, uint64_t addr);
+void
+virtio_complete(struct virtio* virtio);
 
 void
-virtio_disk_write(struct virtio* virtio, uint64_t addr, uint64_t value);
+virtio_quiesce(struct virtio* virtio);
+
+struct virtq {
+    uint64_t num;
+    uint64_t desc;
+    uint64_t avail;
+    uint64_t used;
+    bool event_idx;
+};
 
-uint64_t
-virtio_new_id(struct virtio* virtio);
+bool
+virtio_queue(struct virtio* virtio, struct virtq* queue);
+
+bool
+virtio_disk_read(struct virtio* virtio, uint64_t offset, uint8_t* buf, uint64_t len);
+
+bool
+virtio_disk_write(struct virtio* virtio, uint64_t offset, const uint8_t* buf, uint64_t len);
+
+bool
+virtio_flush(struct virtio* virtio);
+
+void
+virtio_dump_stats(struct virtio* virtio, FILE* f, double seconds);
+
+/* Devices whose register accesses are counted in bus->mmio. */
+enum bus_device {
+    BUS_CLINT,
+    BUS_PLIC,
+    BUS_UART,
+    BUS_VIRTIO,
+    BUS_DEVICES,
+};
 
 struct bus {
     struct dram* dram;
+    struct timer* timer;
     struct clint* clint;
     struct plic* plic;
     struct uart* uart;
     struct virtio *virtio;
+    /* Harts that have to look at their interrupts again, see irq_notify(). */
+    struct irq irq;
+    uint64_t mmio[BUS_DEVICES];
 };
 
 struct bus*
-bus_new(struct dram* dram, struct virtio* virtio);
+bus_new(struct dram* dram, struct timer* timer, struct virtio* virtio);
 
 enum exception
 bus_load(struct bus* bus, uint64_t addr, uint64_t size, uint64_t *result);
@@ -240,34 +686,454 @@ bus_load(struct bus* bus, uint64_t addr, uint64_t size, uint64_t *result);
 enum exception
 bus_store(struct bus* bus, uint64_t addr, uint64_t size, uint64_t value);
 
-void
+bool
 bus_disk_access(struct bus* bus);
 
+void*
+bus_disk_thread(void* opaque);
+
 enum mode {
     USER = 0x0,
     SUPERVISOR = 0x1,
     MACHINE = 0x3
 };
 
+/* Number of entries in each direct-mapped TLB, must be a power of two. */
+#define TLB_SIZE 256
+
+/*
+ * Megapages and gigapages are cached one 4 KiB slice at a time, `level`
+ * tells which page table level the leaf came from.
+ */
+struct tlb_entry {
+    uint64_t vpn;
+    uint64_t ppn;
+    enum mode mode;
+    bool valid;
+    uint8_t level;
+};
+
+struct tlb {
+    struct tlb_entry entries[TLB_SIZE];
+    uint64_t hits;
+    uint64_t misses;
+    /* Whether any entry may be a superpage slice, see tlb_flush_page(). */
+    bool superpages;
+};
+
+bool
+tlb_lookup(struct tlb* tlb, uint64_t addr, enum mode mode, uint64_t *result);
+
+void
+tlb_insert(struct tlb* tlb, uint64_t addr, enum mode mode, uint64_t paddr, int level);
+
+void
+tlb_flush(struct tlb* tlb);
+
+void
+tlb_flush_page(struct tlb* tlb, uint64_t addr);
+
+/*
+ * M extension arithmetic, shared by cpu_execute and the block handlers.
+ * Division never traps: dividing by zero gives all ones or the dividend,
+ * and the one overflowing signed division gives the dividend back.
+ */
+static inline uint64_t
+alu_mulhu(uint64_t a, uint64_t b) {
+#ifdef __SIZEOF_INT128__
+    __extension__ typedef unsigned __int128 uint128;
+    return ((uint128)a * b) >> 64;
+#else
+    uint64_t lo = (a & 0xffffffff) * (b & 0xffffffff);
+    uint64_t mid1 = (a >> 32) * (b & 0xffffffff);
+    uint64_t mid2 = (a & 0xffffffff) * (b >> 32);
+    uint64_t carry = ((lo >> 32) + (mid1 & 0xffffffff) + (mid2 & 0xffffffff)) >> 32;
+    return (a >> 32) * (b >> 32) + (mid1 >> 32) + (mid2 >> 32) + carry;
+#endif
+}
+
+/* Signed operands are their unsigned value minus 2^64 when negative. */
+static inline uint64_t
+alu_mulh(uint64_t a, uint64_t b) {
+    return alu_mulhu(a, b) - ((int64_t)a < 0 ? b : 0) - ((int64_t)b < 0 ? a : 0);
+}
+
+static inline uint64_t
+alu_mulhsu(uint64_t a, uint64_t b) {
+    return alu_mulhu(a, b) - ((int64_t)a < 0 ? b : 0);
+}
+
+static inline uint64_t
+alu_div(uint64_t a, uint64_t b) {
+    if (b == 0) {
+        return UINT64_MAX;
+    }
+    if (a == (uint64_t)INT64_MIN && b == UINT64_MAX) {
+        return a;
+    }
+    return (int64_t)a / (int64_t)b;
+}
+
+static inline uint64_t
+alu_divu(uint64_t a, uint64_t b) {
+    return b == 0 ? UINT64_MAX : a / b;
+}
+
+static inline uint64_t
+alu_rem(uint64_t a, uint64_t b) {
+    if (b == 0) {
+        return a;
+    }
+    if (a == (uint64_t)INT64_MIN && b == UINT64_MAX) {
+        return 0;
+    }
+    return (int64_t)a % (int64_t)b;
+}
+
+static inline uint64_t
+alu_remu(uint64_t a, uint64_t b) {
+    return b == 0 ? a : a % b;
+}
+
+/* The word forms use the low 32 bits and sign-extend the result. */
+static inline uint64_t
+alu_divw(uint64_t a, uint64_t b) {
+    return (int32_t)alu_div((int32_t)a, (int32_t)b);
+}
+
+static inline uint64_t
+alu_divuw(uint64_t a, uint64_t b) {
+    return (int32_t)alu_divu((uint32_t)a, (uint32_t)b);
+}
+
+static inline uint64_t
+alu_remw(uint64_t a, uint64_t b) {
+    return (int32_t)alu_rem((int32_t)a, (int32_t)b);
+}
+
+static inline uint64_t
+alu_remuw(uint64_t a, uint64_t b) {
+    return (int32_t)alu_remu((uint32_t)a, (uint32_t)b);
+}
+
+/*
+ * Zbb arithmetic. The builtins are single host instructions where the host
+ * has them; counting the zeros of zero gives the register width.
+ */
+static inline uint64_t
+alu_clz(uint64_t a) {
+    return a == 0 ? 64 : __builtin_clzll(a);
+}
+
+static inline uint64_t
+alu_ctz(uint64_t a) {
+    return a == 0 ? 64 : __builtin_ctzll(a);
+}
+
+static inline uint64_t
+alu_clzw(uint64_t a) {
+    return (uint32_t)a == 0 ? 32 : __builtin_clz((uint32_t)a);
+}
+
+static inline uint64_t
+alu_ctzw(uint64_t a) {
+    return (uint32_t)a == 0 ? 32 : __builtin_ctz((uint32_t)a);
+}
+
+static inline uint64_t
+alu_rol(uint64_t a, uint64_t b) {
+    return (a << (b & 0x3f)) | (a >> (-b & 0x3f));
+}
+
+static inline uint64_t
+alu_ror(uint64_t a, uint64_t b) {
+    return (a >> (b & 0x3f)) | (a << (-b & 0x3f));
+}
+
+static inline uint64_t
+alu_rolw(uint64_t a, uint64_t b) {
+    uint32_t w = a;
+    return (int32_t)((w << (b & 0x1f)) | (w >> (-b & 0x1f)));
+}
+
+static inline uint64_t
+alu_rorw(uint64_t a, uint64_t b) {
+    uint32_t w = a;
+    return (int32_t)((w >> (b & 0x1f)) | (w << (-b & 0x1f)));
+}
+
+/* Every non-zero byte becomes 0xff, without a loop over the bytes. */
+static inline uint64_t
+alu_orcb(uint64_t a) {
+    uint64_t high = (((a & 0x7f7f7f7f7f7f7f7f) + 0x7f7f7f7f7f7f7f7f) | a) & 0x8080808080808080;
+    return (high >> 7) * 0xff;
+}
+
+/* Longest straight-line run decoded into one block. */
+#define BLOCK_MAX_INSTS 64
+
+/* Number of blocks in the direct-mapped block cache, must be a power of two. */
+#define BLOCK_CACHE_SIZE 4096
+
+/*
+ * Micro-ops with a dedicated handler. The second column tells whether the
+ * micro-op may write memory and so invalidate the running block.
+ */
+#define UOPS(X) \
+    X(generic, true) \
+    X(lui, false) \
+    X(auipc, false) \
+    X(addi, false) \
+    X(slti, false) \
+    X(sltiu, false) \
+    X(xori, false) \
+    X(ori, false) \
+    X(andi, false) \
+    X(slli, false) \
+    X(srli, false) \
+    X(srai, false) \
+    X(addiw, false) \
+    X(slliw, false) \
+    X(srliw, false) \
+    X(sraiw, false) \
+    X(add, false) \
+    X(sub, false) \
+    X(sll, false) \
+    X(slt, false) \
+    X(sltu, false) \
+    X(xor, false) \
+    X(srl, false) \
+    X(sra, false) \
+    X(or, false) \
+    X(and, false) \
+    X(addw, false) \
+    X(subw, false) \
+    X(sllw, false) \
+    X(srlw, false) \
+    X(sraw, false) \
+    X(mul, false) \
+    X(mulh, false) \
+    X(mulhsu, false) \
+    X(mulhu, false) \
+    X(div, false) \
+    X(divu, false) \
+    X(rem, false) \
+    X(remu, false) \
+    X(mulw, false) \
+    X(divw, false) \
+    X(divuw, false) \
+    X(remw, false) \
+    X(remuw, false) \
+    X(sh1add, false) \
+    X(sh2add, false) \
+    X(sh3add, false) \
+    X(add_uw, false) \
+    X(slli_uw, false) \
+    X(andn, false) \
+    X(orn, false) \
+    X(xnor, false) \
+    X(min, false) \
+    X(minu, false) \
+    X(max, false) \
+    X(maxu, false) \
+    X(rol, false) \
+    X(ror, false) \
+    X(rori, false) \
+    X(clz, false) \
+    X(ctz, false) \
+    X(cpop, false) \
+    X(sext_b, false) \
+    X(sext_h, false) \
+    X(zext_h, false) \
+    X(rev8, false) \
+    X(orc_b, false) \
+    X(bset, false) \
+    X(bclr, false) \
+    X(binv, false) \
+    X(bext, false) \
+    X(bseti, false) \
+    X(bclri, false) \
+    X(binvi, false) \
+    X(bexti, false) \
+    X(lb, false) \
+    X(lh, false) \
+    X(lw, false) \
+    X(ld, false) \
+    X(lbu, false) \
+    X(lhu, false) \
+    X(lwu, false) \
+    X(sb, true) \
+    X(sh, true) \
+    X(sw, true) \
+    X(sd, true) \
+    X(beq, false) \
+    X(bne, false) \
+    X(blt, false) \
+    X(bge, false) \
+    X(bltu, false) \
+    X(bgeu, false) \
+    X(jal, false) \
+    X(jalr, false)
+
+#define UOP_ID(name, store) UOP_##name,
+enum uop_id {
+    UOPS(UOP_ID)
+    /* Terminates the micro-op array of every block. */
+    UOP_end
+};
+
+struct cpu;
+struct uop;
+
+typedef enum exception (*uop_handler)(struct cpu* cpu, const struct uop* uop);
+
+struct uop {
+    uop_handler handler;
+    uint8_t id;
+    uint8_t rd;
+    uint8_t rs1;
+    uint8_t rs2;
+    bool store;
+    /* Length of the instruction in bytes, 2 if it was compressed. */
+    uint8_t len;
+    /* The instruction, expanded to 32 bits. */
+    uint32_t inst;
+    uint64_t imm;
+};
+
+struct block {
+    uint64_t paddr;
+    uint32_t code_gen;
+    int len;
+    /* Host code for the first `jit_len` micro-ops, see src/jit.c. */
+    void* code;
+    int jit_len;
+    uint32_t runs;
+    struct uop uops[BLOCK_MAX_INSTS + 1];
+};
+
+struct block_cache {
+    struct block* blocks;
+    uint64_t hits;
+    uint64_t misses;
+};
+
+/* 32-bit expansions of the compressed instructions, see src/rvc.c. */
+extern uint32_t rvc_table[65536];
+
+void
+rvc_init();
+
+struct block_cache*
+block_cache_new();
+
+/* Number of runs through the interpreter before a block is translated. */
+#define JIT_THRESHOLD   32
+
+/* Size of the executable code cache. */
+#define JIT_CACHE_SIZE  1024 * 1024 * 16
+
+struct jit {
+    uint8_t* base;
+    size_t size;
+    size_t used;
+    uint64_t blocks;
+    uint64_t flushes;
+};
+
+struct jit*
+jit_new();
+
+bool
+jit_compile(struct jit* jit, struct cpu* cpu, struct block* block);
+
+enum exception
+jit_run(struct block* block, struct cpu* cpu);
+
+/* Host-side statistics of a hart, see stats_dump(). */
+struct cpu_stats {
+    uint64_t exceptions[16];
+    uint64_t interrupts[16];
+    /* External interrupts taken, by PLIC source. */
+    uint64_t external[32];
+};
+
 struct cpu {
     uint64_t regs[32];
+    /* Floating-point registers; single-precision values are NaN-boxed. */
+    uint64_t fregs[32];
+    /* Vector registers v0-v31 back to back, so register groups are contiguous. */
+    uint8_t vregs[32 * VLEN_BYTES];
     uint64_t pc;
     uint64_t csrs[4096];
     enum mode mode;
     struct bus* bus;
     bool enable_paging;
     uint64_t pagetable;
+    struct tlb itlb;
+    struct tlb dtlb;
+    struct block_cache* blocks;
+    struct jit* jit;
+    /* Set when a CSR write or xRET may have enabled a pending interrupt. */
+    bool irq_check;
+    /* Set by wfi, the run loop then idles until an interrupt may be pending. */
+    bool wfi;
+    /* Retired instructions, and the count at the last look at the event queue. */
+    uint64_t instret;
+    uint64_t timer_instret;
+    /* Instructions in the current block; instret only counts whole blocks. */
+    int block_len;
+    /* Length of the instruction executing, the PC is already past it. */
+    uint8_t inst_len;
+    /* Rounding mode the host thread is set to, see src/fpu.c. */
+    uint8_t host_rm;
+    struct cpu_stats stats;
+    /* LR/SC reservation: the address and the value loaded by lr. */
+    bool reserved;
+    uint64_t reservation;
+    uint64_t reservation_value;
+    /*
+     * Fetch page cache: the code page of the last fetch, keyed on virtual
+     * page and mode. `fetch_host` is NULL if the page is not in DRAM.
+     */
+    bool fetch_valid;
+    uint64_t fetch_vpage;
+    enum mode fetch_mode;
+    uint64_t fetch_ppage;
+    uint8_t* fetch_host;
 };
 
 struct cpu*
-cpu_new(uint8_t* code, size_t code_size, uint8_t* disk);
+cpu_new(struct bus* bus, uint64_t hartid);
 
 void
 cpu_update_paging(struct cpu* cpu, uint16_t csr_addr);
 
+void
+cpu_update_interrupts(struct cpu* cpu, uint16_t csr_addr);
+
 enum exception
 cpu_translate(struct cpu* cpu, uint64_t addr, enum exception e, uint64_t *result);
 
+enum exception
+cpu_fill_fetch_page(struct cpu* cpu);
+
+/* Make the fetch page cache hold the page of the current PC. */
+static inline enum exception
+cpu_fetch_page(struct cpu* cpu) {
+    if (cpu->fetch_valid && cpu->fetch_vpage == (cpu->pc & ~(uint64_t)(PAGE_SIZE - 1))
+        && cpu->fetch_mode == cpu->mode) {
+        return OK;
+    }
+    return cpu_fill_fetch_page(cpu);
+}
+
+/* Forget the cached code page, its translation may have changed. */
+static inline void
+cpu_flush_fetch_page(struct cpu* cpu) {
+    cpu->fetch_valid = false;
+}
+
 enum exception
 cpu_fetch(struct cpu* cpu, uint64_t* result);
 
@@ -289,14 +1155,106 @@ cpu_dump_csrs(struct cpu* cpu);
 enum exception
 cpu_execute(struct cpu* cpu, uint64_t inst);
 
+enum exception
+cpu_run_block(struct cpu* cpu);
+
 void
 cpu_dump_registers(struct cpu* cpu);
 
+void
+cpu_dump_caches(struct cpu* cpu);
+
 void
 cpu_take_trap(struct cpu* cpu, enum exception exception, enum interrupt interrupt);
 
 enum interrupt
 cpu_check_pending_interrupt(struct cpu* cpu);
 
+void
+cpu_wait_for_interrupt(struct cpu* cpu);
+
+/* Cheap test run at block boundaries, before the full evaluation. */
+static inline bool
+cpu_interrupt_may_be_pending(struct cpu* cpu) {
+    uint64_t hart = cpu->csrs[MHARTID];
+    return cpu->irq_check || ((__atomic_load_n(&cpu->bus->irq.pending, __ATOMIC_RELAXED) >> hart) & 1);
+}
+
+enum exception
+fpu_execute(struct cpu* cpu, uint32_t inst);
+
+void
+fpu_sync_flags(struct cpu* cpu);
+
+void
+fpu_store_fcsr(struct cpu* cpu, uint64_t value);
+
+enum exception
+vector_execute(struct cpu* cpu, uint32_t inst);
+
+void
+vector_store_csr(struct cpu* cpu, uint16_t addr, uint64_t value);
+
 size_t
 read_file(FILE* f, uint8_t** r);
+
+uint8_t*
+map_file(const char* path, bool shared, size_t* size);
+
+bool
+snapshot_save(const char* path, struct bus* bus, struct cpu** cpus, int harts, const char* disk_path);
+
+bool
+snapshot_restore(const char* path, struct bus* bus, struct cpu** cpus, int harts);
+
+void
+stats_dump(FILE* f, struct bus* bus, struct cpu** cpus, int harts, double seconds);
+
+bool
+bench_start(const char* path, struct bus* bus, struct cpu** cpus, int harts);
+
+/* Default number of instructions a hart runs between two profiler samples. */
+#define PROFILE_PERIOD 10007
+
+/* Deepest call stack the profiler records. */
+#define PROFILE_DEPTH 32
+
+struct symbol {
+    uint64_t addr;
+    uint64_t size;
+    char* name;
+};
+
+struct profile_stack {
+    enum mode mode;
+    int depth;
+    /* The sampled PC first, then the return addresses of its callers. */
+    uint64_t pcs[PROFILE_DEPTH];
+    uint64_t count;
+};
+
+struct profile {
+    uint64_t period;
+    /* instret at which each hart takes its next sample. */
+    uint64_t next[MAX_HARTS];
+    /* Open-addressed table of the distinct stacks sampled. */
+    struct profile_stack* stacks;
+    size_t size;
+    size_t used;
+    pthread_mutex_t lock;
+    /* Sorted on address. */
+    struct symbol* symbols;
+    size_t nsymbols;
+};
+
+struct profile*
+profile_new(uint64_t period);
+
+bool
+profile_load_symbols(struct profile* profile, const char* path);
+
+void
+profile_sample(struct profile* profile, struct cpu* cpu);
+
+bool
+profile_write(struct profile* profile, const char* path);
@@ -1,31 +1,46 @@
 #include "nanoemu.h"
 
 struct plic*
-plic_new() {
+plic_new(struct irq* irq) {
     struct plic* plic = calloc(1, sizeof *plic);
+    plic->irq = irq;
     return plic;
 }
 
+/*
+ * Map `addr` to the register of a per-hart supervisor context, or return
+ * NULL if it isn't one.
+ */
+static uint64_t*
+plic_context(struct plic* plic, uint64_t addr) {
+    for (int hart = 0; hart < MAX_HARTS; hart++) {
+        if (addr == PLIC_SENABLE_HART(hart)) {
+            return &plic->senable[hart];
+        }
+        if (addr == PLIC_SPRIORITY_HART(hart)) {
+            return &plic->spriority[hart];
+        }
+        if (addr == PLIC_SCLAIM_HART(hart)) {
+            return &plic->sclaim[hart];
+        }
+    }
+    return NULL;
+}
+
 enum exception
 plic_load(struct plic* plic, uint64_t addr, uint64_t size, uint64_t *result) {
     switch (size) {
-    case 32:
-        switch (addr) {
-        case PLIC_PENDING:
+    case 32: {
+        uint64_t* reg = plic_context(plic, addr);
+        if (reg != NULL) {
+            *result = *reg;
+        } else if (addr == PLIC_PENDING) {
             *result = plic->pending;
-            break;
-        case PLIC_SENABLE:
-            *result = plic->senable;
-            break;
-        case PLIC_SPRIORITY:
-            *result = plic->spriority;
-            break;
-        case PLIC_SCLAIM:
-            *result = plic->sclaim;
-            break;
-        default: *result = 0;
+        } else {
+            *result = 0;
         }
         return OK;
+    }
     default:
         return LOAD_ACCESS_FAULT;
     }
@@ -34,23 +49,49 @@ plic_load(struct plic* plic, uint64_t addr, uint64_t size, uint64_t *result) {
 enum exception
 plic_store(struct plic* plic, uint64_t addr, uint64_t size, uint64_t value) {
     switch (size) {
-    case 32:
-        switch (addr) {
-        case PLIC_PENDING:
+    case 32: {
+        uint64_t* reg = plic_context(plic, addr);
+        if (reg != NULL) {
+            *reg = value;
+            /* Writing the claim register completes the interrupt. */
+            if (reg >= plic->sclaim && reg < plic->sclaim + MAX_HARTS) {
+                plic_complete(plic, value);
+            }
+        } else if (addr == PLIC_PENDING) {
             plic->pending = value;
-            break;
-        case PLIC_SENABLE:
-            plic->senable = value;
-            break;
-        case PLIC_SPRIORITY:
-            plic->spriority = value;
-            break;
-        case PLIC_SCLAIM:
-            plic->sclaim = value;
-            break;
         }
         return OK;
+    }
     default:
         return STORE_AMO_ACCESS_FAULT;
     }
 }
+
+/*
+ * Reserve `irq` for the calling hart. Fails while another hart has claimed
+ * it and not completed it yet, so each source is served by one hart at a
+ * time.
+ */
+bool
+plic_claim(struct plic* plic, uint64_t irq) {
+    uint64_t bit = (uint64_t)1 << irq;
+    if (__atomic_load_n(&plic->claimed, __ATOMIC_ACQUIRE) & bit) {
+        return false;
+    }
+    return (__atomic_fetch_or(&plic->claimed, bit, __ATOMIC_ACQ_REL) & bit) == 0;
+}
+
+/* The sources of `mask` that no hart has claimed. */
+uint64_t
+plic_may_claim(struct plic* plic, uint64_t mask) {
+    return mask & ~__atomic_load_n(&plic->claimed, __ATOMIC_ACQUIRE);
+}
+
+/* The source may still be interrupting, so every hart has to look at it again. */
+void
+plic_complete(struct plic* plic, uint64_t irq) {
+    if (irq < 64) {
+        __atomic_fetch_and(&plic->claimed, ~((uint64_t)1 << irq), __ATOMIC_RELEASE);
+        irq_notify(plic->irq, ALL_HARTS);
+    }
+}
@@ -0,0 +1,289 @@
+#include "nanoemu.h"
+
+/* The parts of an ELF64 file the profiler reads, see profile_load_symbols(). */
+#define ELF_SHT_SYMTAB  2
+#define ELF_STT_NOTYPE  0
+#define ELF_STT_FUNC    2
+#define ELF_SYM_SIZE    24
+
+struct profile*
+profile_new(uint64_t period) {
+    struct profile* profile = calloc(1, sizeof *profile);
+    profile->period = period;
+    profile->size = 1024;
+    profile->stacks = calloc(profile->size, sizeof *profile->stacks);
+    pthread_mutex_init(&profile->lock, NULL);
+    for (int i = 0; i < MAX_HARTS; i++) {
+        profile->next[i] = period;
+    }
+    return profile;
+}
+
+static int
+symbol_compare(const void* a, const void* b) {
+    const struct symbol* x = a;
+    const struct symbol* y = b;
+    return x->addr < y->addr ? -1 : x->addr > y->addr;
+}
+
+/*
+ * Read the function symbols of the ELF64 file at `path`. Labels without a
+ * type are kept too, assembly routines often have nothing else.
+ */
+bool
+profile_load_symbols(struct profile* profile, const char* path) {
+    FILE* f = fopen(path, "rb");
+    if (f == NULL) {
+        return false;
+    }
+    uint8_t* elf;
+    size_t size = read_file(f, &elf);
+    if (size < 64 || memcmp(elf, "\177ELF", 4) != 0 || elf[4] != 2 || elf[5] != 1) {
+        free(elf);
+        errno = ENOEXEC;
+        return false;
+    }
+
+    uint64_t shoff = host_load(elf + 0x28, 64);
+    uint64_t shentsize = host_load(elf + 0x3a, 16);
+    uint64_t shnum = host_load(elf + 0x3c, 16);
+    if (shoff > size || shnum * shentsize > size - shoff || shentsize < 64) {
+        free(elf);
+        errno = ENOEXEC;
+        return false;
+    }
+
+    for (uint64_t i = 0; i < shnum; i++) {
+        uint8_t* sh = elf + shoff + i * shentsize;
+        if (host_load(sh + 0x04, 32) != ELF_SHT_SYMTAB) {
+            continue;
+        }
+        uint64_t offset = host_load(sh + 0x18, 64);
+        uint64_t len = host_load(sh + 0x20, 64);
+        uint64_t link = host_load(sh + 0x28, 32);
+        if (link >= shnum || offset > size || len > size - offset) {
+            continue;
+        }
+        uint8_t* strsh = elf + shoff + link * shentsize;
+        uint64_t stroff = host_load(strsh + 0x18, 64);
+        uint64_t strsize = host_load(strsh + 0x20, 64);
+        if (stroff > size || strsize > size - stroff) {
+            continue;
+        }
+
+        for (uint64_t j = 0; j + ELF_SYM_SIZE <= len; j += ELF_SYM_SIZE) {
+            uint8_t* sym = elf + offset + j;
+            uint64_t name = host_load(sym, 32);
+            uint8_t type = sym[4] & 0xf;
+            uint64_t shndx = host_load(sym + 6, 16);
+            if ((type != ELF_STT_FUNC && type != ELF_STT_NOTYPE) || shndx == 0 || name == 0 || name >= strsize) {
+                continue;
+            }
+            const char* s = (const char*)elf + stroff + name;
+            if (strnlen(s, strsize - name) == strsize - name || s[0] == '$' || s[0] == '.') {
+                continue;
+            }
+            profile->symbols = realloc(profile->symbols, (profile->nsymbols + 1) * sizeof *profile->symbols);
+            profile->symbols[profile->nsymbols++] = (struct symbol){
+                host_load(sym + 8, 64),
+                host_load(sym + 16, 64),
+                strdup(s),
+            };
+        }
+    }
+    free(elf);
+
+    qsort(profile->symbols, profile->nsymbols, sizeof *profile->symbols, symbol_compare);
+    return true;
+}
+
+/* Name of the function holding `pc`, or NULL if no symbol covers it. */
+static const char*
+profile_symbolize(struct profile* profile, uint64_t pc) {
+    size_t lo = 0, hi = profile->nsymbols;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (profile->symbols[mid].addr <= pc) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    if (lo == 0) {
+        return NULL;
+    }
+    struct symbol* sym = &profile->symbols[lo - 1];
+    if (sym->size != 0 && pc - sym->addr >= sym->size) {
+        return NULL;
+    }
+    return sym->name;
+}
+
+/* Read a doubleword of guest memory without side effects on the guest. */
+static bool
+profile_peek(struct cpu* cpu, uint64_t addr, uint64_t* value) {
+    uint64_t pa;
+    if (cpu_translate(cpu, addr, LOAD_PAGE_FAULT, &pa) != OK) {
+        return false;
+    }
+    uint8_t* host = dram_host(cpu->bus->dram, pa, 64);
+    if (host == NULL) {
+        return false;
+    }
+    *value = host_load(host, 64);
+    return true;
+}
+
+static uint64_t
+profile_hash(const struct profile_stack* stack) {
+    uint64_t h = 14695981039346656037ull ^ stack->mode;
+    for (int i = 0; i < stack->depth; i++) {
+        h = (h ^ stack->pcs[i]) * 1099511628211ull;
+    }
+    return h;
+}
+
+static bool
+profile_stack_equal(const struct profile_stack* a, const struct profile_stack* b) {
+    return a->mode == b->mode && a->depth == b->depth
+        && memcmp(a->pcs, b->pcs, a->depth * sizeof a->pcs[0]) == 0;
+}
+
+/* Add `count` samples of `stack` to the open-addressed table. */
+static void
+profile_insert(struct profile* profile, const struct profile_stack* stack, uint64_t count) {
+    if (2 * (profile->used + 1) > profile->size) {
+        struct profile_stack* old = profile->stacks;
+        size_t old_size = profile->size;
+        profile->size *= 2;
+        profile->stacks = calloc(profile->size, sizeof *profile->stacks);
+        profile->used = 0;
+        for (size_t i = 0; i < old_size; i++) {
+            if (old[i].count != 0) {
+                profile_insert(profile, &old[i], old[i].count);
+            }
+        }
+        free(old);
+    }
+
+    size_t i = profile_hash(stack) & (profile->size - 1);
+    while (profile->stacks[i].count != 0 && !profile_stack_equal(&profile->stacks[i], stack)) {
+        i = (i + 1) & (profile->size - 1);
+    }
+    if (profile->stacks[i].count == 0) {
+        profile->stacks[i] = *stack;
+        profile->stacks[i].count = 0;
+        profile->used += 1;
+    }
+    profile->stacks[i].count += count;
+}
+
+/*
+ * Record where `cpu` is: its PC, then the return addresses found by
+ * following the frame pointer (s0) up the stack. A frame holds the return
+ * address at fp - 8 and the caller's frame pointer at fp - 16. User code is
+ * not symbolized, so it is recorded as one stack.
+ */
+void
+profile_sample(struct profile* profile, struct cpu* cpu) {
+    uint64_t hart = cpu->csrs[MHARTID];
+    profile->next[hart] = cpu->instret + profile->period;
+
+    struct profile_stack stack = { .mode = cpu->mode };
+    if (cpu->mode != USER) {
+        stack.pcs[stack.depth++] = cpu->pc;
+        uint64_t fp = cpu->regs[8];
+        while (stack.depth < PROFILE_DEPTH && (fp & 7) == 0) {
+            uint64_t ra, prev;
+            if (!profile_peek(cpu, fp - 8, &ra) || !profile_peek(cpu, fp - 16, &prev) || ra == 0) {
+                break;
+            }
+            /*
+             * Point into the call itself, the return address can be past the
+             * caller's end. Calls are 2 or 4 bytes long.
+             */
+            stack.pcs[stack.depth++] = ra - 2;
+            /* Stacks grow down, the caller's frame must be above this one. */
+            if (prev <= fp) {
+                break;
+            }
+            fp = prev;
+        }
+    }
+
+    pthread_mutex_lock(&profile->lock);
+    profile_insert(profile, &stack, 1);
+    pthread_mutex_unlock(&profile->lock);
+}
+
+struct profile_line {
+    char* text;
+    uint64_t count;
+};
+
+static int
+profile_line_compare(const void* a, const void* b) {
+    return strcmp(((const struct profile_line*)a)->text, ((const struct profile_line*)b)->text);
+}
+
+/* Append `s` to the growing string `*buf` of length `*len`. */
+static void
+profile_append(char** buf, size_t* len, const char* s) {
+    size_t n = strlen(s);
+    *buf = realloc(*buf, *len + n + 1);
+    memcpy(*buf + *len, s, n + 1);
+    *len += n;
+}
+
+/*
+ * Write the samples to `path` as folded stacks, one "root;caller;callee
+ * count" line per distinct stack, as flame graph tools take them.
+ */
+bool
+profile_write(struct profile* profile, const char* path) {
+    static const char* modes[] = { "[user]", "[supervisor]", NULL, "[machine]" };
+
+    FILE* f = fopen(path, "w");
+    if (f == NULL) {
+        return false;
+    }
+
+    pthread_mutex_lock(&profile->lock);
+    struct profile_line* lines = calloc(profile->used + 1, sizeof *lines);
+    size_t n = 0;
+    for (size_t i = 0; i < profile->size; i++) {
+        struct profile_stack* stack = &profile->stacks[i];
+        if (stack->count == 0) {
+            continue;
+        }
+        char* text = NULL;
+        size_t len = 0;
+        profile_append(&text, &len, modes[stack->mode]);
+        for (int j = stack->depth - 1; j >= 0; j--) {
+            char hex[24];
+            const char* name = profile_symbolize(profile, stack->pcs[j]);
+            if (name == NULL) {
+                snprintf(hex, sizeof hex, "0x%"PRIx64, stack->pcs[j]);
+                name = hex;
+            }
+            profile_append(&text, &len, ";");
+            profile_append(&text, &len, name);
+        }
+        lines[n++] = (struct profile_line){ text, stack->count };
+    }
+    pthread_mutex_unlock(&profile->lock);
+
+    /* Different return addresses in the same functions make the same line. */
+    qsort(lines, n, sizeof *lines, profile_line_compare);
+    for (size_t i = 0; i < n; i++) {
+        uint64_t count = lines[i].count;
+        while (i + 1 < n && strcmp(lines[i].text, lines[i + 1].text) == 0) {
+            free(lines[i].text);
+            count += lines[++i].count;
+        }
+        fprintf(f, "%s %"PRIu64"\n", lines[i].text, count);
+        free(lines[i].text);
+    }
+    free(lines);
+    return fclose(f) == 0;
+}
@@ -0,0 +1,169 @@
+#include "nanoemu.h"
+
+/*
+ * The C extension: every 16-bit instruction is an alias of a 32-bit one.
+ * rvc_table maps each of the 64K encodings to the 32-bit instruction it
+ * expands to, so decoding a compressed instruction is one load and the rest
+ * of the emulator only ever sees 32-bit instructions. Reserved and illegal
+ * encodings expand to 0, which is illegal as well.
+ */
+uint32_t rvc_table[65536];
+
+/* Bits `hi` down to `lo` of the compressed instruction `c`. */
+#define BITS(c, hi, lo)     (((c) >> (lo)) & ((1u << ((hi) - (lo) + 1)) - 1))
+/* The 3-bit register fields name x8 to x15. */
+#define CREG(c, lo)         (8 + BITS(c, (lo) + 2, lo))
+
+static uint32_t
+rvc_r(uint32_t opcode, uint32_t rd, uint32_t funct3, uint32_t rs1, uint32_t rs2, uint32_t funct7) {
+    return opcode | rd << 7 | funct3 << 12 | rs1 << 15 | rs2 << 20 | funct7 << 25;
+}
+
+static uint32_t
+rvc_i(uint32_t opcode, uint32_t rd, uint32_t funct3, uint32_t rs1, int32_t imm) {
+    return opcode | rd << 7 | funct3 << 12 | rs1 << 15 | (uint32_t)imm << 20;
+}
+
+static uint32_t
+rvc_s(uint32_t opcode, uint32_t funct3, uint32_t rs1, uint32_t rs2, int32_t imm) {
+    uint32_t u = imm;
+    return opcode | (u & 0x1f) << 7 | funct3 << 12 | rs1 << 15 | rs2 << 20 | (u >> 5 & 0x7f) << 25;
+}
+
+static uint32_t
+rvc_b(uint32_t funct3, uint32_t rs1, uint32_t rs2, int32_t imm) {
+    uint32_t u = imm;
+    return 0x63 | (u >> 11 & 1) << 7 | (u >> 1 & 0xf) << 8 | funct3 << 12 | rs1 << 15 | rs2 << 20
+        | (u >> 5 & 0x3f) << 25 | (u >> 12 & 1) << 31;
+}
+
+static uint32_t
+rvc_j(uint32_t rd, int32_t imm) {
+    uint32_t u = imm;
+    return 0x6f | rd << 7 | (u >> 12 & 0xff) << 12 | (u >> 11 & 1) << 20 | (u >> 1 & 0x3ff) << 21
+        | (u >> 20 & 1) << 31;
+}
+
+/* Sign-extend the low `bits` bits of `value`. */
+static int32_t
+rvc_sext(uint32_t value, int bits) {
+    return (int32_t)(value << (32 - bits)) >> (32 - bits);
+}
+
+/* Quadrant 0: stack-relative addi and loads and stores off x8-x15. */
+static uint32_t
+rvc_expand_q0(uint32_t c) {
+    uint32_t rd = CREG(c, 2);
+    uint32_t rs1 = CREG(c, 7);
+    /* Offsets of the word and doubleword accesses. */
+    uint32_t w = BITS(c, 12, 10) << 3 | BITS(c, 6, 6) << 2 | BITS(c, 5, 5) << 6;
+    uint32_t d = BITS(c, 12, 10) << 3 | BITS(c, 6, 5) << 6;
+
+    switch (BITS(c, 15, 13)) {
+    case 0x0: { /* c.addi4spn */
+        uint32_t imm = BITS(c, 12, 11) << 4 | BITS(c, 10, 7) << 6 | BITS(c, 6, 6) << 2 | BITS(c, 5, 5) << 3;
+        return imm == 0 ? 0 : rvc_i(0x13, rd, 0x0, 2, imm);
+    }
+    case 0x1: return rvc_i(0x07, rd, 0x3, rs1, d);          /* c.fld */
+    case 0x2: return rvc_i(0x03, rd, 0x2, rs1, w);          /* c.lw */
+    case 0x3: return rvc_i(0x03, rd, 0x3, rs1, d);          /* c.ld */
+    case 0x5: return rvc_s(0x27, 0x3, rs1, rd, d);          /* c.fsd */
+    case 0x6: return rvc_s(0x23, 0x2, rs1, rd, w);          /* c.sw */
+    case 0x7: return rvc_s(0x23, 0x3, rs1, rd, d);          /* c.sd */
+    default: return 0;
+    }
+}
+
+/* Quadrant 1: immediates, arithmetic on x8-x15, jumps and branches. */
+static uint32_t
+rvc_expand_q1(uint32_t c) {
+    uint32_t rd = BITS(c, 11, 7);
+    uint32_t rs1 = CREG(c, 7);
+    uint32_t rs2 = CREG(c, 2);
+    int32_t imm = rvc_sext(BITS(c, 12, 12) << 5 | BITS(c, 6, 2), 6);
+
+    switch (BITS(c, 15, 13)) {
+    case 0x0: return rvc_i(0x13, rd, 0x0, rd, imm);         /* c.addi, c.nop */
+    case 0x1: return rd == 0 ? 0 : rvc_i(0x1b, rd, 0x0, rd, imm); /* c.addiw */
+    case 0x2: return rvc_i(0x13, rd, 0x0, 0, imm);          /* c.li */
+    case 0x3:
+        if (rd == 2) { /* c.addi16sp */
+            int32_t sp = rvc_sext(BITS(c, 12, 12) << 9 | BITS(c, 6, 6) << 4 | BITS(c, 5, 5) << 6
+                | BITS(c, 4, 3) << 7 | BITS(c, 2, 2) << 5, 10);
+            return sp == 0 ? 0 : rvc_i(0x13, 2, 0x0, 2, sp);
+        }
+        /* c.lui */
+        return imm == 0 ? 0 : 0x37 | rd << 7 | ((uint32_t)imm << 12);
+    case 0x4:
+        switch (BITS(c, 11, 10)) {
+        case 0x0: return rvc_i(0x13, rs1, 0x5, rs1, imm & 0x3f);            /* c.srli */
+        case 0x1: return rvc_i(0x13, rs1, 0x5, rs1, 0x400 | (imm & 0x3f));  /* c.srai */
+        case 0x2: return rvc_i(0x13, rs1, 0x7, rs1, imm);                   /* c.andi */
+        }
+        switch (BITS(c, 12, 12) << 2 | BITS(c, 6, 5)) {
+        case 0x0: return rvc_r(0x33, rs1, 0x0, rs1, rs2, 0x20); /* c.sub */
+        case 0x1: return rvc_r(0x33, rs1, 0x4, rs1, rs2, 0x00); /* c.xor */
+        case 0x2: return rvc_r(0x33, rs1, 0x6, rs1, rs2, 0x00); /* c.or */
+        case 0x3: return rvc_r(0x33, rs1, 0x7, rs1, rs2, 0x00); /* c.and */
+        case 0x4: return rvc_r(0x3b, rs1, 0x0, rs1, rs2, 0x20); /* c.subw */
+        case 0x5: return rvc_r(0x3b, rs1, 0x0, rs1, rs2, 0x00); /* c.addw */
+        default: return 0;
+        }
+    case 0x5: { /* c.j */
+        int32_t off = rvc_sext(BITS(c, 12, 12) << 11 | BITS(c, 11, 11) << 4 | BITS(c, 10, 9) << 8
+            | BITS(c, 8, 8) << 10 | BITS(c, 7, 7) << 6 | BITS(c, 6, 6) << 7 | BITS(c, 5, 3) << 1
+            | BITS(c, 2, 2) << 5, 12);
+        return rvc_j(0, off);
+    }
+    default: { /* c.beqz, c.bnez */
+        int32_t off = rvc_sext(BITS(c, 12, 12) << 8 | BITS(c, 11, 10) << 3 | BITS(c, 6, 5) << 6
+            | BITS(c, 4, 3) << 1 | BITS(c, 2, 2) << 5, 9);
+        return rvc_b(BITS(c, 15, 13) == 0x6 ? 0x0 : 0x1, rs1, 0, off);
+    }
+    }
+}
+
+/* Quadrant 2: shifts, moves, indirect jumps and stack-pointer loads and stores. */
+static uint32_t
+rvc_expand_q2(uint32_t c) {
+    uint32_t rd = BITS(c, 11, 7);
+    uint32_t rs2 = BITS(c, 6, 2);
+    /* Offsets of the word and doubleword accesses off sp. */
+    uint32_t lw = BITS(c, 12, 12) << 5 | BITS(c, 6, 4) << 2 | BITS(c, 3, 2) << 6;
+    uint32_t ld = BITS(c, 12, 12) << 5 | BITS(c, 6, 5) << 3 | BITS(c, 4, 2) << 6;
+    uint32_t sw = BITS(c, 12, 9) << 2 | BITS(c, 8, 7) << 6;
+    uint32_t sd = BITS(c, 12, 10) << 3 | BITS(c, 9, 7) << 6;
+
+    switch (BITS(c, 15, 13)) {
+    case 0x0: return rvc_i(0x13, rd, 0x1, rd, BITS(c, 12, 12) << 5 | rs2);  /* c.slli */
+    case 0x1: return rvc_i(0x07, rd, 0x3, 2, ld);                           /* c.fldsp */
+    case 0x2: return rd == 0 ? 0 : rvc_i(0x03, rd, 0x2, 2, lw);             /* c.lwsp */
+    case 0x3: return rd == 0 ? 0 : rvc_i(0x03, rd, 0x3, 2, ld);             /* c.ldsp */
+    case 0x4:
+        if (BITS(c, 12, 12) == 0) {
+            if (rs2 == 0) {
+                return rd == 0 ? 0 : rvc_i(0x67, 0, 0x0, rd, 0);            /* c.jr */
+            }
+            return rvc_r(0x33, rd, 0x0, 0, rs2, 0x00);                      /* c.mv */
+        }
+        if (rs2 == 0) {
+            return rd == 0 ? 0x00100073 : rvc_i(0x67, 1, 0x0, rd, 0);       /* c.ebreak, c.jalr */
+        }
+        return rvc_r(0x33, rd, 0x0, rd, rs2, 0x00);                         /* c.add */
+    case 0x5: return rvc_s(0x27, 0x3, 2, rs2, sd);                          /* c.fsdsp */
+    case 0x6: return rvc_s(0x23, 0x2, 2, rs2, sw);                          /* c.swsp */
+    default: return rvc_s(0x23, 0x3, 2, rs2, sd);                           /* c.sdsp */
+    }
+}
+
+void
+rvc_init() {
+    for (uint32_t c = 0; c < 65536; c++) {
+        switch (c & 0x3) {
+        case 0x0: rvc_table[c] = rvc_expand_q0(c); break;
+        case 0x1: rvc_table[c] = rvc_expand_q1(c); break;
+        case 0x2: rvc_table[c] = rvc_expand_q2(c); break;
+        default: rvc_table[c] = 0; break;
+        }
+    }
+}
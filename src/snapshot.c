@@ -0,0 +1,230 @@
+#include "nanoemu.h"
+
+/*
+ * Layout of a snapshot file:
+ *
+ *   struct snapshot_header
+ *   per hart: regs, fregs, vregs, pc, csrs, mode, instret
+ *   CLINT, PLIC, UART and virtio registers; the console receive ring
+ *   (input not yet read by the guest) and THRE interrupts the writer
+ *   thread has yet to raise for the transmit buffer are not kept
+ *   DRAM contents, at a page-aligned offset so that they can be mapped
+ *   disk delta: (page number, page) for every disk page that differs from
+ *   the image file; empty with --writeback, the file has the writes
+ *
+ * DRAM pages that are all zeroes are left as holes, so the file is sparse.
+ */
+#define SNAPSHOT_MAGIC      "NANOSNAP"
+#define SNAPSHOT_VERSION    3
+
+struct snapshot_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t harts;
+    uint64_t dram_size;
+    uint64_t dram_offset;
+    uint64_t disk_size;
+    uint64_t disk_offset;
+    uint64_t disk_pages;
+    uint64_t mtime;
+};
+
+static bool
+snapshot_write(FILE* f, const void* data, size_t size) {
+    return fwrite(data, size, 1, f) == 1;
+}
+
+static bool
+snapshot_read(FILE* f, void* data, size_t size) {
+    return fread(data, size, 1, f) == 1;
+}
+
+/* Fields of each device that make up its state, written in this order. */
+#define SNAPSHOT_FIELDS(X, bus) \
+    X((bus)->clint->msip) \
+    X((bus)->clint->mtimecmp) \
+    X((bus)->clint->mtip) \
+    X((bus)->plic->pending) \
+    X((bus)->plic->senable) \
+    X((bus)->plic->spriority) \
+    X((bus)->plic->sclaim) \
+    X((bus)->plic->claimed) \
+    X((bus)->uart->data) \
+    X((bus)->uart->divisor) \
+    X((bus)->uart->thre_pending) \
+    X((bus)->uart->tx_stalled) \
+    X((bus)->virtio->last_avail) \
+    X((bus)->virtio->used_idx) \
+    X((bus)->virtio->device_features_sel) \
+    X((bus)->virtio->driver_features) \
+    X((bus)->virtio->driver_features_sel) \
+    X((bus)->virtio->page_size) \
+    X((bus)->virtio->queue_sel) \
+    X((bus)->virtio->queue_num) \
+    X((bus)->virtio->queue_align) \
+    X((bus)->virtio->queue_pfn) \
+    X((bus)->virtio->interrupt_status) \
+    X((bus)->virtio->status) \
+    X((bus)->virtio->interrupting)
+
+#define CPU_FIELDS(X, cpu) \
+    X((cpu)->regs) \
+    X((cpu)->fregs) \
+    X((cpu)->vregs) \
+    X((cpu)->pc) \
+    X((cpu)->csrs) \
+    X((cpu)->mode) \
+    X((cpu)->instret)
+
+#define SNAPSHOT_WRITE_FIELD(field) ok = ok && snapshot_write(f, &(field), sizeof(field));
+#define SNAPSHOT_READ_FIELD(field) ok = ok && snapshot_read(f, &(field), sizeof(field));
+
+static bool
+page_is_zero(const uint8_t* page) {
+    for (int i = 0; i < PAGE_SIZE; i += 8) {
+        if (host_load(page + i, 64) != 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/*
+ * Save the machine to `path`. Harts must be stopped at a block boundary,
+ * and the I/O thread idle. `disk_path` is the image the disk delta is
+ * taken against.
+ */
+bool
+snapshot_save(const char* path, struct bus* bus, struct cpu** cpus, int harts, const char* disk_path) {
+    FILE* f = fopen(path, "wb");
+    if (f == NULL) {
+        return false;
+    }
+
+    struct snapshot_header header = {
+        .magic = SNAPSHOT_MAGIC,
+        .version = SNAPSHOT_VERSION,
+        .harts = harts,
+        .dram_size = bus->dram->size,
+        .disk_size = bus->virtio->disk_size,
+        .mtime = timer_now(bus->timer),
+    };
+    bool ok = snapshot_write(f, &header, sizeof header);
+    for (int i = 0; i < harts; i++) {
+        CPU_FIELDS(SNAPSHOT_WRITE_FIELD, cpus[i])
+    }
+    SNAPSHOT_FIELDS(SNAPSHOT_WRITE_FIELD, bus)
+
+    ok = ok && fflush(f) == 0;
+    int fd = fileno(f);
+    header.dram_offset = ((uint64_t)ftell(f) + PAGE_SIZE - 1) & ~(uint64_t)(PAGE_SIZE - 1);
+    for (uint64_t page = 0; ok && page < header.dram_size; page += PAGE_SIZE) {
+        const uint8_t* data = bus->dram->data + page;
+        if (!page_is_zero(data)) {
+            ok = pwrite(fd, data, PAGE_SIZE, header.dram_offset + page) == PAGE_SIZE;
+        }
+    }
+
+    /*
+     * Pages written by the guest are the ones that differ from the image
+     * file. Without the file they cannot be told apart, and the snapshot
+     * would silently lose them.
+     */
+    header.disk_offset = header.dram_offset + header.dram_size;
+    int disk_fd = -1;
+    if (bus->virtio->disk != NULL && !bus->virtio->disk_shared) {
+        if (disk_path == NULL || (disk_fd = open(disk_path, O_RDONLY)) < 0) {
+            ok = false;
+        }
+    }
+    uint64_t offset = header.disk_offset;
+    for (uint64_t page = 0; ok && disk_fd >= 0 && page < header.disk_size; page += PAGE_SIZE) {
+        uint8_t original[PAGE_SIZE] = {0};
+        uint64_t len = header.disk_size - page < PAGE_SIZE ? header.disk_size - page : PAGE_SIZE;
+        if (pread(disk_fd, original, len, page) != (ssize_t)len) {
+            ok = false;
+            break;
+        }
+        if (memcmp(original, bus->virtio->disk + page, len) != 0) {
+            uint64_t number = page / PAGE_SIZE;
+            ok = pwrite(fd, &number, sizeof number, offset) == sizeof number
+                && pwrite(fd, bus->virtio->disk + page, len, offset + sizeof number) == (ssize_t)len;
+            offset += sizeof number + PAGE_SIZE;
+            header.disk_pages += 1;
+        }
+    }
+    if (disk_fd >= 0) {
+        close(disk_fd);
+    }
+
+    /* The header goes last, once the offsets are known. */
+    ok = ok && ftruncate(fd, offset) == 0 && pwrite(fd, &header, sizeof header, 0) == sizeof header;
+    return fclose(f) == 0 && ok;
+}
+
+/*
+ * Load the snapshot at `path` into a machine built with the same number of
+ * harts and disk image. DRAM is mapped copy-on-write from the file rather
+ * than read, so restoring costs a few page faults instead of a boot.
+ */
+bool
+snapshot_restore(const char* path, struct bus* bus, struct cpu** cpus, int harts) {
+    FILE* f = fopen(path, "rb");
+    if (f == NULL) {
+        return false;
+    }
+
+    struct snapshot_header header;
+    bool ok = snapshot_read(f, &header, sizeof header)
+        && memcmp(header.magic, SNAPSHOT_MAGIC, sizeof header.magic) == 0
+        && header.version == SNAPSHOT_VERSION
+        && header.dram_size == bus->dram->size
+        && header.harts == (uint32_t)harts
+        && header.disk_size == bus->virtio->disk_size;
+    if (!ok) {
+        fclose(f);
+        errno = EINVAL;
+        return false;
+    }
+
+    for (int i = 0; i < harts; i++) {
+        CPU_FIELDS(SNAPSHOT_READ_FIELD, cpus[i])
+        cpus[i]->timer_instret = cpus[i]->instret;
+        cpu_update_paging(cpus[i], SATP);
+    }
+    SNAPSHOT_FIELDS(SNAPSHOT_READ_FIELD, bus)
+
+    int fd = fileno(f);
+    void* dram = ok ? mmap(NULL, header.dram_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, header.dram_offset) : MAP_FAILED;
+    if (dram != MAP_FAILED) {
+        munmap(bus->dram->data, bus->dram->size);
+        bus->dram->data = dram;
+    } else {
+        ok = false;
+    }
+
+    for (uint64_t i = 0; ok && i < header.disk_pages; i++) {
+        uint64_t number;
+        uint64_t offset = header.disk_offset + i * (sizeof number + PAGE_SIZE);
+        ok = pread(fd, &number, sizeof number, offset) == sizeof number
+            && number * PAGE_SIZE < header.disk_size;
+        if (ok) {
+            uint64_t len = header.disk_size - number * PAGE_SIZE < PAGE_SIZE
+                ? header.disk_size - number * PAGE_SIZE
+                : PAGE_SIZE;
+            ok = pread(fd, bus->virtio->disk + number * PAGE_SIZE, len, offset + sizeof number) == (ssize_t)len;
+        }
+    }
+    fclose(f);
+    if (!ok) {
+        return false;
+    }
+
+    /* Time carries on from the snapshot, and the timer events with it. */
+    timer_set_now(bus->timer, header.mtime);
+    for (int i = 0; i < MAX_HARTS; i++) {
+        clint_set_mtimecmp(bus->clint, i, bus->clint->mtimecmp[i]);
+    }
+    irq_notify(&bus->irq, ALL_HARTS);
+    return true;
+}
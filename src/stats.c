@@ -0,0 +1,75 @@
+#include "nanoemu.h"
+
+static const char* exception_names[16] = {
+    "inst_misaligned", "inst_access", "illegal_inst", "breakpoint",
+    "load_misaligned", "load_access", "store_misaligned", "store_access",
+    "ecall_u", "ecall_s", NULL, "ecall_m",
+    "inst_page", "load_page", NULL, "store_page",
+};
+
+static const char* interrupt_names[16] = {
+    "u_software", "s_software", NULL, "m_software",
+    "u_timer", "s_timer", NULL, "m_timer",
+    "u_external", "s_external", NULL, "m_external",
+};
+
+static const char* device_names[BUS_DEVICES] = {
+    [BUS_CLINT] = "clint",
+    [BUS_PLIC] = "plic",
+    [BUS_UART] = "uart",
+    [BUS_VIRTIO] = "virtio",
+};
+
+/* Print the non-zero counters of `counts`, named by `names`. */
+static void
+stats_dump_counts(FILE* f, const char* title, const char** names, const uint64_t* counts, int n) {
+    fprintf(f, "%s:", title);
+    for (int i = 0; i < n; i++) {
+        if (counts[i] != 0) {
+            fprintf(f, " %s=%"PRIu64, names[i] != NULL ? names[i] : "?", counts[i]);
+        }
+    }
+    fprintf(f, "\n");
+}
+
+/*
+ * Print what the machine has done in the `seconds` it has been running.
+ * Other harts keep running while this reads their counters, so the totals
+ * are only approximately consistent with each other.
+ */
+void
+stats_dump(FILE* f, struct bus* bus, struct cpu** cpus, int harts, double seconds) {
+    struct cpu_stats total = {0};
+    uint64_t insts = 0;
+    for (int i = 0; i < harts; i++) {
+        struct cpu* cpu = cpus[i];
+        uint64_t walks = cpu->itlb.misses + cpu->dtlb.misses;
+        fprintf(f, "hart %d insts=%"PRIu64" page walks=%"PRIu64"\n", i, cpu->instret, walks);
+        if (cpu->jit != NULL) {
+            fprintf(f, "hart %d jit blocks=%"PRIu64" flushes=%"PRIu64"\n", i, cpu->jit->blocks, cpu->jit->flushes);
+        }
+        insts += cpu->instret;
+        for (int j = 0; j < 16; j++) {
+            total.exceptions[j] += cpu->stats.exceptions[j];
+            total.interrupts[j] += cpu->stats.interrupts[j];
+        }
+        for (int j = 0; j < 32; j++) {
+            total.external[j] += cpu->stats.external[j];
+        }
+    }
+    fprintf(f, "insts=%"PRIu64" in %.3f s  %.1f MIPS\n", insts, seconds, seconds > 0 ? insts / seconds / 1e6 : 0.0);
+
+    stats_dump_counts(f, "exceptions", exception_names, total.exceptions, 16);
+    stats_dump_counts(f, "interrupts", interrupt_names, total.interrupts, 16);
+    fprintf(f, "external: virtio=%"PRIu64" uart=%"PRIu64"\n", total.external[VIRTIO_IRQ], total.external[UART_IRQ]);
+
+    uint64_t mmio[BUS_DEVICES];
+    for (int i = 0; i < BUS_DEVICES; i++) {
+        mmio[i] = __atomic_load_n(&bus->mmio[i], __ATOMIC_RELAXED);
+    }
+    stats_dump_counts(f, "mmio", device_names, mmio, BUS_DEVICES);
+
+    virtio_dump_stats(bus->virtio, f, seconds);
+    dram_dump_stats(bus->dram, f);
+    fflush(f);
+}
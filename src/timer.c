@@ -0,0 +1,197 @@
+#include "nanoemu.h"
+
+static uint64_t
+timer_host_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+struct timer*
+timer_new(bool icount) {
+    struct timer* timer = calloc(1, sizeof *timer);
+    timer->icount = icount;
+    timer->base_ns = timer_host_ns();
+    timer->next = UINT64_MAX;
+    pthread_mutex_init(&timer->lock, NULL);
+    return timer;
+}
+
+/* Current value of mtime, in ticks of TIMER_FREQ. */
+uint64_t
+timer_now(struct timer* timer) {
+    uint64_t ticks;
+    if (timer->icount) {
+        ticks = __atomic_load_n(&timer->insts, __ATOMIC_RELAXED) / TIMER_INSTS_PER_TICK;
+    } else {
+        ticks = (timer_host_ns() - timer->base_ns) / (1000000000 / TIMER_FREQ);
+    }
+    return ticks + __atomic_load_n(&timer->offset, __ATOMIC_RELAXED);
+}
+
+void
+timer_set_now(struct timer* timer, uint64_t value) {
+    uint64_t now = timer_now(timer) - __atomic_load_n(&timer->offset, __ATOMIC_RELAXED);
+    __atomic_store_n(&timer->offset, value - now, __ATOMIC_RELAXED);
+}
+
+/* Account for instructions retired by a hart, which is what moves mtime in icount mode. */
+void
+timer_advance(struct timer* timer, uint64_t insts) {
+    if (timer->icount) {
+        __atomic_fetch_add(&timer->insts, insts, __ATOMIC_RELAXED);
+    }
+}
+
+/*
+ * The pending events form a binary min-heap on their deadline, and `next`
+ * mirrors the root so that harts can test it without taking the lock.
+ */
+static void
+timer_swap(struct timer* timer, int i, int j) {
+    struct event t = timer->events[i];
+    timer->events[i] = timer->events[j];
+    timer->events[j] = t;
+}
+
+static void
+timer_sift_up(struct timer* timer, int i) {
+    while (i > 0 && timer->events[(i - 1) / 2].when > timer->events[i].when) {
+        timer_swap(timer, i, (i - 1) / 2);
+        i = (i - 1) / 2;
+    }
+}
+
+static void
+timer_sift_down(struct timer* timer, int i) {
+    while (1) {
+        int min = i;
+        int l = 2 * i + 1, r = 2 * i + 2;
+        if (l < timer->nevents && timer->events[l].when < timer->events[min].when) min = l;
+        if (r < timer->nevents && timer->events[r].when < timer->events[min].when) min = r;
+        if (min == i) return;
+        timer_swap(timer, i, min);
+        i = min;
+    }
+}
+
+static void
+timer_remove(struct timer* timer, int i) {
+    timer->events[i] = timer->events[--timer->nevents];
+    if (i < timer->nevents) {
+        timer_sift_down(timer, i);
+        timer_sift_up(timer, i);
+    }
+}
+
+static int
+timer_find(struct timer* timer, event_fn fn, void* opaque, uint64_t arg) {
+    for (int i = 0; i < timer->nevents; i++) {
+        struct event* e = &timer->events[i];
+        if (e->fn == fn && e->opaque == opaque && e->arg == arg) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static void
+timer_update_next(struct timer* timer) {
+    uint64_t next = timer->nevents > 0 ? timer->events[0].when : UINT64_MAX;
+    __atomic_store_n(&timer->next, next, __ATOMIC_RELEASE);
+}
+
+/*
+ * Call `fn(opaque, arg)` once mtime reaches `when`. An event already
+ * scheduled with the same callback and arguments is moved rather than
+ * duplicated.
+ */
+void
+timer_schedule(struct timer* timer, uint64_t when, event_fn fn, void* opaque, uint64_t arg) {
+    pthread_mutex_lock(&timer->lock);
+    int i = timer_find(timer, fn, opaque, arg);
+    if (i >= 0) {
+        timer_remove(timer, i);
+    }
+    if (timer->nevents == MAX_EVENTS) {
+        printf("ERROR: too many timer events.\n");
+        exit(1);
+    }
+    timer->events[timer->nevents] = (struct event){ when, fn, opaque, arg };
+    timer_sift_up(timer, timer->nevents++);
+    bool earlier = when < timer->next;
+    timer_update_next(timer);
+    pthread_mutex_unlock(&timer->lock);
+
+    /* Idle harts sleep until the previous deadline, they have to look again. */
+    if (earlier && timer->irq != NULL) {
+        irq_notify(timer->irq, ALL_HARTS);
+    }
+}
+
+void
+timer_cancel(struct timer* timer, event_fn fn, void* opaque, uint64_t arg) {
+    pthread_mutex_lock(&timer->lock);
+    int i = timer_find(timer, fn, opaque, arg);
+    if (i >= 0) {
+        timer_remove(timer, i);
+        timer_update_next(timer);
+    }
+    pthread_mutex_unlock(&timer->lock);
+}
+
+/*
+ * Run the events that are due. Harts call this every TIMER_QUANTUM
+ * instructions; when nothing is due it costs one clock read. Callbacks run
+ * with the lock held and must not schedule events themselves.
+ */
+void
+timer_poll(struct timer* timer) {
+    uint64_t now = timer_now(timer);
+    if (now < __atomic_load_n(&timer->next, __ATOMIC_ACQUIRE)) {
+        return;
+    }
+
+    pthread_mutex_lock(&timer->lock);
+    while (timer->nevents > 0 && timer->events[0].when <= now) {
+        struct event e = timer->events[0];
+        timer_remove(timer, 0);
+        e.fn(e.opaque, e.arg);
+    }
+    timer_update_next(timer);
+    pthread_mutex_unlock(&timer->lock);
+}
+
+/* Host monotonic time at which the next event is due. False if there is none. */
+bool
+timer_next_deadline(struct timer* timer, struct timespec* deadline) {
+    uint64_t next = __atomic_load_n(&timer->next, __ATOMIC_ACQUIRE);
+    if (next == UINT64_MAX || timer->icount) {
+        return false;
+    }
+    uint64_t ticks = next - __atomic_load_n(&timer->offset, __ATOMIC_RELAXED);
+    if ((int64_t)ticks < 0) {
+        ticks = 0;
+    }
+    uint64_t ns = timer->base_ns + ticks * (1000000000 / TIMER_FREQ);
+    deadline->tv_sec = ns / 1000000000;
+    deadline->tv_nsec = ns % 1000000000;
+    return true;
+}
+
+/*
+ * With --icount, idle harts retire nothing, so virtual time would stop.
+ * Jump straight to the next event instead. False if there is none.
+ */
+bool
+timer_skip_to_next(struct timer* timer) {
+    uint64_t next = __atomic_load_n(&timer->next, __ATOMIC_ACQUIRE);
+    if (!timer->icount || next == UINT64_MAX) {
+        return false;
+    }
+    uint64_t insts = (next - __atomic_load_n(&timer->offset, __ATOMIC_RELAXED)) * TIMER_INSTS_PER_TICK;
+    uint64_t old = __atomic_load_n(&timer->insts, __ATOMIC_RELAXED);
+    while (old < insts && !__atomic_compare_exchange_n(&timer->insts, &old, insts, false,
+        __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    return true;
+}
@@ -0,0 +1,62 @@
+#include "nanoemu.h"
+
+static inline struct tlb_entry*
+tlb_entry(struct tlb* tlb, uint64_t addr) {
+    return &tlb->entries[(addr / PAGE_SIZE) & (TLB_SIZE - 1)];
+}
+
+bool
+tlb_lookup(struct tlb* tlb, uint64_t addr, enum mode mode, uint64_t *result) {
+    struct tlb_entry* entry = tlb_entry(tlb, addr);
+    if (entry->valid && entry->vpn == addr / PAGE_SIZE && entry->mode == mode) {
+        tlb->hits += 1;
+        *result = entry->ppn * PAGE_SIZE + (addr & (PAGE_SIZE - 1));
+        return true;
+    }
+    tlb->misses += 1;
+    return false;
+}
+
+void
+tlb_insert(struct tlb* tlb, uint64_t addr, enum mode mode, uint64_t paddr, int level) {
+    struct tlb_entry* entry = tlb_entry(tlb, addr);
+    entry->vpn = addr / PAGE_SIZE;
+    entry->ppn = paddr / PAGE_SIZE;
+    entry->mode = mode;
+    entry->valid = true;
+    entry->level = level;
+    if (level > 0) {
+        tlb->superpages = true;
+    }
+}
+
+void
+tlb_flush(struct tlb* tlb) {
+    for (int i = 0; i < TLB_SIZE; i++) {
+        tlb->entries[i].valid = false;
+    }
+    tlb->superpages = false;
+}
+
+/*
+ * Every slice of a superpage that contains `addr` goes too, they sit in
+ * other entries. Without superpages only one entry can match.
+ */
+void
+tlb_flush_page(struct tlb* tlb, uint64_t addr) {
+    uint64_t vpn = addr / PAGE_SIZE;
+    if (!tlb->superpages) {
+        struct tlb_entry* entry = tlb_entry(tlb, addr);
+        if (entry->vpn == vpn) {
+            entry->valid = false;
+        }
+        return;
+    }
+    for (int i = 0; i < TLB_SIZE; i++) {
+        struct tlb_entry* entry = &tlb->entries[i];
+        int shift = 9 * entry->level;
+        if (entry->vpn >> shift == vpn >> shift) {
+            entry->valid = false;
+        }
+    }
+}
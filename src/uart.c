@@ -1,19 +1,174 @@
 #include "nanoemu.h"
 
+static uint32_t
+ring_count(struct uart_ring* ring) {
+    return __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) - __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+}
+
+/* Producer side, the harts call it under hart_lock. */
+static bool
+ring_push(struct uart_ring* ring, uint8_t c) {
+    uint32_t tail = ring->tail;
+    if (tail - __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) == ring->size) {
+        return false;
+    }
+    ring->buf[tail & (ring->size - 1)] = c;
+    __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+/* Consumer side, the harts call it under hart_lock. */
+static bool
+ring_pop(struct uart_ring* ring, uint8_t* c) {
+    uint32_t head = ring->head;
+    if (head == __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE)) {
+        return false;
+    }
+    *c = ring->buf[head & (ring->size - 1)];
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+/*
+ * Sleep until the other side of the ring makes `ready` true. The flag and
+ * the recheck under the lock pair with uart_wake(), so no wakeup is lost.
+ */
+static void
+uart_wait(struct uart* uart, struct uart_ring* ring, bool (*ready)(struct uart_ring*)) {
+    pthread_mutex_lock(&uart->lock);
+    __atomic_store_n(&ring->waiting, true, __ATOMIC_SEQ_CST);
+    while (!ready(ring)) {
+        pthread_cond_wait(&uart->cond, &uart->lock);
+    }
+    __atomic_store_n(&ring->waiting, false, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&uart->lock);
+}
+
+/* Wake the host thread sleeping on `ring`, if any. Costs a load otherwise. */
+static void
+uart_wake(struct uart* uart, struct uart_ring* ring) {
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&ring->waiting, __ATOMIC_RELAXED)) {
+        pthread_mutex_lock(&uart->lock);
+        pthread_cond_broadcast(&uart->cond);
+        pthread_mutex_unlock(&uart->lock);
+    }
+}
+
+static bool
+ring_has_room(struct uart_ring* ring) {
+    return ring_count(ring) < ring->size;
+}
+
+static bool
+ring_has_data(struct uart_ring* ring) {
+    return ring_count(ring) > 0;
+}
+
+static uint8_t
+uart_ier(struct uart* uart) {
+    return __atomic_load_n(&uart->data[UART_IER - UART_BASE], __ATOMIC_ACQUIRE);
+}
+
+/* The guest sees the transmit FIFO as empty while the host buffer has room for a full one. */
+static bool
+uart_thr_empty(struct uart* uart) {
+    return uart->tx.size - ring_count(&uart->tx) >= UART_FIFO_SIZE;
+}
+
+/* Like uart_thr_empty(), but a full FIFO makes the writer raise THRE once it drains. */
+static bool
+uart_check_thr(struct uart* uart) {
+    if (uart_thr_empty(uart)) {
+        return true;
+    }
+    __atomic_store_n(&uart->tx_stalled, true, __ATOMIC_SEQ_CST);
+    return uart_thr_empty(uart);
+}
+
+/* Receive `data` on the line, waiting for the guest to make room in the FIFO. */
+void
+uart_send(struct uart* uart, const uint8_t* data, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        while (!ring_push(&uart->rx, data[i])) {
+            irq_notify(uart->irq, ALL_HARTS);
+            uart_wait(uart, &uart->rx, ring_has_room);
+        }
+    }
+    irq_notify(uart->irq, ALL_HARTS);
+}
+
 static void*
-uart_thread(void* opaque) {
+uart_rx_thread(void* opaque) {
     struct uart* uart = opaque;
     while (1) {
-        char c;
-        SUPRESS_RETURN(read(STDIN_FILENO, &c, 1));
-        pthread_mutex_lock(&uart->lock);
-        while ((uart->data[UART_LSR - UART_BASE] & UART_LSR_RX) == 1) {
-            pthread_cond_wait(&uart->cond, &uart->lock);
+        uint8_t buf[UART_FIFO_SIZE];
+        ssize_t n = read(STDIN_FILENO, buf, sizeof buf);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            /* End of input: the line simply goes quiet. */
+            return NULL;
+        }
+        uart_send(uart, buf, n);
+    }
+}
+
+/* Keep the last bytes written to the host, and wake uart_wait_expected() on a match. */
+static void
+uart_watch_output(struct uart* uart, const uint8_t* data, size_t len) {
+    pthread_mutex_lock(&uart->lock);
+    for (size_t i = 0; i < len; i++) {
+        if (uart->out_len == UART_EXPECT_MAX) {
+            memmove(uart->out_tail, uart->out_tail + 1, UART_EXPECT_MAX - 1);
+            uart->out_len -= 1;
+        }
+        uart->out_tail[uart->out_len++] = data[i];
+    }
+    size_t n = strlen(uart->expect);
+    if (uart->out_len >= n && memcmp(uart->out_tail + uart->out_len - n, uart->expect, n) == 0) {
+        uart->expect_seen = true;
+        pthread_cond_broadcast(&uart->cond);
+    }
+    pthread_mutex_unlock(&uart->lock);
+}
+
+/*
+ * Copy whatever the guest has transmitted to stdout, in as few writes as
+ * possible, and raise the THRE interrupt once a full transmit FIFO drains.
+ */
+static void*
+uart_tx_thread(void* opaque) {
+    struct uart* uart = opaque;
+    struct uart_ring* tx = &uart->tx;
+    while (1) {
+        uart_wait(uart, tx, ring_has_data);
+
+        uint32_t head = tx->head;
+        uint32_t count = ring_count(tx);
+        uint32_t offset = head & (tx->size - 1);
+        if (count > tx->size - offset) {
+            count = tx->size - offset;
+        }
+        ssize_t n = write(STDOUT_FILENO, &tx->buf[offset], count);
+        if (n < 0) {
+            if (errno != EINTR && errno != EAGAIN) {
+                /* Nowhere to write to, drop the output. */
+                n = count;
+            } else {
+                continue;
+            }
+        }
+        if (__atomic_load_n(&uart->expect, __ATOMIC_ACQUIRE) != NULL) {
+            uart_watch_output(uart, &tx->buf[offset], n);
+        }
+        __atomic_store_n(&tx->head, head + (uint32_t)n, __ATOMIC_RELEASE);
+
+        if (uart_thr_empty(uart) && __atomic_exchange_n(&uart->tx_stalled, false, __ATOMIC_SEQ_CST)) {
+            __atomic_store_n(&uart->thre_pending, true, __ATOMIC_RELEASE);
+            irq_notify(uart->irq, ALL_HARTS);
         }
-        uart->data[0] = c;
-        uart->interrupting = true;
-        uart->data[UART_LSR - UART_BASE] |= UART_LSR_RX;
-        pthread_mutex_unlock(&uart->lock);
     }
 
     /* Unreachable. */
@@ -21,60 +176,183 @@ uart_thread(void* opaque) {
 }
 
 struct uart*
-uart_new() {
+uart_new(struct irq* irq) {
     struct uart* uart = calloc(1, sizeof *uart);
-    uart->data[UART_LSR - UART_BASE] |= UART_LSR_TX;
+    uart->irq = irq;
+    uart->rx = (struct uart_ring){ .buf = uart->rx_buf, .size = UART_FIFO_SIZE };
+    uart->tx = (struct uart_ring){ .buf = uart->tx_buf, .size = UART_TX_BUF_SIZE };
     pthread_mutex_init(&uart->lock, NULL);
-    pthread_cond_init(&uart->cond, NULL);
+    pthread_mutex_init(&uart->hart_lock, NULL);
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&uart->cond, &attr);
 
-    pthread_create(&uart->tid, NULL, uart_thread, (void*)uart);
+    pthread_create(&uart->tx_tid, NULL, uart_tx_thread, (void*)uart);
     return uart;
 }
 
+/* Feed the host's stdin to the guest. */
+void
+uart_attach_stdin(struct uart* uart) {
+    pthread_create(&uart->rx_tid, NULL, uart_rx_thread, (void*)uart);
+}
+
+/*
+ * Start watching the output for `text`, of at most UART_EXPECT_MAX bytes.
+ * Only output written after this call can match.
+ */
+void
+uart_expect(struct uart* uart, const char* text) {
+    pthread_mutex_lock(&uart->lock);
+    uart->out_len = 0;
+    uart->expect_seen = false;
+    __atomic_store_n(&uart->expect, text, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&uart->lock);
+}
+
+/* Wait until the output ends with the text given to uart_expect(). False on timeout. */
+bool
+uart_wait_expected(struct uart* uart, const struct timespec* deadline) {
+    pthread_mutex_lock(&uart->lock);
+    int err = 0;
+    while (!uart->expect_seen && err != ETIMEDOUT) {
+        err = pthread_cond_timedwait(&uart->cond, &uart->lock, deadline);
+    }
+    bool seen = uart->expect_seen;
+    pthread_mutex_unlock(&uart->lock);
+    return seen;
+}
+
+/* Wait for the writer thread to pass all transmitted bytes to the host. */
+void
+uart_flush(struct uart* uart) {
+    while (ring_has_data(&uart->tx)) {
+        uart_wake(uart, &uart->tx);
+        usleep(1000);
+    }
+}
+
 enum exception
 uart_load(struct uart* uart, uint64_t addr, uint64_t size, uint64_t *result) {
-    switch (size) {
-    case 8:
-        pthread_mutex_lock(&uart->lock);
-        switch (addr) {
-        case UART_RHR:
-            pthread_cond_broadcast(&uart->cond);
-            uart->data[UART_LSR - UART_BASE] &= ~UART_LSR_RX;
-        default:
-            *result = uart->data[addr - UART_BASE];
+    if (size != 8) {
+        return LOAD_ACCESS_FAULT;
+    }
+
+    bool dlab = uart->data[UART_LCR - UART_BASE] & UART_LCR_DLAB;
+    switch (addr) {
+    case UART_RHR: {
+        if (dlab) {
+            *result = uart->divisor[0];
+            break;
         }
-        pthread_mutex_unlock(&uart->lock);
-        return OK;
+        uint8_t c = 0;
+        pthread_mutex_lock(&uart->hart_lock);
+        bool popped = ring_pop(&uart->rx, &c);
+        pthread_mutex_unlock(&uart->hart_lock);
+        if (popped) {
+            uart_wake(uart, &uart->rx);
+        }
+        *result = c;
+        break;
+    }
+    case UART_IER:
+        *result = dlab ? uart->divisor[1] : uart_ier(uart);
+        break;
+    case UART_IIR: {
+        uint8_t fifo = uart->data[UART_FCR - UART_BASE] & UART_FCR_FIFO ? UART_IIR_FIFO : 0;
+        uint8_t ier = uart_ier(uart);
+        if ((ier & UART_IER_RX) && ring_has_data(&uart->rx)) {
+            *result = fifo | UART_IIR_RX;
+        } else if ((ier & UART_IER_TX) && __atomic_exchange_n(&uart->thre_pending, false, __ATOMIC_ACQ_REL)) {
+            /* Reading IIR acknowledges the THRE interrupt. */
+            *result = fifo | UART_IIR_TX;
+        } else {
+            *result = fifo | UART_IIR_NONE;
+        }
+        break;
+    }
+    case UART_LSR:
+        *result = (ring_has_data(&uart->rx) ? UART_LSR_RX : 0)
+            | (uart_check_thr(uart) ? UART_LSR_TX : 0)
+            | (ring_has_data(&uart->tx) ? 0 : UART_LSR_TEMT);
+        break;
     default:
-        return LOAD_ACCESS_FAULT;
+        *result = uart->data[addr - UART_BASE];
     }
+    return OK;
 }
 
 enum exception
 uart_store(struct uart* uart, uint64_t addr, uint64_t size, uint64_t value) {
-    switch (size) {
-    case 8:
-        pthread_mutex_lock(&uart->lock);
-        switch (addr) {
-        case UART_THR:
-            printf("%c", (char)(value & 0xff));
-            fflush(stdout);
+    if (size != 8) {
+        return STORE_AMO_ACCESS_FAULT;
+    }
+
+    bool dlab = uart->data[UART_LCR - UART_BASE] & UART_LCR_DLAB;
+    switch (addr) {
+    case UART_THR:
+        if (dlab) {
+            uart->divisor[0] = value;
             break;
-        default:
-            uart->data[addr - UART_BASE] = value & 0xff;
         }
-        pthread_mutex_unlock(&uart->lock);
-        return OK;
+        /* A full FIFO drops the byte, as a real one would. */
+        __atomic_store_n(&uart->thre_pending, false, __ATOMIC_RELAXED);
+        pthread_mutex_lock(&uart->hart_lock);
+        bool pushed = ring_push(&uart->tx, value & 0xff);
+        pthread_mutex_unlock(&uart->hart_lock);
+        if (pushed) {
+            uart_wake(uart, &uart->tx);
+        }
+        uart_check_thr(uart);
+        break;
+    case UART_IER:
+        if (dlab) {
+            uart->divisor[1] = value;
+            break;
+        }
+        /* Enabling the THRE interrupt with an empty FIFO raises it at once. */
+        if ((value & UART_IER_TX) && !(uart_ier(uart) & UART_IER_TX) && uart_thr_empty(uart)) {
+            __atomic_store_n(&uart->thre_pending, true, __ATOMIC_RELEASE);
+        }
+        __atomic_store_n(&uart->data[UART_IER - UART_BASE], value & 0x0f, __ATOMIC_RELEASE);
+        irq_notify(uart->irq, ALL_HARTS);
+        break;
+    case UART_FCR:
+        if (value & UART_FCR_RX_RESET) {
+            uint8_t c;
+            pthread_mutex_lock(&uart->hart_lock);
+            while (ring_pop(&uart->rx, &c));
+            pthread_mutex_unlock(&uart->hart_lock);
+            uart_wake(uart, &uart->rx);
+        }
+        /* Transmitted bytes are already on their way to the host. */
+        uart->data[UART_FCR - UART_BASE] = value & UART_FCR_FIFO;
+        break;
     default:
-        return STORE_AMO_ACCESS_FAULT;
+        uart->data[addr - UART_BASE] = value & 0xff;
     }
+    return OK;
 }
 
+/* Lock-free check for a pending interrupt, uart_interrupting() consumes it. */
+bool
+uart_may_interrupt(struct uart* uart) {
+    uint8_t ier = uart_ier(uart);
+    return ((ier & UART_IER_RX) && ring_has_data(&uart->rx))
+        || ((ier & UART_IER_TX) && __atomic_load_n(&uart->thre_pending, __ATOMIC_ACQUIRE));
+}
+
+/*
+ * Received data interrupts for as long as the FIFO holds any. The THRE
+ * interrupt is acknowledged when it is claimed, since drivers that have
+ * nothing left to send don't always read IIR.
+ */
 bool
 uart_interrupting(struct uart* uart) {
-    pthread_mutex_lock(&uart->lock);
-    bool interrupting = uart->interrupting;
-    uart->interrupting = false;
-    pthread_mutex_unlock(&uart->lock);
-    return interrupting;
+    uint8_t ier = uart_ier(uart);
+    if ((ier & UART_IER_RX) && ring_has_data(&uart->rx)) {
+        return true;
+    }
+    return (ier & UART_IER_TX) && __atomic_exchange_n(&uart->thre_pending, false, __ATOMIC_ACQ_REL);
 }
@@ -14,3 +14,33 @@ read_file(FILE* f, uint8_t** r) {
 
     return fsize;
 }
+
+/*
+ * Map the file at `path` into memory instead of reading it. A private
+ * mapping is copy-on-write: writes stay in this process, and clean pages
+ * are shared through the page cache with every other process mapping the
+ * same file. A shared mapping writes back to the file.
+ */
+uint8_t*
+map_file(const char* path, bool shared, size_t* size) {
+    int fd = open(path, shared ? O_RDWR : O_RDONLY);
+    if (fd < 0) {
+        return NULL;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        return NULL;
+    }
+
+    void* data = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE,
+        shared ? MAP_SHARED : MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        return NULL;
+    }
+
+    *size = st.st_size;
+    return data;
+}
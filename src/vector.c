@@ -0,0 +1,871 @@
+#include "nanoemu.h"
+
+/*
+ * The V extension with VLEN = 128 and ELEN = 64: vsetvl*, the integer
+ * arithmetic, mask, permutation and reduction instructions, and every load
+ * and store addressing mode. There is no vector floating point, fixed point
+ * or widening arithmetic yet; those encodings are illegal.
+ *
+ * A guest register is one host SIMD register, so element-wise arithmetic
+ * runs as GCC vector extension kernels (SSE2 on x86-64), a register at a
+ * time, with the mask and tail applied afterwards. Operations without a
+ * kernel, and all of them on big-endian hosts, go element by element.
+ * Tail and mask agnostic elements are left undisturbed.
+ */
+
+/* The vtype in effect. */
+struct vconfig {
+    uint64_t sew;
+    /* log2 of LMUL, -3 to 3. */
+    int lmul;
+    uint64_t vlmax;
+};
+
+enum vec_op {
+    VOP_NONE,
+    VOP_ADD, VOP_SUB, VOP_RSUB,
+    VOP_AND, VOP_OR, VOP_XOR, VOP_ANDN, VOP_ORN, VOP_NAND, VOP_NOR, VOP_XNOR,
+    VOP_MINU, VOP_MIN, VOP_MAXU, VOP_MAX,
+    VOP_SLL, VOP_SRL, VOP_SRA,
+    VOP_MUL, VOP_MULH, VOP_MULHU, VOP_MULHSU,
+    VOP_DIVU, VOP_DIV, VOP_REMU, VOP_REM,
+    VOP_MACC, VOP_NMSAC, VOP_MADD, VOP_NMSUB,
+    VOP_MERGE,
+    VOP_SEQ, VOP_SNE, VOP_SLTU, VOP_SLT, VOP_SLEU, VOP_SLE, VOP_SGTU, VOP_SGT,
+};
+
+/* How an OP-V instruction is executed. */
+enum vec_kind {
+    VK_NONE,
+    VK_ARITH,       /* vd[i] = op(vs2[i], operand) */
+    VK_COMPARE,     /* mask vd[i] = op(vs2[i], operand) */
+    VK_REDUCE,      /* vd[0] = op(vs1[0], vs2[*]) */
+    VK_MASK,        /* mask vd[i] = op(mask vs2[i], mask vs1[i]) */
+    VK_GATHER,
+    VK_SLIDEUP,
+    VK_SLIDEDOWN,
+    VK_SLIDE1UP,
+    VK_SLIDE1DOWN,
+    VK_MVR,         /* vmv<nr>r.v */
+    VK_UNARY0,      /* vmv.x.s, vcpop.m, vfirst.m and vmv.s.x */
+    VK_EXT,         /* vzext and vsext */
+    VK_ID,          /* viota.m and vid.v */
+};
+
+struct vec_inst {
+    uint8_t kind;
+    uint8_t op;
+    /* The funct3 forms that exist, as 1 << funct3. */
+    uint8_t forms;
+};
+
+#define IVV (1 << 0)
+#define MVV (1 << 2)
+#define IVI (1 << 3)
+#define IVX (1 << 4)
+#define MVX (1 << 6)
+
+/* OPIVV, OPIVI and OPIVX by funct6. */
+static const struct vec_inst vec_opi[64] = {
+    [0x00] = { VK_ARITH, VOP_ADD, IVV | IVX | IVI },
+    [0x02] = { VK_ARITH, VOP_SUB, IVV | IVX },
+    [0x03] = { VK_ARITH, VOP_RSUB, IVX | IVI },
+    [0x04] = { VK_ARITH, VOP_MINU, IVV | IVX },
+    [0x05] = { VK_ARITH, VOP_MIN, IVV | IVX },
+    [0x06] = { VK_ARITH, VOP_MAXU, IVV | IVX },
+    [0x07] = { VK_ARITH, VOP_MAX, IVV | IVX },
+    [0x09] = { VK_ARITH, VOP_AND, IVV | IVX | IVI },
+    [0x0a] = { VK_ARITH, VOP_OR, IVV | IVX | IVI },
+    [0x0b] = { VK_ARITH, VOP_XOR, IVV | IVX | IVI },
+    [0x0c] = { VK_GATHER, VOP_NONE, IVV | IVX | IVI },
+    [0x0e] = { VK_SLIDEUP, VOP_NONE, IVX | IVI },
+    [0x0f] = { VK_SLIDEDOWN, VOP_NONE, IVX | IVI },
+    [0x17] = { VK_ARITH, VOP_MERGE, IVV | IVX | IVI },
+    [0x18] = { VK_COMPARE, VOP_SEQ, IVV | IVX | IVI },
+    [0x19] = { VK_COMPARE, VOP_SNE, IVV | IVX | IVI },
+    [0x1a] = { VK_COMPARE, VOP_SLTU, IVV | IVX },
+    [0x1b] = { VK_COMPARE, VOP_SLT, IVV | IVX },
+    [0x1c] = { VK_COMPARE, VOP_SLEU, IVV | IVX | IVI },
+    [0x1d] = { VK_COMPARE, VOP_SLE, IVV | IVX | IVI },
+    [0x1e] = { VK_COMPARE, VOP_SGTU, IVX | IVI },
+    [0x1f] = { VK_COMPARE, VOP_SGT, IVX | IVI },
+    [0x25] = { VK_ARITH, VOP_SLL, IVV | IVX | IVI },
+    [0x27] = { VK_MVR, VOP_NONE, IVI },
+    [0x28] = { VK_ARITH, VOP_SRL, IVV | IVX | IVI },
+    [0x29] = { VK_ARITH, VOP_SRA, IVV | IVX | IVI },
+};
+
+/* OPMVV and OPMVX by funct6. */
+static const struct vec_inst vec_opm[64] = {
+    [0x00] = { VK_REDUCE, VOP_ADD, MVV },
+    [0x01] = { VK_REDUCE, VOP_AND, MVV },
+    [0x02] = { VK_REDUCE, VOP_OR, MVV },
+    [0x03] = { VK_REDUCE, VOP_XOR, MVV },
+    [0x04] = { VK_REDUCE, VOP_MINU, MVV },
+    [0x05] = { VK_REDUCE, VOP_MIN, MVV },
+    [0x06] = { VK_REDUCE, VOP_MAXU, MVV },
+    [0x07] = { VK_REDUCE, VOP_MAX, MVV },
+    [0x0e] = { VK_SLIDE1UP, VOP_NONE, MVX },
+    [0x0f] = { VK_SLIDE1DOWN, VOP_NONE, MVX },
+    [0x10] = { VK_UNARY0, VOP_NONE, MVV | MVX },
+    [0x12] = { VK_EXT, VOP_NONE, MVV },
+    [0x14] = { VK_ID, VOP_NONE, MVV },
+    [0x18] = { VK_MASK, VOP_ANDN, MVV },
+    [0x19] = { VK_MASK, VOP_AND, MVV },
+    [0x1a] = { VK_MASK, VOP_OR, MVV },
+    [0x1b] = { VK_MASK, VOP_XOR, MVV },
+    [0x1c] = { VK_MASK, VOP_ORN, MVV },
+    [0x1d] = { VK_MASK, VOP_NAND, MVV },
+    [0x1e] = { VK_MASK, VOP_NOR, MVV },
+    [0x1f] = { VK_MASK, VOP_XNOR, MVV },
+    [0x20] = { VK_ARITH, VOP_DIVU, MVV | MVX },
+    [0x21] = { VK_ARITH, VOP_DIV, MVV | MVX },
+    [0x22] = { VK_ARITH, VOP_REMU, MVV | MVX },
+    [0x23] = { VK_ARITH, VOP_REM, MVV | MVX },
+    [0x24] = { VK_ARITH, VOP_MULHU, MVV | MVX },
+    [0x25] = { VK_ARITH, VOP_MUL, MVV | MVX },
+    [0x26] = { VK_ARITH, VOP_MULHSU, MVV | MVX },
+    [0x27] = { VK_ARITH, VOP_MULH, MVV | MVX },
+    [0x29] = { VK_ARITH, VOP_MADD, MVV | MVX },
+    [0x2b] = { VK_ARITH, VOP_NMSUB, MVV | MVX },
+    [0x2d] = { VK_ARITH, VOP_MACC, MVV | MVX },
+    [0x2f] = { VK_ARITH, VOP_NMSAC, MVV | MVX },
+};
+
+static uint8_t*
+vreg(struct cpu* cpu, uint64_t r) {
+    return cpu->vregs + r * VLEN_BYTES;
+}
+
+/* Element `i` of the register group starting at `r`. */
+static uint64_t
+vec_get(struct cpu* cpu, uint64_t r, uint64_t i, uint64_t sew) {
+    return host_load(vreg(cpu, r) + i * (sew / 8), sew);
+}
+
+static void
+vec_set(struct cpu* cpu, uint64_t r, uint64_t i, uint64_t sew, uint64_t value) {
+    host_store(vreg(cpu, r) + i * (sew / 8), sew, value);
+}
+
+/* Bit `i` of the mask register `r`. */
+static bool
+vec_mask(struct cpu* cpu, uint64_t r, uint64_t i) {
+    return (vreg(cpu, r)[i / 8] >> (i % 8)) & 1;
+}
+
+static bool
+vec_active(struct cpu* cpu, bool vm, uint64_t i) {
+    return vm || vec_mask(cpu, 0, i);
+}
+
+static uint64_t
+vec_trunc(uint64_t value, uint64_t sew) {
+    return sew == 64 ? value : value & (((uint64_t)1 << sew) - 1);
+}
+
+static int64_t
+vec_sext(uint64_t value, uint64_t sew) {
+    return sew == 64 ? (int64_t)value : (int64_t)(value << (64 - sew)) >> (64 - sew);
+}
+
+/* Registers in a group of EMUL = 2^`emul`. */
+static uint64_t
+vec_group(int emul) {
+    return emul > 0 ? (uint64_t)1 << emul : 1;
+}
+
+/* Whether `r` can start a group of EMUL = 2^`emul`; aligned groups never run past v31. */
+static bool
+vec_aligned(uint64_t r, int emul) {
+    return r % vec_group(emul) == 0;
+}
+
+/* Read vtype. Returns false if it is illegal (vill). */
+static bool
+vector_config(struct cpu* cpu, struct vconfig* c) {
+    uint64_t vtype = cpu->csrs[VTYPE];
+    if (vtype & VTYPE_VILL) {
+        return false;
+    }
+    uint64_t vlmul = vtype & 0x7;
+    c->sew = (uint64_t)8 << ((vtype >> 3) & 0x7);
+    c->lmul = vlmul & 0x4 ? (int)vlmul - 8 : (int)vlmul;
+    c->vlmax = c->lmul >= 0 ? (VLEN / c->sew) << c->lmul : (VLEN / c->sew) >> -c->lmul;
+    return true;
+}
+
+/* One element of `op`: `a` is from vs2, `b` the other operand and `d` from vd. */
+static uint64_t
+vec_alu(enum vec_op op, uint64_t sew, uint64_t a, uint64_t b, uint64_t d) {
+    a = vec_trunc(a, sew);
+    b = vec_trunc(b, sew);
+    int64_t sa = vec_sext(a, sew);
+    int64_t sb = vec_sext(b, sew);
+    uint64_t r;
+    switch (op) {
+    case VOP_ADD: r = a + b; break;
+    case VOP_SUB: r = a - b; break;
+    case VOP_RSUB: r = b - a; break;
+    case VOP_AND: r = a & b; break;
+    case VOP_OR: r = a | b; break;
+    case VOP_XOR: r = a ^ b; break;
+    case VOP_ANDN: r = a & ~b; break;
+    case VOP_ORN: r = a | ~b; break;
+    case VOP_NAND: r = ~(a & b); break;
+    case VOP_NOR: r = ~(a | b); break;
+    case VOP_XNOR: r = ~(a ^ b); break;
+    case VOP_MINU: r = a < b ? a : b; break;
+    case VOP_MIN: r = sa < sb ? a : b; break;
+    case VOP_MAXU: r = a > b ? a : b; break;
+    case VOP_MAX: r = sa > sb ? a : b; break;
+    case VOP_SLL: r = a << (b & (sew - 1)); break;
+    case VOP_SRL: r = a >> (b & (sew - 1)); break;
+    case VOP_SRA: r = sa >> (b & (sew - 1)); break;
+    case VOP_MUL: r = a * b; break;
+    case VOP_MULH: r = sew == 64 ? alu_mulh(a, b) : (uint64_t)((sa * sb) >> sew); break;
+    case VOP_MULHU: r = sew == 64 ? alu_mulhu(a, b) : (a * b) >> sew; break;
+    case VOP_MULHSU: r = sew == 64 ? alu_mulhsu(a, b) : (uint64_t)((sa * (int64_t)b) >> sew); break;
+    case VOP_DIVU: r = alu_divu(a, b); break;
+    case VOP_DIV: r = alu_div(sa, sb); break;
+    case VOP_REMU: r = alu_remu(a, b); break;
+    case VOP_REM: r = alu_rem(sa, sb); break;
+    case VOP_MACC: r = a * b + d; break;
+    case VOP_NMSAC: r = d - a * b; break;
+    case VOP_MADD: r = b * d + a; break;
+    case VOP_NMSUB: r = a - b * d; break;
+    case VOP_MERGE: r = b; break;
+    case VOP_SEQ: r = a == b; break;
+    case VOP_SNE: r = a != b; break;
+    case VOP_SLTU: r = a < b; break;
+    case VOP_SLT: r = sa < sb; break;
+    case VOP_SLEU: r = a <= b; break;
+    case VOP_SLE: r = sa <= sb; break;
+    case VOP_SGTU: r = a > b; break;
+    case VOP_SGT: r = sa > sb; break;
+    default: r = 0; break;
+    }
+    return vec_trunc(r, sew);
+}
+
+/* The kernels see a register as a host vector, which is the guest layout on little-endian hosts only. */
+#if !(defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__)
+
+/*
+ * Compute `op` on one whole register of `bits`-bit elements, `b` holding
+ * vs1 or the scalar operand in every element. Returns false for the ops
+ * without a kernel.
+ */
+#define VEC_KERNEL(bits) \
+typedef uint##bits##_t vec_u##bits __attribute__((vector_size(VLEN_BYTES))); \
+typedef int##bits##_t vec_i##bits __attribute__((vector_size(VLEN_BYTES))); \
+\
+static bool \
+vec_kernel##bits(enum vec_op op, uint8_t* out, const uint8_t* pa, const uint8_t* pb, const uint8_t* pd) { \
+    vec_u##bits a, b, d, r, m; \
+    memcpy(&a, pa, VLEN_BYTES); \
+    memcpy(&b, pb, VLEN_BYTES); \
+    memcpy(&d, pd, VLEN_BYTES); \
+    switch (op) { \
+    case VOP_ADD: r = a + b; break; \
+    case VOP_SUB: r = a - b; break; \
+    case VOP_RSUB: r = b - a; break; \
+    case VOP_AND: r = a & b; break; \
+    case VOP_OR: r = a | b; break; \
+    case VOP_XOR: r = a ^ b; break; \
+    case VOP_MINU: m = (vec_u##bits)(a < b); r = (a & m) | (b & ~m); break; \
+    case VOP_MIN: m = (vec_u##bits)((vec_i##bits)a < (vec_i##bits)b); r = (a & m) | (b & ~m); break; \
+    case VOP_MAXU: m = (vec_u##bits)(a > b); r = (a & m) | (b & ~m); break; \
+    case VOP_MAX: m = (vec_u##bits)((vec_i##bits)a > (vec_i##bits)b); r = (a & m) | (b & ~m); break; \
+    case VOP_SLL: r = a << (b & (bits - 1)); break; \
+    case VOP_SRL: r = a >> (b & (bits - 1)); break; \
+    case VOP_SRA: r = (vec_u##bits)((vec_i##bits)a >> (vec_i##bits)(b & (bits - 1))); break; \
+    case VOP_MUL: r = a * b; break; \
+    case VOP_MACC: r = a * b + d; break; \
+    case VOP_NMSAC: r = d - a * b; break; \
+    case VOP_MADD: r = b * d + a; break; \
+    case VOP_NMSUB: r = a - b * d; break; \
+    case VOP_MERGE: r = b; break; \
+    default: return false; \
+    } \
+    memcpy(out, &r, VLEN_BYTES); \
+    return true; \
+}
+
+VEC_KERNEL(8)
+VEC_KERNEL(16)
+VEC_KERNEL(32)
+VEC_KERNEL(64)
+
+static bool
+vec_kernel(enum vec_op op, uint64_t sew, uint8_t* out, const uint8_t* a, const uint8_t* b, const uint8_t* d) {
+    switch (sew) {
+    case 8: return vec_kernel8(op, out, a, b, d);
+    case 16: return vec_kernel16(op, out, a, b, d);
+    case 32: return vec_kernel32(op, out, a, b, d);
+    default: return vec_kernel64(op, out, a, b, d);
+    }
+}
+
+#else
+
+static bool
+vec_kernel(enum vec_op op, uint64_t sew, uint8_t* out, const uint8_t* a, const uint8_t* b, const uint8_t* d) {
+    return false;
+}
+
+#endif
+
+/*
+ * vd = op(vs2, vs1) element by element, or op(vs2, scalar) if `vs1` is
+ * negative. vmerge takes vs2 rather than vd where the mask is clear.
+ */
+static void
+vector_arith(struct cpu* cpu, const struct vconfig* c, enum vec_op op, bool vm,
+    uint64_t vd, uint64_t vs2, int vs1, uint64_t scalar) {
+    uint64_t sew = c->sew;
+    uint64_t bytes = sew / 8;
+    uint64_t per_reg = VLEN_BYTES / bytes;
+    uint64_t vl = cpu->csrs[VL];
+    uint8_t splat[VLEN_BYTES];
+    if (vs1 < 0) {
+        for (uint64_t i = 0; i < per_reg; i++) {
+            host_store(splat + i * bytes, sew, scalar);
+        }
+    }
+
+    for (uint64_t k = 0; k * per_reg < vl; k++) {
+        uint8_t* d = vreg(cpu, vd + k);
+        const uint8_t* a = vreg(cpu, vs2 + k);
+        const uint8_t* b = vs1 < 0 ? splat : vreg(cpu, vs1 + k);
+        uint8_t r[VLEN_BYTES];
+        if (!vec_kernel(op, sew, r, a, b, d)) {
+            for (uint64_t i = 0; i < per_reg; i++) {
+                uint64_t o = i * bytes;
+                host_store(r + o, sew, vec_alu(op, sew, host_load(a + o, sew), host_load(b + o, sew), host_load(d + o, sew)));
+            }
+        }
+
+        uint64_t n = vl - k * per_reg < per_reg ? vl - k * per_reg : per_reg;
+        if (vm && n == per_reg) {
+            memcpy(d, r, VLEN_BYTES);
+            continue;
+        }
+        for (uint64_t i = 0; i < n; i++) {
+            if (vec_active(cpu, vm, k * per_reg + i)) {
+                memcpy(d + i * bytes, r + i * bytes, bytes);
+            } else if (op == VOP_MERGE) {
+                memmove(d + i * bytes, a + i * bytes, bytes);
+            }
+        }
+    }
+}
+
+/* Set mask vd[i] to op(vs2[i], vs1[i] or scalar) for the active elements. */
+static void
+vector_compare(struct cpu* cpu, const struct vconfig* c, enum vec_op op, bool vm,
+    uint64_t vd, uint64_t vs2, int vs1, uint64_t scalar) {
+    uint8_t mask[VLEN_BYTES];
+    memcpy(mask, vreg(cpu, vd), VLEN_BYTES);
+    for (uint64_t i = 0; i < cpu->csrs[VL]; i++) {
+        if (!vec_active(cpu, vm, i)) {
+            continue;
+        }
+        uint64_t b = vs1 < 0 ? scalar : vec_get(cpu, vs1, i, c->sew);
+        uint8_t bit = 1 << (i % 8);
+        if (vec_alu(op, c->sew, vec_get(cpu, vs2, i, c->sew), b, 0)) {
+            mask[i / 8] |= bit;
+        } else {
+            mask[i / 8] &= ~bit;
+        }
+    }
+    memcpy(vreg(cpu, vd), mask, VLEN_BYTES);
+}
+
+/* Mask vd = op(vs2, vs1) on the first vl bits, 64 at a time. */
+static void
+vector_mask_logical(struct cpu* cpu, enum vec_op op, uint64_t vd, uint64_t vs2, uint64_t vs1) {
+    uint64_t vl = cpu->csrs[VL];
+    for (uint64_t i = 0; i < vl; i += 64) {
+        uint8_t* d = vreg(cpu, vd) + i / 8;
+        uint64_t r = vec_alu(op, 64, host_load(vreg(cpu, vs2) + i / 8, 64), host_load(vreg(cpu, vs1) + i / 8, 64), 0);
+        uint64_t keep = vl - i >= 64 ? ~(uint64_t)0 : ((uint64_t)1 << (vl - i)) - 1;
+        host_store(d, 64, (r & keep) | (host_load(d, 64) & ~keep));
+    }
+}
+
+/* The bits of mask `r` that are set, active and below vl, 64 at word `w`. */
+static uint64_t
+vec_mask_word(struct cpu* cpu, bool vm, uint64_t r, uint64_t w) {
+    uint64_t vl = cpu->csrs[VL];
+    uint64_t bits = host_load(vreg(cpu, r) + w * 8, 64);
+    if (!vm) {
+        bits &= host_load(vreg(cpu, 0) + w * 8, 64);
+    }
+    if (vl - w * 64 < 64) {
+        bits &= ((uint64_t)1 << (vl - w * 64)) - 1;
+    }
+    return bits;
+}
+
+/* vrgather, the slides and vmv<nr>r.v read the source group as it was before any write. */
+static enum exception
+vector_permute(struct cpu* cpu, const struct vconfig* c, enum vec_kind kind, bool vm,
+    uint64_t vd, uint64_t vs2, int vs1, uint64_t scalar) {
+    uint64_t sew = c->sew;
+    uint64_t vl = cpu->csrs[VL];
+    uint8_t src[8 * VLEN_BYTES];
+    memcpy(src, vreg(cpu, vs2), vec_group(c->lmul) * VLEN_BYTES);
+    uint64_t bytes = sew / 8;
+
+    for (uint64_t i = 0; i < vl; i++) {
+        if (!vec_active(cpu, vm, i)) {
+            continue;
+        }
+        uint64_t j;
+        switch (kind) {
+        case VK_GATHER:
+            j = vs1 < 0 ? scalar : vec_get(cpu, vs1, i, sew);
+            break;
+        case VK_SLIDEUP:
+            if (i < scalar) {
+                continue;
+            }
+            j = i - scalar;
+            break;
+        case VK_SLIDEDOWN:
+            j = scalar < c->vlmax - i ? i + scalar : c->vlmax;
+            break;
+        case VK_SLIDE1UP:
+            if (i == 0) {
+                vec_set(cpu, vd, i, sew, scalar);
+                continue;
+            }
+            j = i - 1;
+            break;
+        default: /* VK_SLIDE1DOWN */
+            if (i == vl - 1) {
+                vec_set(cpu, vd, i, sew, scalar);
+                continue;
+            }
+            j = i + 1;
+            break;
+        }
+        vec_set(cpu, vd, i, sew, j < c->vlmax ? host_load(src + j * bytes, sew) : 0);
+    }
+    return OK;
+}
+
+/* vmv.x.s, vcpop.m and vfirst.m write x[rd]; vmv.s.x writes vd[0]. */
+static enum exception
+vector_unary0(struct cpu* cpu, const struct vconfig* c, uint64_t funct3, bool vm,
+    uint64_t vd, uint64_t vs2, uint64_t vs1) {
+    if (funct3 == 0x6) { /* vmv.s.x */
+        if (vs2 != 0 || !vm) {
+            return ILLEGAL_INSTRUCTION;
+        }
+        if (cpu->csrs[VL] > 0) {
+            vec_set(cpu, vd, 0, c->sew, cpu->regs[vs1]);
+        }
+        return OK;
+    }
+    switch (vs1) {
+    case 0x00: /* vmv.x.s */
+        if (!vm) {
+            return ILLEGAL_INSTRUCTION;
+        }
+        cpu->regs[vd] = vec_sext(vec_get(cpu, vs2, 0, c->sew), c->sew);
+        return OK;
+    case 0x10: { /* vcpop.m */
+        uint64_t count = 0;
+        for (uint64_t w = 0; w * 64 < cpu->csrs[VL]; w++) {
+            count += __builtin_popcountll(vec_mask_word(cpu, vm, vs2, w));
+        }
+        cpu->regs[vd] = count;
+        return OK;
+    }
+    case 0x11: /* vfirst.m */
+        cpu->regs[vd] = -1;
+        for (uint64_t w = 0; w * 64 < cpu->csrs[VL]; w++) {
+            uint64_t bits = vec_mask_word(cpu, vm, vs2, w);
+            if (bits != 0) {
+                cpu->regs[vd] = w * 64 + __builtin_ctzll(bits);
+                break;
+            }
+        }
+        return OK;
+    default:
+        return ILLEGAL_INSTRUCTION;
+    }
+}
+
+/* vzext.vf2/4/8 and vsext.vf2/4/8. */
+static enum exception
+vector_extend(struct cpu* cpu, const struct vconfig* c, bool vm, uint64_t vd, uint64_t vs2, uint64_t vs1) {
+    if (vs1 < 0x2 || vs1 > 0x7) {
+        return ILLEGAL_INSTRUCTION;
+    }
+    /* vs1 is 2 and 3 for a factor of 8, 4 and 5 for 4, 6 and 7 for 2; odd means signed. */
+    int shift = 3 - (int)(vs1 - 2) / 2;
+    bool sign = vs1 & 1;
+    uint64_t from = c->sew >> shift;
+    if (from < 8 || c->lmul - shift < -3 || !vec_aligned(vd, c->lmul) || !vec_aligned(vs2, c->lmul - shift)) {
+        return ILLEGAL_INSTRUCTION;
+    }
+    uint8_t src[8 * VLEN_BYTES];
+    memcpy(src, vreg(cpu, vs2), vec_group(c->lmul - shift) * VLEN_BYTES);
+    for (uint64_t i = 0; i < cpu->csrs[VL]; i++) {
+        if (vec_active(cpu, vm, i)) {
+            uint64_t value = host_load(src + i * (from / 8), from);
+            vec_set(cpu, vd, i, c->sew, sign ? (uint64_t)vec_sext(value, from) : value);
+        }
+    }
+    return OK;
+}
+
+/* viota.m and vid.v. */
+static enum exception
+vector_id(struct cpu* cpu, const struct vconfig* c, bool vm, uint64_t vd, uint64_t vs2, uint64_t vs1) {
+    if ((vs1 != 0x10 && vs1 != 0x11) || (vs1 == 0x11 && vs2 != 0)) {
+        return ILLEGAL_INSTRUCTION;
+    }
+    uint8_t mask[VLEN_BYTES];
+    memcpy(mask, vreg(cpu, vs2), VLEN_BYTES);
+    uint64_t count = 0;
+    for (uint64_t i = 0; i < cpu->csrs[VL]; i++) {
+        if (!vec_active(cpu, vm, i)) {
+            continue;
+        }
+        vec_set(cpu, vd, i, c->sew, vs1 == 0x11 ? i : count);
+        count += (mask[i / 8] >> (i % 8)) & 1;
+    }
+    return OK;
+}
+
+/* OP-V instructions other than vsetvl*. */
+static enum exception
+vector_op(struct cpu* cpu, uint32_t inst) {
+    uint64_t vd = (inst >> 7) & 0x1f;
+    uint64_t funct3 = (inst >> 12) & 0x7;
+    uint64_t vs1 = (inst >> 15) & 0x1f;
+    uint64_t vs2 = (inst >> 20) & 0x1f;
+    bool vm = (inst >> 25) & 1;
+    uint64_t funct6 = inst >> 26;
+
+    /* OPFVV and OPFVF: no vector floating point. */
+    if (funct3 == 0x1 || funct3 == 0x5) {
+        return ILLEGAL_INSTRUCTION;
+    }
+    const struct vec_inst* d = &(funct3 == 0x2 || funct3 == 0x6 ? vec_opm : vec_opi)[funct6];
+    if (!(d->forms & (1 << funct3))) {
+        return ILLEGAL_INSTRUCTION;
+    }
+
+    /* vmv<nr>r.v copies whole registers whatever vtype is. */
+    if (d->kind == VK_MVR) {
+        uint64_t nr = vs1 + 1;
+        if (!vm || (nr != 1 && nr != 2 && nr != 4 && nr != 8) || vd % nr != 0 || vs2 % nr != 0) {
+            return ILLEGAL_INSTRUCTION;
+        }
+        memmove(vreg(cpu, vd), vreg(cpu, vs2), nr * VLEN_BYTES);
+        return OK;
+    }
+
+    /* Arithmetic is never interrupted, so it need not resume from vstart. */
+    struct vconfig c;
+    if (!vector_config(cpu, &c) || cpu->csrs[VSTART] != 0) {
+        return ILLEGAL_INSTRUCTION;
+    }
+
+    /* The second operand is vs1, x[rs1] or a 5-bit immediate, unsigned for shifts and permutations. */
+    int src = funct3 == 0x0 || funct3 == 0x2 ? (int)vs1 : -1;
+    uint64_t scalar = cpu->regs[vs1];
+    if (funct3 == 0x3) {
+        bool uimm = d->op == VOP_SLL || d->op == VOP_SRL || d->op == VOP_SRA
+            || d->kind == VK_GATHER || d->kind == VK_SLIDEUP || d->kind == VK_SLIDEDOWN;
+        scalar = uimm ? vs1 : (uint64_t)vec_sext(vs1, 5);
+    }
+
+    /* Register groups must be aligned, and a masked result must not overwrite v0. */
+    bool group_ok = vec_aligned(vs2, c.lmul) && (src < 0 || vec_aligned(src, c.lmul));
+    bool dest_ok = vec_aligned(vd, c.lmul) && (vm || vd != 0);
+
+    switch (d->kind) {
+    case VK_ARITH:
+        if (!group_ok || !dest_ok || (d->op == VOP_MERGE && vm && vs2 != 0)) {
+            return ILLEGAL_INSTRUCTION;
+        }
+        vector_arith(cpu, &c, d->op, vm, vd, vs2, src, scalar);
+        return OK;
+    case VK_COMPARE:
+        if (!group_ok) {
+            return ILLEGAL_INSTRUCTION;
+        }
+        vector_compare(cpu, &c, d->op, vm, vd, vs2, src, scalar);
+        return OK;
+    case VK_REDUCE: {
+        if (!vec_aligned(vs2, c.lmul)) {
+            return ILLEGAL_INSTRUCTION;
+        }
+        uint64_t acc = vec_get(cpu, vs1, 0, c.sew);
+        for (uint64_t i = 0; i < cpu->csrs[VL]; i++) {
+            if (vec_active(cpu, vm, i)) {
+                acc = vec_alu(d->op, c.sew, acc, vec_get(cpu, vs2, i, c.sew), 0);
+            }
+        }
+        if (cpu->csrs[VL] > 0) {
+            vec_set(cpu, vd, 0, c.sew, acc);
+        }
+        return OK;
+    }
+    case VK_MASK:
+        if (!vm) {
+            return ILLEGAL_INSTRUCTION;
+        }
+        vector_mask_logical(cpu, d->op, vd, vs2, vs1);
+        return OK;
+    case VK_GATHER:
+    case VK_SLIDEUP:
+    case VK_SLIDEDOWN:
+    case VK_SLIDE1UP:
+    case VK_SLIDE1DOWN:
+        if (!group_ok || !dest_ok) {
+            return ILLEGAL_INSTRUCTION;
+        }
+        return vector_permute(cpu, &c, d->kind, vm, vd, vs2, src, scalar);
+    case VK_UNARY0:
+        return vector_unary0(cpu, &c, funct3, vm, vd, vs2, vs1);
+    case VK_EXT:
+        if (!vm && vd == 0) {
+            return ILLEGAL_INSTRUCTION;
+        }
+        return vector_extend(cpu, &c, vm, vd, vs2, vs1);
+    case VK_ID:
+        if (!dest_ok) {
+            return ILLEGAL_INSTRUCTION;
+        }
+        return vector_id(cpu, &c, vm, vd, vs2, vs1);
+    default:
+        return ILLEGAL_INSTRUCTION;
+    }
+}
+
+/* vsetvli, vsetivli and vsetvl: set vtype and as much of the requested length as fits. */
+static enum exception
+vector_setvl(struct cpu* cpu, uint32_t inst) {
+    uint64_t rd = (inst >> 7) & 0x1f;
+    uint64_t rs1 = (inst >> 15) & 0x1f;
+    uint64_t vtype, avl;
+    if ((inst >> 31) == 0) { /* vsetvli */
+        vtype = (inst >> 20) & 0x7ff;
+        avl = cpu->regs[rs1];
+    } else if ((inst >> 30) == 0x3) { /* vsetivli */
+        vtype = (inst >> 20) & 0x3ff;
+        avl = rs1;
+    } else if (((inst >> 25) & 0x3f) == 0) { /* vsetvl */
+        vtype = cpu->regs[(inst >> 20) & 0x1f];
+        avl = cpu->regs[rs1];
+    } else {
+        return ILLEGAL_INSTRUCTION;
+    }
+    /* x0 as the source asks for VLMAX, or to keep vl if rd is x0 too. */
+    if ((inst >> 30) != 0x3 && rs1 == 0) {
+        avl = rd != 0 ? UINT64_MAX : cpu->csrs[VL];
+    }
+
+    /* Reserved bits, SEW or LMUL, or SEW above LMUL * ELEN, make vtype illegal. */
+    uint64_t vlmul = vtype & 0x7;
+    uint64_t vsew = (vtype >> 3) & 0x7;
+    int lmul = vlmul & 0x4 ? (int)vlmul - 8 : (int)vlmul;
+    struct vconfig c;
+    cpu->csrs[VTYPE] = vtype;
+    if ((vtype >> 8) != 0 || vsew > 3 || vlmul == 4 || (int)vsew > lmul + 3 || !vector_config(cpu, &c)) {
+        cpu->csrs[VTYPE] = VTYPE_VILL;
+        cpu->csrs[VL] = 0;
+    } else {
+        cpu->csrs[VL] = avl < c.vlmax ? avl : c.vlmax;
+    }
+    cpu->csrs[VSTART] = 0;
+    cpu->regs[rd] = cpu->csrs[VL];
+    return OK;
+}
+
+/*
+ * Copy `len` bytes between `data` and guest memory at `addr`, resolving a
+ * host pointer once per page rather than once per element. Fails without
+ * copying anything if part of the range is unmapped or not DRAM; the
+ * element-by-element path then raises the exception.
+ */
+static bool
+vector_copy(struct cpu* cpu, uint64_t addr, uint8_t* data, uint64_t len, bool store) {
+    uint8_t* host[2];
+    uint64_t pa[2];
+    uint64_t part[2];
+    part[0] = PAGE_SIZE - addr % PAGE_SIZE < len ? PAGE_SIZE - addr % PAGE_SIZE : len;
+    part[1] = len - part[0];
+    for (int n = 0; n < 2 && part[n] != 0; n++) {
+        if (cpu_translate(cpu, addr + n * part[0], store ? STORE_AMO_PAGE_FAULT : LOAD_PAGE_FAULT, &pa[n]) != OK
+            || (host[n] = dram_range(cpu->bus->dram, pa[n], part[n])) == NULL) {
+            return false;
+        }
+    }
+    for (int n = 0; n < 2 && part[n] != 0; n++) {
+        if (store) {
+            dram_invalidate_code_range(cpu->bus->dram, pa[n], part[n]);
+            memcpy(host[n], data, part[n]);
+        } else {
+            memcpy(data, host[n], part[n]);
+        }
+        data += part[n];
+    }
+    return true;
+}
+
+/* Vector loads and stores: unit-stride, strided and indexed, with segments. */
+static enum exception
+vector_memory(struct cpu* cpu, uint32_t inst, bool store) {
+    uint64_t vd = (inst >> 7) & 0x1f;
+    uint64_t width = (inst >> 12) & 0x7;
+    uint64_t rs1 = (inst >> 15) & 0x1f;
+    uint64_t rs2 = (inst >> 20) & 0x1f;
+    bool vm = (inst >> 25) & 1;
+    uint64_t mop = (inst >> 26) & 0x3;
+    uint64_t nf = (inst >> 29) + 1;
+    /* The width field holds the EEW of the data, or of the indices for indexed accesses. */
+    int eew_log = width == 0x0 ? 3 : (int)width - 1;
+    uint64_t eew = (uint64_t)1 << eew_log;
+    if ((inst >> 28) & 1) {
+        return ILLEGAL_INSTRUCTION;
+    }
+
+    struct vconfig c;
+    uint64_t sew, evl, segments = nf;
+    int emul;
+    bool first_only = false;
+    if (mop == 0x0 && rs2 == 0x08) {
+        /* Whole registers: nf of them, whatever vtype is. */
+        if (!vm || (nf != 1 && nf != 2 && nf != 4 && nf != 8) || vd % nf != 0) {
+            return ILLEGAL_INSTRUCTION;
+        }
+        sew = eew;
+        evl = nf * VLEN / eew;
+        segments = 1;
+        emul = 0;
+    } else {
+        if (!vector_config(cpu, &c)) {
+            return ILLEGAL_INSTRUCTION;
+        }
+        sew = mop & 0x1 ? c.sew : eew;
+        evl = cpu->csrs[VL];
+        emul = mop & 0x1 ? c.lmul : eew_log - (int)__builtin_ctzll(c.sew) + c.lmul;
+        if (mop == 0x0 && rs2 == 0x0b) { /* vlm.v and vsm.v */
+            if (!vm || nf != 1 || eew != 8) {
+                return ILLEGAL_INSTRUCTION;
+            }
+            evl = (evl + 7) / 8;
+            emul = 0;
+        } else if (mop == 0x0 && rs2 == 0x10 && !store) { /* fault-only-first */
+            first_only = true;
+        } else if (mop == 0x0 && rs2 != 0x0) {
+            return ILLEGAL_INSTRUCTION;
+        }
+        if (emul < -3 || emul > 3 || nf * vec_group(emul) > 8 || vd + nf * vec_group(emul) > 32
+            || !vec_aligned(vd, emul) || (!vm && vd == 0 && !store)) {
+            return ILLEGAL_INSTRUCTION;
+        }
+        if (mop & 0x1) {
+            int index_emul = eew_log - (int)__builtin_ctzll(c.sew) + c.lmul;
+            if (index_emul < -3 || index_emul > 3 || !vec_aligned(rs2, index_emul)) {
+                return ILLEGAL_INSTRUCTION;
+            }
+        }
+    }
+
+    uint64_t bytes = sew / 8;
+    uint64_t base = cpu->regs[rs1];
+    if (mop == 0x0 && vm && segments == 1 && cpu->csrs[VSTART] == 0
+        && (evl == 0 || vector_copy(cpu, base, vreg(cpu, vd), evl * bytes, store))) {
+        return OK;
+    }
+
+    uint64_t group = vec_group(emul);
+    for (uint64_t i = cpu->csrs[VSTART]; i < evl; i++) {
+        if (!vec_active(cpu, vm, i)) {
+            continue;
+        }
+        for (uint64_t f = 0; f < segments; f++) {
+            uint64_t addr;
+            switch (mop) {
+            case 0x0: addr = base + (i * segments + f) * bytes; break;
+            case 0x2: addr = base + i * cpu->regs[rs2] + f * bytes; break;
+            default: addr = base + vec_get(cpu, rs2, i, eew) + f * bytes; break;
+            }
+            uint8_t* elem = vreg(cpu, vd + f * group) + i * bytes;
+            enum exception exception;
+            if (store) {
+                exception = cpu_store(cpu, addr, sew, host_load(elem, sew));
+            } else {
+                uint64_t value;
+                if ((exception = cpu_load(cpu, addr, sew, &value)) == OK) {
+                    host_store(elem, sew, value);
+                }
+            }
+            if (exception != OK) {
+                /* A fault-only-first load stops short instead, unless it is the first element. */
+                if (first_only && i > 0) {
+                    cpu->csrs[VL] = i;
+                    cpu->csrs[VSTART] = 0;
+                    return OK;
+                }
+                cpu->csrs[VSTART] = i;
+                return exception;
+            }
+        }
+    }
+    cpu->csrs[VSTART] = 0;
+    return OK;
+}
+
+void
+vector_store_csr(struct cpu* cpu, uint16_t addr, uint64_t value) {
+    switch (addr) {
+    case VSTART:
+        cpu->csrs[VSTART] = value & (VLEN - 1);
+        break;
+    case VXSAT:
+        cpu->csrs[VCSR] = (cpu->csrs[VCSR] & ~(uint64_t)0x1) | (value & 0x1);
+        break;
+    case VXRM:
+        cpu->csrs[VCSR] = (cpu->csrs[VCSR] & ~(uint64_t)0x6) | (value & 0x3) << 1;
+        break;
+    default:
+        cpu->csrs[VCSR] = value & 0x7;
+        break;
+    }
+    cpu->csrs[MSTATUS] |= MSTATUS_VS | MSTATUS_SD;
+}
+
+/*
+ * Execute a V extension instruction: OP-V, or a load or store with a
+ * vector width. They are all illegal while mstatus.VS is off.
+ */
+enum exception
+vector_execute(struct cpu* cpu, uint32_t inst) {
+    if ((cpu->csrs[MSTATUS] & MSTATUS_VS) == 0) {
+        return ILLEGAL_INSTRUCTION;
+    }
+
+    uint64_t opcode = inst & 0x7f;
+    enum exception exception;
+    if (opcode == 0x07 || opcode == 0x27) {
+        exception = vector_memory(cpu, inst, opcode == 0x27);
+    } else if (((inst >> 12) & 0x7) == 0x7) {
+        exception = vector_setvl(cpu, inst);
+    } else {
+        exception = vector_op(cpu, inst);
+    }
+    if (exception == OK) {
+        cpu->csrs[MSTATUS] |= MSTATUS_VS | MSTATUS_SD;
+    }
+    return exception;
+}
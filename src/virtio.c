@@ -1,10 +1,15 @@
 #include "nanoemu.h"
 
 struct virtio*
-virtio_new(uint8_t* disk) {
+virtio_new(uint8_t* disk, size_t disk_size, bool disk_shared) {
     struct virtio* virtio = calloc(1, sizeof *virtio);
     virtio->disk = disk;
+    virtio->disk_size = disk_size;
+    virtio->disk_shared = disk_shared;
     virtio->queue_notify = -1;
+    virtio->queue_align = PAGE_SIZE;
+    pthread_mutex_init(&virtio->lock, NULL);
+    pthread_cond_init(&virtio->cond, NULL);
     return virtio;
 }
 
@@ -12,6 +17,7 @@ enum exception
 virtio_load(struct virtio* virtio, uint64_t addr, uint64_t size, uint64_t *result) {
     switch (size) {
     case 32:
+        pthread_mutex_lock(&virtio->lock);
         switch (addr) {
         case VIRTIO_MAGIC:
             *result = 0x74726976;
@@ -26,22 +32,29 @@ virtio_load(struct virtio* virtio, uint64_t addr, uint64_t size, uint64_t *resul
             *result = 0x554d4551;
             break;
         case VIRTIO_DEVICE_FEATURES:
-            *result = 0;
+            /* Only the first 32 feature bits are offered. */
+            *result = virtio->device_features_sel == 0
+                ? (1 << VIRTIO_BLK_F_FLUSH) | (1 << VIRTIO_F_EVENT_IDX)
+                : 0;
             break;
         case VIRTIO_DRIVER_FEATURES:
             *result = virtio->driver_features;
             break;
         case VIRTIO_QUEUE_NUM_MAX:
-            *result = 8;
+            *result = virtio->queue_sel == 0 ? VIRTIO_QUEUE_MAX : 0;
             break;
         case VIRTIO_QUEUE_PFN:
             *result = virtio->queue_pfn;
             break;
+        case VIRTIO_INTERRUPT_STATUS:
+            *result = virtio->interrupt_status;
+            break;
         case VIRTIO_STATUS:
             *result = virtio->status;
             break;
         default: *result = 0;
         }
+        pthread_mutex_unlock(&virtio->lock);
         return OK;
     default:
         return LOAD_ACCESS_FAULT;
@@ -52,9 +65,18 @@ enum exception
 virtio_store(struct virtio* virtio, uint64_t addr, uint64_t size, uint64_t value) {
     switch (size) {
     case 32:
+        pthread_mutex_lock(&virtio->lock);
         switch (addr) {
-        case VIRTIO_DEVICE_FEATURES:
-            virtio->driver_features = value;
+        case VIRTIO_DEVICE_FEATURES_SEL:
+            virtio->device_features_sel = value;
+            break;
+        case VIRTIO_DRIVER_FEATURES:
+            if (virtio->driver_features_sel == 0) {
+                virtio->driver_features = value;
+            }
+            break;
+        case VIRTIO_DRIVER_FEATURES_SEL:
+            virtio->driver_features_sel = value;
             break;
         case VIRTIO_GUEST_PAGE_SIZE:
             virtio->page_size = value;
@@ -63,50 +85,188 @@ virtio_store(struct virtio* virtio, uint64_t addr, uint64_t size, uint64_t value
             virtio->queue_sel = value;
             break;
         case VIRTIO_QUEUE_NUM:
-            virtio->queue_num = value;
+            /* The rings are indexed modulo the size, so only powers of two work. */
+            if (value <= VIRTIO_QUEUE_MAX && (value & (value - 1)) == 0) {
+                virtio->queue_num = value;
+            } else {
+                virtio->queue_num = 0;
+            }
+            break;
+        case VIRTIO_QUEUE_ALIGN:
+            virtio->queue_align = value;
             break;
         case VIRTIO_QUEUE_PFN:
             virtio->queue_pfn = value;
             break;
         case VIRTIO_QUEUE_NOTIFY:
             virtio->queue_notify = value;
+            pthread_cond_broadcast(&virtio->cond);
+            break;
+        case VIRTIO_INTERRUPT_ACK:
+            virtio->interrupt_status &= ~value;
             break;
         case VIRTIO_STATUS:
             virtio->status = value;
+            if (value == 0) {
+                /*
+                 * Reset: the driver sets the queue up again from scratch.
+                 * The I/O thread may be walking the rings, wait for it.
+                 */
+                virtio->queue_notify = -1;
+                while (virtio->busy) {
+                    pthread_cond_wait(&virtio->cond, &virtio->lock);
+                }
+                __atomic_store_n(&virtio->interrupting, false, __ATOMIC_RELEASE);
+                virtio->driver_features = 0;
+                virtio->queue_num = 0;
+                virtio->queue_align = PAGE_SIZE;
+                virtio->queue_pfn = 0;
+                virtio->interrupt_status = 0;
+                virtio->last_avail = 0;
+                virtio->used_idx = 0;
+            }
             break;
         }
+        pthread_mutex_unlock(&virtio->lock);
         return OK;
     default:
         return STORE_AMO_ACCESS_FAULT;
     }
 }
 
-inline bool
+/* Lock-free check for a completion, virtio_is_interrupting() consumes it. */
+bool
+virtio_may_interrupt(struct virtio* virtio) {
+    return __atomic_load_n(&virtio->interrupting, __ATOMIC_ACQUIRE);
+}
+
+/* Only one hart sees each completion. */
+bool
 virtio_is_interrupting(struct virtio* virtio) {
-    if (virtio->queue_notify != -1) {
-        virtio->queue_notify = -1;
-        return true;
+    return __atomic_exchange_n(&virtio->interrupting, false, __ATOMIC_ACQ_REL);
+}
+
+/* Block the I/O thread until the driver notifies the queue. */
+void
+virtio_wait_notify(struct virtio* virtio) {
+    pthread_mutex_lock(&virtio->lock);
+    virtio->busy = false;
+    pthread_cond_broadcast(&virtio->cond);
+    while (virtio->queue_notify == -1) {
+        pthread_cond_wait(&virtio->cond, &virtio->lock);
     }
-    return false;
+    virtio->queue_notify = -1;
+    virtio->busy = true;
+    pthread_mutex_unlock(&virtio->lock);
 }
 
-inline uint64_t
-virtio_desc_addr(struct virtio* virtio) {
-    return (uint64_t)virtio->queue_pfn * (uint64_t)virtio->page_size;
+/* Wait until the I/O thread has served every notification, see snapshot_save(). */
+void
+virtio_quiesce(struct virtio* virtio) {
+    pthread_mutex_lock(&virtio->lock);
+    while (virtio->busy || virtio->queue_notify != (uint32_t)-1) {
+        pthread_cond_wait(&virtio->cond, &virtio->lock);
+    }
+    pthread_mutex_unlock(&virtio->lock);
 }
 
-inline uint64_t
-virtio_disk_read(struct virtio* virtio, uint64_t addr) {
-    return virtio->disk[addr];
+/* Raise the interrupt once the used ring holds the completed requests. */
+void
+virtio_complete(struct virtio* virtio) {
+    pthread_mutex_lock(&virtio->lock);
+    virtio->interrupt_status |= 1;
+    pthread_mutex_unlock(&virtio->lock);
+    __atomic_store_n(&virtio->interrupting, true, __ATOMIC_RELEASE);
 }
 
-inline void
-virtio_disk_write(struct virtio* virtio, uint64_t addr, uint64_t value) {
-    virtio->disk[addr] = (uint8_t)value;
+/*
+ * Locate the rings of the queue in guest memory, using the legacy layout:
+ * the descriptor table at the queue's page, the available ring right after
+ * it and the used ring at the next QueueAlign boundary. Returns false if
+ * the driver has not set up a usable queue.
+ */
+bool
+virtio_queue(struct virtio* virtio, struct virtq* queue) {
+    pthread_mutex_lock(&virtio->lock);
+    uint64_t num = virtio->queue_num;
+    uint64_t align = virtio->queue_align;
+    queue->num = num;
+    queue->desc = (uint64_t)virtio->queue_pfn * (uint64_t)virtio->page_size;
+    queue->event_idx = (virtio->driver_features >> VIRTIO_F_EVENT_IDX) & 1;
+    pthread_mutex_unlock(&virtio->lock);
+
+    if (num == 0 || num > VIRTIO_QUEUE_MAX || (num & (num - 1)) != 0 || align == 0 || (align & (align - 1)) != 0) {
+        return false;
+    }
+    queue->avail = queue->desc + VIRTIO_VRING_DESC_SIZE * num;
+    queue->used = (queue->avail + 6 + 2 * num + align - 1) & ~(align - 1);
+    return true;
+}
+
+static uint64_t
+virtio_now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Return the disk bytes of a transfer, or NULL if it runs past the image. */
+static uint8_t*
+virtio_disk_range(struct virtio* virtio, uint64_t offset, uint64_t len) {
+    if (virtio->disk == NULL || offset > virtio->disk_size || len > virtio->disk_size - offset) {
+        return NULL;
+    }
+    return virtio->disk + offset;
+}
+
+/* Copy `len` bytes at `offset` of the disk into `buf`. */
+bool
+virtio_disk_read(struct virtio* virtio, uint64_t offset, uint8_t* buf, uint64_t len) {
+    uint8_t* disk = virtio_disk_range(virtio, offset, len);
+    if (disk == NULL) {
+        return false;
+    }
+    uint64_t start = virtio_now_ns();
+    memcpy(buf, disk, len);
+    virtio->dma_ns += virtio_now_ns() - start;
+    virtio->bytes_read += len;
+    return true;
+}
+
+/* Copy `len` bytes from `buf` to the disk at `offset`. */
+bool
+virtio_disk_write(struct virtio* virtio, uint64_t offset, const uint8_t* buf, uint64_t len) {
+    uint8_t* disk = virtio_disk_range(virtio, offset, len);
+    if (disk == NULL) {
+        return false;
+    }
+    uint64_t start = virtio_now_ns();
+    memcpy(disk, buf, len);
+    virtio->dma_ns += virtio_now_ns() - start;
+    virtio->bytes_written += len;
+    return true;
+}
+
+/* Write guest writes back to the image file, if it is shared. False if that failed. */
+bool
+virtio_flush(struct virtio* virtio) {
+    if (virtio->disk_shared && msync(virtio->disk, virtio->disk_size, MS_SYNC) != 0) {
+        printf("ERROR: failed to flush the disk: %s\n", strerror(errno));
+        return false;
+    }
+    return true;
 }
 
-inline uint64_t
-virtio_new_id(struct virtio* virtio) {
-    virtio->id += 1;
-    return virtio->id;
+/*
+ * Throughput is over the `seconds` the machine has been running, like
+ * bench.c reports it. The time spent copying is only part of a request.
+ */
+void
+virtio_dump_stats(struct virtio* virtio, FILE* f, double seconds) {
+    uint64_t bytes = virtio->bytes_read + virtio->bytes_written;
+    fprintf(f, "disk read=%"PRIu64" written=%"PRIu64" bytes  %.1f MB/s  copying %.3f s\n",
+        virtio->bytes_read,
+        virtio->bytes_written,
+        seconds > 0 ? bytes / seconds / 1e6 : 0.0,
+        virtio->dma_ns / 1e9);
 }